@@ -2,19 +2,117 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+
+/*
+ * Text engines. Both keep the text behind the same calls (create_buffer,
+ * free_buffer, load_file, buf_length, buf_cursor, move_cursor, insert_char,
+ * insert_text, delete_range, buf_chunk, buf_chunk_before, buf_record,
+ * buf_replay, buf_maps_file, buf_detach) with 64-bit offsets; pick one at
+ * build time:
+ *
+ *   gcc -DNEOTEX_ENGINE=NEOTEX_GAP neotex.c -o neotex
+ *
+ * NEOTEX_PIECE (default) a piece table: the file is mapped read-only and
+ *              typed text goes to an append-only add buffer, with a
+ *              balanced tree of pieces listing the text in order. Opening
+ *              costs the same for any file size, edits and cursor moves
+ *              cost O(log n) anywhere, and memory grows with the edits.
+ * NEOTEX_GAP   one allocation with a gap at the cursor, holding the whole
+ *              file; moving the cursor memmoves everything between the old
+ *              and new position.
+ *
+ * Each engine also keeps newline counts up to date as the text changes, so
+ * find_line_offset() and find_line_number() take O(log n) plus a scan of
+ * at most LINE_BLOCK bytes instead of counting from byte zero.
+ */
+#define NEOTEX_GAP   1
+#define NEOTEX_PIECE 2
+#ifndef NEOTEX_ENGINE
+#define NEOTEX_ENGINE NEOTEX_PIECE
+#endif
+
+/* Pages of a mapped file that faulted because the file shrank on disk */
+static volatile sig_atomic_t map_faults;
 
 #define INITIAL_CAPACITY 1024
 #define GAP_SIZE         512
+#define LINE_BLOCK       4096
+
+static int64_t count_newlines(const char *p, int64_t n)
+{
+    int64_t count = 0, i = 0;
+    /* Eight bytes at a time: after the mask a byte is 0x80 exactly where p held '\n' */
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        w ^= 0x0a0a0a0a0a0a0a0aull;
+        w  = ~(((w & 0x7f7f7f7f7f7f7f7full) + 0x7f7f7f7f7f7f7f7full) | w | 0x7f7f7f7f7f7f7f7full);
+        count += (int64_t)(((w >> 7) * 0x0101010101010101ull) >> 56);
+    }
+    for (; i < n; i++) count += p[i] == '\n';
+    return count;
+}
+
+#if NEOTEX_ENGINE == NEOTEX_GAP
 
 typedef struct {
-    char *buffer;
-    int   gap_start;
-    int   gap_end;
-    int   capacity;
-    int   length;
+    char    *buffer;
+    int64_t  gap_start;
+    int64_t  gap_end;
+    int64_t  capacity;
+    int64_t  length;
+    int64_t *line_tree;     /* Fenwick tree of newlines per LINE_BLOCK bytes of buffer, gap excluded */
+    int64_t  blocks;
 } GapBuffer;
 
-GapBuffer *create_buffer(int cap)
+typedef GapBuffer Buffer;
+
+static void line_tree_add(GapBuffer *gb, int64_t block, int64_t delta)
+{
+    for (block++; block <= gb->blocks; block += block & -block) gb->line_tree[block] += delta;
+}
+
+/* Newlines in blocks [0, block) */
+static int64_t line_tree_prefix(const GapBuffer *gb, int64_t block)
+{
+    int64_t sum = 0;
+    for (; block > 0; block -= block & -block) sum += gb->line_tree[block];
+    return sum;
+}
+
+/* Add sign times the newlines stored in buffer[from, to) to their blocks */
+static void count_range(GapBuffer *gb, int64_t from, int64_t to, int sign)
+{
+    while (from < to) {
+        int64_t block = from / LINE_BLOCK;
+        int64_t stop  = (block + 1) * LINE_BLOCK < to ? (block + 1) * LINE_BLOCK : to;
+        int64_t n     = count_newlines(gb->buffer + from, stop - from);
+        if (n) line_tree_add(gb, block, sign * n);
+        from = stop;
+    }
+}
+
+static void rebuild_line_tree(GapBuffer *gb)
+{
+    free(gb->line_tree);
+    gb->blocks    = (gb->capacity + LINE_BLOCK - 1) / LINE_BLOCK;
+    gb->line_tree = calloc((size_t)gb->blocks + 1, sizeof(int64_t));
+    if (!gb->line_tree) { perror("Fatal: out of memory"); exit(1); }
+    count_range(gb, 0, gb->gap_start, 1);
+    count_range(gb, gb->gap_end, gb->capacity, 1);
+}
+
+GapBuffer *create_buffer(int64_t cap)
 {
     if (cap <= 0) cap = INITIAL_CAPACITY;
     GapBuffer *gb = malloc(sizeof(GapBuffer));
@@ -25,15 +123,24 @@ GapBuffer *create_buffer(int cap)
     gb->gap_start = 0;
     gb->gap_end   = cap;
     gb->length    = 0;
+    gb->line_tree = NULL;
+    rebuild_line_tree(gb);
     return gb;
 }
 
+static void free_buffer(GapBuffer *gb)
+{
+    free(gb->line_tree);
+    free(gb->buffer);
+    free(gb);
+}
+
 static void grow_buffer(GapBuffer *gb)
 {
-    int new_cap     = gb->capacity * 2 + GAP_SIZE;
-    int post_len    = gb->capacity - gb->gap_end;
-    int new_gap_end = new_cap - post_len;
-    char *new_buf   = malloc((size_t)new_cap);
+    int64_t new_cap     = gb->capacity * 2 + GAP_SIZE;
+    int64_t post_len    = gb->capacity - gb->gap_end;
+    int64_t new_gap_end = new_cap - post_len;
+    char *new_buf       = malloc((size_t)new_cap);
     if (!new_buf) { perror("Fatal: out of memory"); exit(1); }
     memcpy(new_buf,               gb->buffer,              (size_t)gb->gap_start);
     memcpy(new_buf + new_gap_end, gb->buffer + gb->gap_end, (size_t)post_len);
@@ -41,20 +148,25 @@ static void grow_buffer(GapBuffer *gb)
     gb->buffer   = new_buf;
     gb->gap_end  = new_gap_end;
     gb->capacity = new_cap;
+    rebuild_line_tree(gb);
 }
 
-static void move_gap(GapBuffer *gb, int target)
+static void move_gap(GapBuffer *gb, int64_t target)
 {
     if (target < 0)          target = 0;
     if (target > gb->length) target = gb->length;
     if (target < gb->gap_start) {
-        int delta = gb->gap_start - target;
+        int64_t delta = gb->gap_start - target;
+        count_range(gb, target, gb->gap_start, -1);
         memmove(gb->buffer + gb->gap_end - delta, gb->buffer + target, (size_t)delta);
         gb->gap_start -= delta;
         gb->gap_end   -= delta;
+        count_range(gb, gb->gap_end, gb->gap_end + delta, 1);
     } else if (target > gb->gap_start) {
-        int delta = target - gb->gap_start;
+        int64_t delta = target - gb->gap_start;
+        count_range(gb, gb->gap_end, gb->gap_end + delta, -1);
         memmove(gb->buffer + gb->gap_start, gb->buffer + gb->gap_end, (size_t)delta);
+        count_range(gb, gb->gap_start, gb->gap_start + delta, 1);
         gb->gap_start += delta;
         gb->gap_end   += delta;
     }
@@ -63,38 +175,906 @@ static void move_gap(GapBuffer *gb, int target)
 static void insert_char(GapBuffer *gb, char c)
 {
     if (gb->gap_start == gb->gap_end) grow_buffer(gb);
+    if (c == '\n') line_tree_add(gb, gb->gap_start / LINE_BLOCK, 1);
     gb->buffer[gb->gap_start++] = c;
     gb->length++;
 }
 
-/* Gap-adjusted logical character read */
-static char buf_char(const GapBuffer *gb, int pos)
+/* Insert n bytes at the cursor and move the cursor past them */
+static void insert_text(GapBuffer *gb, const char *text, int64_t n)
+{
+    while (gb->gap_end - gb->gap_start < n) grow_buffer(gb);
+    memcpy(gb->buffer + gb->gap_start, text, (size_t)n);
+    count_range(gb, gb->gap_start, gb->gap_start + n, 1);
+    gb->gap_start += n;
+    gb->length    += n;
+}
+
+static void load_file(const char *filename, GapBuffer *gb)
+{
+    FILE *f = fopen(filename, "r");
+    if (!f) return;
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) insert_text(gb, chunk, (int64_t)n);
+    fclose(f);
+}
+
+static int64_t buf_length(const GapBuffer *gb) { return gb->length; }
+static int64_t buf_cursor(const GapBuffer *gb) { return gb->gap_start; }
+static void move_cursor(GapBuffer *gb, int64_t target) { move_gap(gb, target); }
+
+/* The whole file is read in, so it can always be rewritten in place */
+static int buf_maps_file(const GapBuffer *gb) { (void)gb; return 0; }
+static int buf_detach(GapBuffer *gb) { (void)gb; return 1; }
+
+/* Remove [start, end) and leave the cursor at start */
+static void delete_range(GapBuffer *gb, int64_t start, int64_t end)
+{
+    if (end > gb->length) end = gb->length;
+    move_gap(gb, start);
+    if (end <= gb->gap_start) return;
+    count_range(gb, gb->gap_end, gb->gap_end + (end - gb->gap_start), -1);
+    gb->gap_end += end - gb->gap_start;
+    gb->length  -= end - gb->gap_start;
+}
+
+/* Contiguous bytes from pos: sets *data and returns how many, 0 at the end */
+static int64_t buf_chunk(const GapBuffer *gb, int64_t pos, const char **data)
 {
     if (pos < 0 || pos >= gb->length) return 0;
-    if (pos < gb->gap_start) return gb->buffer[pos];
-    return gb->buffer[gb->gap_end + (pos - gb->gap_start)];
+    if (pos < gb->gap_start) { *data = gb->buffer + pos; return gb->gap_start - pos; }
+    *data = gb->buffer + gb->gap_end + (pos - gb->gap_start);
+    return gb->length - pos;
+}
+
+/* Contiguous bytes ending at pos: sets *data to their start and returns how many, 0 at the start */
+static int64_t buf_chunk_before(const GapBuffer *gb, int64_t pos, const char **data)
+{
+    if (pos <= 0 || pos > gb->length) return 0;
+    if (pos <= gb->gap_start) { *data = gb->buffer; return pos; }
+    *data = gb->buffer + gb->gap_end;
+    return pos - gb->gap_start;
+}
+
+/* Append the text of [start, end) to the undo record rec of size bytes and
+ * return its new size; with rec NULL, the most bytes that could take. The
+ * gap moves its bytes around, so the record is a copy of them. */
+static int64_t buf_record(const GapBuffer *gb, int64_t start, int64_t end, char *rec, int64_t size)
+{
+    if (!rec) return end - start;
+    int64_t n;
+    const char *data;
+    while (start < end && (n = buf_chunk(gb, start, &data)) > 0) {
+        if (n > end - start) n = end - start;
+        memcpy(rec + size, data, (size_t)n);
+        size  += n;
+        start += n;
+    }
+    return size;
+}
+
+/* Insert the text of an undo record at the cursor */
+static void buf_replay(GapBuffer *gb, const char *rec, int64_t size)
+{
+    insert_text(gb, rec, size);
+}
+
+/* Offset of the first byte of line target_line (1-based); the length past the last line */
+static int64_t find_line_offset(const GapBuffer *gb, int64_t target_line)
+{
+    if (target_line <= 1) return 0;
+    int64_t need = target_line - 1;
+    int64_t block = 0, step = 1;
+    while (step * 2 <= gb->blocks) step *= 2;
+    /* Fenwick descent to the block holding the need-th newline */
+    for (; step > 0; step /= 2) {
+        if (block + step <= gb->blocks && gb->line_tree[block + step] < need) {
+            block += step;
+            need  -= gb->line_tree[block];
+        }
+    }
+    if (block >= gb->blocks) return gb->length;
+    int64_t from = block * LINE_BLOCK;
+    int64_t to   = from + LINE_BLOCK < gb->capacity ? from + LINE_BLOCK : gb->capacity;
+    for (int64_t i = from; i < to; i++) {
+        if (i >= gb->gap_start && i < gb->gap_end) i = gb->gap_end;
+        if (i >= to) break;
+        if (gb->buffer[i] == '\n' && --need == 0) return (i < gb->gap_start ? i : i - (gb->gap_end - gb->gap_start)) + 1;
+    }
+    return gb->length;
+}
+
+/* 1-based line holding offset pos */
+static int64_t find_line_number(const GapBuffer *gb, int64_t pos)
+{
+    if (pos > gb->length) pos = gb->length;
+    int64_t phys  = pos < gb->gap_start ? pos : pos + (gb->gap_end - gb->gap_start);
+    int64_t block = phys / LINE_BLOCK;
+    int64_t line  = 1 + line_tree_prefix(gb, block);
+    int64_t from  = block * LINE_BLOCK;
+    if (from < gb->gap_start) line += count_newlines(gb->buffer + from, (phys < gb->gap_start ? phys : gb->gap_start) - from);
+    if (phys > gb->gap_end) {
+        int64_t start = from > gb->gap_end ? from : gb->gap_end;
+        line += count_newlines(gb->buffer + start, phys - start);
+    }
+    return line;
+}
+
+/* Every line is counted as the text changes, so this is always known */
+static int64_t known_line_number(const GapBuffer *gb, int64_t pos) { return find_line_number(gb, pos); }
+
+static void buffer_stats(const GapBuffer *gb, char *out, size_t size)
+{
+    double usage = (gb->capacity > 0) ? ((double)gb->length / gb->capacity) * 100.0 : 0.0;
+    snprintf(out, size, "Used: %" PRId64 "/%" PRId64 " bytes (%.1f%%)", gb->length, gb->capacity, usage);
+}
+
+#elif NEOTEX_ENGINE == NEOTEX_PIECE
+
+/* Where piece bytes live: the file, mapped read-only, or the add buffer */
+enum { SRC_FILE, SRC_ADD };
+
+typedef struct {
+    char    *data;
+    int64_t  len;
+    int64_t *lines;         /* lines[k]: newlines in data[0, k * LINE_BLOCK), for k <= counted */
+    int64_t  counted;
+} Source;
+
+/* A treap keyed by text position: in-order traversal spells the text, and
+ * every node knows how many bytes and newlines its subtree holds. Newlines
+ * in the mapped file are counted lazily, so lines and total_lines may be
+ * -1 until a line lookup needs them. */
+typedef struct Piece {
+    struct Piece *left;
+    struct Piece *right;
+    uint32_t      prio;
+    int           src;
+    int64_t       start;    /* offset into src */
+    int64_t       len;
+    int64_t       lines;    /* newlines in the piece */
+    int64_t       total;    /* bytes in this subtree */
+    int64_t       total_lines;
+} Piece;
+
+typedef struct {
+    Piece  *root;
+    Source  src[2];
+    int64_t map_len;
+    int     detached;       /* src[SRC_FILE] is a private copy, not the file */
+    int64_t add_cap;
+    int64_t cursor;
+    int64_t length;
+    int64_t pieces;
+} PieceTable;
+
+typedef PieceTable Buffer;
+
+/* The mapping the SIGBUS handler may patch, and the page size to round to */
+static char  *fault_map;
+static size_t fault_map_len;
+static size_t fault_page;
+
+static uint32_t piece_seed = 2463534242u;
+
+/* Count whole blocks of s up to block */
+static void source_count_to(Source *s, int64_t block)
+{
+    for (; s->counted < block; s->counted++) {
+        s->lines[s->counted + 1] = s->lines[s->counted] + count_newlines(s->data + s->counted * LINE_BLOCK, LINE_BLOCK);
+    }
+}
+
+/* Newlines in data[0, off) */
+static int64_t source_newlines_before(Source *s, int64_t off)
+{
+    int64_t block = off / LINE_BLOCK;
+    source_count_to(s, block);
+    return s->lines[block] + count_newlines(s->data + block * LINE_BLOCK, off - block * LINE_BLOCK);
+}
+
+/* Offset of the need-th newline from data[start] on, s->len if there are fewer */
+static int64_t source_find_newline(Source *s, int64_t start, int64_t need)
+{
+    int64_t goal = source_newlines_before(s, start) + need;
+    while (s->lines[s->counted] < goal && s->counted < s->len / LINE_BLOCK) source_count_to(s, s->counted + 1);
+    int64_t lo = start / LINE_BLOCK, hi = s->counted;
+    while (lo < hi) {
+        int64_t mid = (lo + hi + 1) / 2;
+        if (s->lines[mid] < goal) lo = mid; else hi = mid - 1;
+    }
+    need = goal - s->lines[lo];
+    const char *p = s->data + lo * LINE_BLOCK, *end = s->data + s->len;
+    while ((p = memchr(p, '\n', (size_t)(end - p))) && --need > 0) p++;
+    return p ? p - s->data : s->len;
+}
+
+/* Newlines in a span of s if they are counted already, else -1 */
+static int64_t source_span_lines(Source *s, int64_t start, int64_t len)
+{
+    if ((start + len) / LINE_BLOCK > s->counted) return -1;
+    return source_newlines_before(s, start + len) - source_newlines_before(s, start);
+}
+
+static Piece *piece_new(PieceTable *pt, int src, int64_t start, int64_t len)
+{
+    Piece *p = malloc(sizeof(Piece));
+    if (!p) { perror("Fatal: out of memory"); exit(1); }
+    piece_seed ^= piece_seed << 13;
+    piece_seed ^= piece_seed >> 17;
+    piece_seed ^= piece_seed << 5;
+    p->left  = p->right = NULL;
+    p->prio  = piece_seed;
+    p->src   = src;
+    p->start = start;
+    p->len   = len;
+    p->lines = source_span_lines(&pt->src[src], start, len);
+    p->total = len;
+    p->total_lines = p->lines;
+    pt->pieces++;
+    return p;
+}
+
+static int64_t piece_total(const Piece *p) { return p ? p->total : 0; }
+static int64_t piece_lines(const Piece *p) { return p ? p->total_lines : 0; }
+
+static void piece_update(Piece *p)
+{
+    p->total = piece_total(p->left) + p->len + piece_total(p->right);
+    if (piece_lines(p->left) < 0 || p->lines < 0 || piece_lines(p->right) < 0) p->total_lines = -1;
+    else p->total_lines = piece_lines(p->left) + p->lines + piece_lines(p->right);
+}
+
+/* Count whatever is still uncounted under p */
+static void piece_resolve(PieceTable *pt, Piece *p)
+{
+    if (!p || p->total_lines >= 0) return;
+    piece_resolve(pt, p->left);
+    piece_resolve(pt, p->right);
+    if (p->lines < 0) {
+        Source *s = &pt->src[p->src];
+        p->lines = source_newlines_before(s, p->start + p->len) - source_newlines_before(s, p->start);
+    }
+    piece_update(p);
+}
+
+static Piece *piece_merge(Piece *a, Piece *b)
+{
+    if (!a) return b;
+    if (!b) return a;
+    if (a->prio > b->prio) {
+        a->right = piece_merge(a->right, b);
+        piece_update(a);
+        return a;
+    }
+    b->left = piece_merge(a, b->left);
+    piece_update(b);
+    return b;
+}
+
+/* First pos bytes of t into *l, the rest into *r; a piece straddling pos is cut in two */
+static void piece_split(PieceTable *pt, Piece *t, int64_t pos, Piece **l, Piece **r)
+{
+    if (!t) { *l = *r = NULL; return; }
+    int64_t left = piece_total(t->left);
+    if (pos <= left) {
+        piece_split(pt, t->left, pos, l, &t->left);
+        piece_update(t);
+        *r = t;
+    } else if (pos >= left + t->len) {
+        piece_split(pt, t->right, pos - left - t->len, &t->right, r);
+        piece_update(t);
+        *l = t;
+    } else {
+        int64_t off  = pos - left;
+        Piece  *tail = piece_new(pt, t->src, t->start + off, t->len - off);
+        t->len   = off;
+        t->lines = t->lines >= 0 ? t->lines - tail->lines : -1;
+        *r       = piece_merge(tail, t->right);
+        t->right = NULL;
+        piece_update(t);
+        *l = t;
+    }
+}
+
+static void piece_free(PieceTable *pt, Piece *p)
+{
+    if (!p) return;
+    piece_free(pt, p->left);
+    piece_free(pt, p->right);
+    free(p);
+    pt->pieces--;
+}
+
+/* Grow the piece ending at pos over add[add_end, add_end + len) if those bytes follow it */
+static int piece_extend(Piece *t, int64_t pos, int64_t add_end, int64_t len, int64_t lines)
+{
+    if (!t) return 0;
+    int64_t left = piece_total(t->left);
+    int grown;
+    if (pos <= left) {
+        grown = piece_extend(t->left, pos, add_end, len, lines);
+    } else if (pos > left + t->len) {
+        grown = piece_extend(t->right, pos - left - t->len, add_end, len, lines);
+    } else if (pos == left + t->len && t->src == SRC_ADD && t->start + t->len == add_end) {
+        t->len   += len;
+        t->lines += lines;
+        grown = 1;
+    } else {
+        grown = 0;
+    }
+    if (grown) {
+        t->total += len;
+        if (t->total_lines >= 0) t->total_lines += lines;
+    }
+    return grown;
+}
+
+PieceTable *create_buffer(int64_t cap)
+{
+    if (cap <= 0) cap = INITIAL_CAPACITY;
+    PieceTable *pt = calloc(1, sizeof(PieceTable));
+    if (!pt) { perror("Fatal: malloc PieceTable"); exit(1); }
+    pt->src[SRC_ADD].data  = malloc((size_t)cap);
+    pt->src[SRC_ADD].lines = calloc((size_t)(cap / LINE_BLOCK) + 1, sizeof(int64_t));
+    pt->src[SRC_FILE].lines = calloc(1, sizeof(int64_t));
+    if (!pt->src[SRC_ADD].data || !pt->src[SRC_ADD].lines || !pt->src[SRC_FILE].lines) {
+        perror("Fatal: malloc buffer");
+        exit(1);
+    }
+    pt->add_cap = cap;
+    return pt;
+}
+
+static void free_buffer(PieceTable *pt)
+{
+    piece_free(pt, pt->root);
+    if (pt->map_len) munmap(pt->src[SRC_FILE].data, (size_t)pt->map_len);
+    fault_map = NULL;
+    free(pt->src[SRC_FILE].lines);
+    free(pt->src[SRC_ADD].lines);
+    free(pt->src[SRC_ADD].data);
+    free(pt);
+}
+
+/* Insert n bytes at the cursor and move the cursor past them */
+static void insert_text(PieceTable *pt, const char *text, int64_t n)
+{
+    Source *add = &pt->src[SRC_ADD];
+    if (n <= 0) return;
+    if (add->len + n > pt->add_cap) {
+        int64_t new_cap = pt->add_cap * 2 + GAP_SIZE;
+        while (new_cap < add->len + n) new_cap *= 2;
+        char *new_data     = realloc(add->data, (size_t)new_cap);
+        int64_t *new_lines = realloc(add->lines, (size_t)(new_cap / LINE_BLOCK + 1) * sizeof(int64_t));
+        if (!new_data || !new_lines) { perror("Fatal: out of memory"); exit(1); }
+        add->data    = new_data;
+        add->lines   = new_lines;
+        pt->add_cap  = new_cap;
+    }
+    int64_t at = add->len;
+    memcpy(add->data + at, text, (size_t)n);
+    add->len += n;
+    source_count_to(add, add->len / LINE_BLOCK);
+    int64_t lines = count_newlines(text, n);
+
+    /* Typing runs extend the piece before the cursor instead of adding one per insert */
+    if (pt->cursor == 0 || !piece_extend(pt->root, pt->cursor, at, n, lines)) {
+        Piece *l, *r;
+        piece_split(pt, pt->root, pt->cursor, &l, &r);
+        pt->root = piece_merge(piece_merge(l, piece_new(pt, SRC_ADD, at, n)), r);
+    }
+    pt->cursor += n;
+    pt->length += n;
+}
+
+static void insert_char(PieceTable *pt, char c)
+{
+    insert_text(pt, &c, 1);
+}
+
+/* Touching a page past the end of a file that was truncated after it was
+ * mapped raises SIGBUS. The pages from the faulting one to the end of the
+ * mapping are replaced with zeroed memory and the access is retried, so the
+ * text keeps its length and the missing part reads as NUL bytes; the main
+ * loop reports it. Faults anywhere else keep their default action. */
+static void map_fault_handler(int sig, siginfo_t *info, void *ctx)
+{
+    (void)ctx;
+    char *addr = info->si_addr;
+    if (fault_map && addr >= fault_map && addr < fault_map + fault_map_len) {
+        char  *page = fault_map + (size_t)(addr - fault_map) / fault_page * fault_page;
+        size_t len  = fault_map_len - (size_t)(page - fault_map);
+        if (mmap(page, len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+            map_faults = 1;
+            return;
+        }
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/* Map filename read-only as the first piece; nothing is read until it is
+ * shown or searched. The mapping is private but the pages still come from
+ * the file until they are read, so a file rewritten in place by another
+ * program shows its new bytes where they were not read yet, and a file
+ * truncated by one reads as NUL bytes past its new end. */
+static void load_file(const char *filename, PieceTable *pt)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        int64_t *lines = calloc((size_t)(st.st_size / LINE_BLOCK) + 1, sizeof(int64_t));
+        if (map != MAP_FAILED && lines) {
+            struct sigaction sa = { .sa_sigaction = map_fault_handler, .sa_flags = SA_SIGINFO };
+            sigemptyset(&sa.sa_mask);
+            sigaction(SIGBUS, &sa, NULL);
+            fault_map     = map;
+            fault_map_len = (size_t)st.st_size;
+            fault_page    = (size_t)sysconf(_SC_PAGESIZE);
+            Source *file = &pt->src[SRC_FILE];
+            free(file->lines);
+            file->data    = map;
+            file->len     = st.st_size;
+            file->lines   = lines;
+            file->counted = 0;
+            pt->map_len   = st.st_size;
+            pt->root      = piece_new(pt, SRC_FILE, 0, st.st_size);
+            pt->length    = st.st_size;
+            pt->cursor    = st.st_size;
+        } else {
+            perror("Error mapping file");
+            if (map != MAP_FAILED) munmap(map, (size_t)st.st_size);
+            free(lines);
+        }
+    }
+    close(fd);
 }
 
-static void auto_indent(GapBuffer *gb)
+static int64_t buf_length(const PieceTable *pt) { return pt->length; }
+static int64_t buf_cursor(const PieceTable *pt) { return pt->cursor; }
+
+static int buf_maps_file(const PieceTable *pt) { return pt->map_len && !pt->detached; }
+
+/* Copy the mapped file into anonymous memory at the same offsets, so the
+ * file itself can be rewritten without changing the text under the pieces */
+static int buf_detach(PieceTable *pt)
+{
+    if (!buf_maps_file(pt)) return 1;
+    void *copy = mmap(NULL, (size_t)pt->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (copy == MAP_FAILED) return 0;
+    memcpy(copy, pt->src[SRC_FILE].data, (size_t)pt->map_len);
+    munmap(pt->src[SRC_FILE].data, (size_t)pt->map_len);
+    fault_map = NULL;
+    pt->src[SRC_FILE].data = copy;
+    pt->detached           = 1;
+    return 1;
+}
+
+static void move_cursor(PieceTable *pt, int64_t target)
 {
-    if (gb->gap_start == 0) return;
-    int scan = gb->gap_start - 1;
+    if (target < 0)          target = 0;
+    if (target > pt->length) target = pt->length;
+    pt->cursor = target;
+}
+
+/* Remove [start, end) and leave the cursor at start */
+static void delete_range(PieceTable *pt, int64_t start, int64_t end)
+{
+    move_cursor(pt, start);
+    start = pt->cursor;
+    if (end > pt->length) end = pt->length;
+    if (end <= start) return;
+    Piece *l, *mid, *r;
+    piece_split(pt, pt->root, start, &l, &r);
+    piece_split(pt, r, end - start, &mid, &r);
+    piece_free(pt, mid);
+    pt->root    = piece_merge(l, r);
+    pt->length -= end - start;
+}
+
+/* Contiguous bytes from pos: sets *data and returns how many, 0 at the end */
+static int64_t buf_chunk(const PieceTable *pt, int64_t pos, const char **data)
+{
+    if (pos < 0 || pos >= pt->length) return 0;
+    const Piece *t = pt->root;
+    for (;;) {
+        int64_t left = piece_total(t->left);
+        if (pos < left) {
+            t = t->left;
+        } else if (pos >= left + t->len) {
+            pos -= left + t->len;
+            t = t->right;
+        } else {
+            *data = pt->src[t->src].data + t->start + (pos - left);
+            return t->len - (pos - left);
+        }
+    }
+}
+
+/* Contiguous bytes ending at pos: sets *data to their start and returns how many, 0 at the start */
+static int64_t buf_chunk_before(const PieceTable *pt, int64_t pos, const char **data)
+{
+    if (pos <= 0 || pos > pt->length) return 0;
+    pos--;
+    const Piece *t = pt->root;
+    for (;;) {
+        int64_t left = piece_total(t->left);
+        if (pos < left) {
+            t = t->left;
+        } else if (pos >= left + t->len) {
+            pos -= left + t->len;
+            t = t->right;
+        } else {
+            *data = pt->src[t->src].data + t->start;
+            return pos - left + 1;
+        }
+    }
+}
+
+/* Where undo records point: neither source changes under a piece */
+typedef struct {
+    int     src;
+    int64_t start;
+    int64_t len;
+} Span;
+
+/* Append the spans holding [start, end) to the undo record rec of size
+ * bytes and return its new size; with rec NULL, the most bytes that could
+ * take. A span continuing the last one extends it, so a typed run costs
+ * one span however long it gets. */
+static int64_t buf_record(const PieceTable *pt, int64_t start, int64_t end, char *rec, int64_t size)
+{
+    while (start < end) {
+        const Piece *t = pt->root;
+        int64_t pos = start;
+        for (;;) {
+            int64_t left = piece_total(t->left);
+            if (pos < left) {
+                t = t->left;
+            } else if (pos >= left + t->len) {
+                pos -= left + t->len;
+                t = t->right;
+            } else {
+                pos -= left;
+                break;
+            }
+        }
+        Span span = { t->src, t->start + pos, t->len - pos };
+        if (span.len > end - start) span.len = end - start;
+        start += span.len;
+        if (!rec) {
+            size += (int64_t)sizeof(Span);
+            continue;
+        }
+        Span last;
+        if (size > 0) memcpy(&last, rec + size - sizeof(Span), sizeof(Span));
+        if (size > 0 && last.src == span.src && last.start + last.len == span.start) {
+            last.len += span.len;
+            memcpy(rec + size - sizeof(Span), &last, sizeof(Span));
+        } else {
+            memcpy(rec + size, &span, sizeof(Span));
+            size += (int64_t)sizeof(Span);
+        }
+    }
+    return size;
+}
+
+/* Insert the text of an undo record at the cursor, as pieces of the
+ * sources it came from; nothing is copied */
+static void buf_replay(PieceTable *pt, const char *rec, int64_t size)
+{
+    Piece *l, *r;
+    piece_split(pt, pt->root, pt->cursor, &l, &r);
+    for (int64_t i = 0; i + (int64_t)sizeof(Span) <= size; i += (int64_t)sizeof(Span)) {
+        Span span;
+        memcpy(&span, rec + i, sizeof(Span));
+        l = piece_merge(l, piece_new(pt, span.src, span.start, span.len));
+        pt->cursor += span.len;
+        pt->length += span.len;
+    }
+    pt->root = piece_merge(l, r);
+}
+
+/* Offset of the first byte of line target_line (1-based); the length past the last line */
+static int64_t find_line_offset(PieceTable *pt, int64_t target_line)
+{
+    if (target_line <= 1) return 0;
+    int64_t need = target_line - 1, pos = 0;
+    Piece *t = pt->root;
+    while (t) {
+        piece_resolve(pt, t->left);
+        if (need <= piece_lines(t->left)) {
+            t = t->left;
+            continue;
+        }
+        need -= piece_lines(t->left);
+        pos  += piece_total(t->left);
+        /* Search the piece before counting all of it, so early lines of a big file stay cheap */
+        Source *s  = &pt->src[t->src];
+        int64_t at = t->lines >= 0 && need > t->lines ? s->len : source_find_newline(s, t->start, need);
+        if (at < t->start + t->len) return pos + (at - t->start) + 1;
+        if (t->lines < 0) t->lines = source_newlines_before(s, t->start + t->len) - source_newlines_before(s, t->start);
+        need -= t->lines;
+        pos  += t->len;
+        t = t->right;
+    }
+    return pt->length;
+}
+
+/* 1-based line holding offset pos */
+static int64_t find_line_number(PieceTable *pt, int64_t pos)
+{
+    int64_t line = 1;
+    Piece *t = pt->root;
+    while (t) {
+        int64_t left = piece_total(t->left);
+        if (pos < left) {
+            t = t->left;
+            continue;
+        }
+        piece_resolve(pt, t->left);
+        line += piece_lines(t->left);
+        pos  -= left;
+        Source *s = &pt->src[t->src];
+        if (pos < t->len) return line + source_newlines_before(s, t->start + pos) - source_newlines_before(s, t->start);
+        if (t->lines < 0) t->lines = source_newlines_before(s, t->start + t->len) - source_newlines_before(s, t->start);
+        line += t->lines;
+        pos  -= t->len;
+        t = t->right;
+    }
+    return line;
+}
+
+/* piece_resolve() using only blocks counted already; 0 if p needs more */
+static int piece_resolve_counted(PieceTable *pt, Piece *p)
+{
+    if (!p || p->total_lines >= 0) return 1;
+    if (!piece_resolve_counted(pt, p->left) || !piece_resolve_counted(pt, p->right)) return 0;
+    if (p->lines < 0) p->lines = source_span_lines(&pt->src[p->src], p->start, p->len);
+    if (p->lines < 0) return 0;
+    piece_update(p);
+    return 1;
+}
+
+/* find_line_number() if the newlines before pos are counted already, else
+ * -1: drawing uses this, so showing the end of a fresh file counts nothing */
+static int64_t known_line_number(PieceTable *pt, int64_t pos)
+{
+    int64_t line = 1;
+    Piece *t = pt->root;
+    while (t) {
+        int64_t left = piece_total(t->left);
+        if (pos < left) {
+            t = t->left;
+            continue;
+        }
+        if (!piece_resolve_counted(pt, t->left)) return -1;
+        line += piece_lines(t->left);
+        pos  -= left;
+        Source *s = &pt->src[t->src];
+        if (pos < t->len) {
+            if ((t->start + pos) / LINE_BLOCK > s->counted) return -1;
+            return line + source_newlines_before(s, t->start + pos) - source_newlines_before(s, t->start);
+        }
+        if (t->lines < 0) t->lines = source_span_lines(s, t->start, t->len);
+        if (t->lines < 0) return -1;
+        line += t->lines;
+        pos  -= t->len;
+        t = t->right;
+    }
+    return line;
+}
+
+static void buffer_stats(const PieceTable *pt, char *out, size_t size)
+{
+    snprintf(out, size, "Used: %" PRId64 " bytes in %" PRId64 " pieces, file %" PRId64 " mapped, add buffer %" PRId64 "/%" PRId64,
+             pt->length, pt->pieces, pt->map_len, pt->src[SRC_ADD].len, pt->add_cap);
+}
+
+#else
+#error "NEOTEX_ENGINE must be NEOTEX_GAP or NEOTEX_PIECE"
+#endif
+
+/* Logical character read */
+static char buf_char(const Buffer *gb, int64_t pos)
+{
+    const char *data;
+    return buf_chunk(gb, pos, &data) > 0 ? data[0] : 0;
+}
+
+/*
+ * Undo journal. Every edit appends an op to an append-only log, and a
+ * record of the text it inserted or deleted goes to an arena: the pieces
+ * that hold it in the piece engine, whatever the size of the text, and a
+ * copy of the bytes in the gap engine. Single-character inserts made by one
+ * command merge into one op. Ops of the same command share a group and
+ * undo together. The log plus the arena stay under NEOTEX_UNDO_CAP bytes;
+ * the oldest groups are dropped to make room.
+ */
+#ifndef NEOTEX_UNDO_CAP
+#define NEOTEX_UNDO_CAP (64LL << 20)
+#endif
+
+enum { OP_INSERT, OP_DELETE };
+
+typedef struct {
+    int     kind;
+    int64_t group;
+    int64_t pos;
+    int64_t len;
+    int64_t text;           /* offset of the op's record in the arena */
+    int64_t size;           /* bytes of the record */
+} Op;
+
+typedef struct {
+    Op     *ops;
+    int64_t count;
+    int64_t done;           /* ops [0, done) are applied, [done, count) can be redone */
+    int64_t ops_cap;
+    char   *arena;
+    int64_t arena_len;
+    int64_t arena_cap;
+    int64_t group;
+} Journal;
+
+static Journal journal;
+static char    message[128];
+
+static int64_t journal_size(int64_t first)
+{
+    int64_t bytes = first < journal.count ? journal.arena_len - journal.ops[first].text : 0;
+    return bytes + (journal.count - first) * (int64_t)sizeof(Op);
+}
+
+static void journal_clear(void)
+{
+    journal.count     = 0;
+    journal.done      = 0;
+    journal.arena_len = 0;
+}
+
+/* Room for n more arena bytes and one more op */
+static void journal_grow(int64_t n)
+{
+    if (journal.arena_len + n > journal.arena_cap) {
+        int64_t cap = journal.arena_cap * 2 + n + 4096;
+        char *arena = realloc(journal.arena, (size_t)cap);
+        if (!arena) { perror("Fatal: out of memory"); exit(1); }
+        journal.arena     = arena;
+        journal.arena_cap = cap;
+    }
+    if (journal.count == journal.ops_cap) {
+        int64_t cap = journal.ops_cap * 2 + 64;
+        Op *ops = realloc(journal.ops, (size_t)cap * sizeof(Op));
+        if (!ops) { perror("Fatal: out of memory"); exit(1); }
+        journal.ops     = ops;
+        journal.ops_cap = cap;
+    }
+}
+
+/* Make room for a new op with an n byte record; 0 if it cannot fit at all */
+static int journal_reserve(int64_t n)
+{
+    /* A new edit forgets everything that could be redone */
+    if (journal.done < journal.count) {
+        journal.arena_len = journal.ops[journal.done].text;
+        journal.count     = journal.done;
+    }
+    if (n + (int64_t)sizeof(Op) > NEOTEX_UNDO_CAP) {
+        journal_clear();
+        snprintf(message, sizeof(message), "Change too large to undo (cap %lld bytes); undo history cleared",
+                 (long long)NEOTEX_UNDO_CAP);
+        return 0;
+    }
+    if (journal_size(0) + n + (int64_t)sizeof(Op) > NEOTEX_UNDO_CAP) {
+        /* Drop whole groups from the front until half the cap is free */
+        int64_t first = 0;
+        while (first < journal.count && journal_size(first) + n + (int64_t)sizeof(Op) > NEOTEX_UNDO_CAP / 2) {
+            int64_t group = journal.ops[first].group;
+            while (first < journal.count && journal.ops[first].group == group) first++;
+        }
+        int64_t base = first < journal.count ? journal.ops[first].text : journal.arena_len;
+        memmove(journal.arena, journal.arena + base, (size_t)(journal.arena_len - base));
+        memmove(journal.ops, journal.ops + first, (size_t)(journal.count - first) * sizeof(Op));
+        journal.arena_len -= base;
+        journal.count     -= first;
+        journal.done       = journal.count;
+        for (int64_t i = 0; i < journal.count; i++) journal.ops[i].text -= base;
+    }
+    journal_grow(n);
+    return 1;
+}
+
+static void edit_insert_char(Buffer *gb, char c)
+{
+    int64_t pos = buf_cursor(gb);
+    insert_char(gb, c);
+    int64_t need = buf_record(gb, pos, pos + 1, NULL, 0);
+    Op *last = journal.done > 0 && journal.done == journal.count ? &journal.ops[journal.count - 1] : NULL;
+    if (last && last->kind == OP_INSERT && last->group == journal.group && last->pos + last->len == pos &&
+        journal_size(0) + need <= NEOTEX_UNDO_CAP) {
+        journal_grow(need);
+        last = &journal.ops[journal.count - 1];
+        last->size = buf_record(gb, pos, pos + 1, journal.arena + last->text, last->size);
+        last->len++;
+        journal.arena_len = last->text + last->size;
+    } else if (journal_reserve(need)) {
+        int64_t size = buf_record(gb, pos, pos + 1, journal.arena + journal.arena_len, 0);
+        journal.ops[journal.count++] = (Op){ OP_INSERT, journal.group, pos, 1, journal.arena_len, size };
+        journal.arena_len += size;
+        journal.done = journal.count;
+    }
+}
+
+/* delete_range() that keeps a record of the removed text for undo */
+static void edit_delete_range(Buffer *gb, int64_t start, int64_t end)
+{
+    if (start < 0) start = 0;
+    if (end > buf_length(gb)) end = buf_length(gb);
+    if (end > start && journal_reserve(buf_record(gb, start, end, NULL, 0))) {
+        int64_t size = buf_record(gb, start, end, journal.arena + journal.arena_len, 0);
+        journal.ops[journal.count++] = (Op){ OP_DELETE, journal.group, start, end - start, journal.arena_len, size };
+        journal.arena_len += size;
+        journal.done = journal.count;
+    }
+    delete_range(gb, start, end);
+}
+
+static void undo(Buffer *gb)
+{
+    if (journal.done == 0) { snprintf(message, sizeof(message), "Nothing to undo"); return; }
+    int64_t group = journal.ops[journal.done - 1].group;
+    while (journal.done > 0 && journal.ops[journal.done - 1].group == group) {
+        const Op *op = &journal.ops[--journal.done];
+        if (op->kind == OP_INSERT) {
+            delete_range(gb, op->pos, op->pos + op->len);
+        } else {
+            move_cursor(gb, op->pos);
+            buf_replay(gb, journal.arena + op->text, op->size);
+            move_cursor(gb, op->pos);
+        }
+    }
+}
+
+static void redo(Buffer *gb)
+{
+    if (journal.done == journal.count) { snprintf(message, sizeof(message), "Nothing to redo"); return; }
+    int64_t group = journal.ops[journal.done].group;
+    while (journal.done < journal.count && journal.ops[journal.done].group == group) {
+        const Op *op = &journal.ops[journal.done++];
+        if (op->kind == OP_INSERT) {
+            move_cursor(gb, op->pos);
+            buf_replay(gb, journal.arena + op->text, op->size);
+        } else {
+            delete_range(gb, op->pos, op->pos + op->len);
+        }
+    }
+}
+
+static void auto_indent(Buffer *gb)
+{
+    if (buf_cursor(gb) == 0) return;
+    int64_t scan = buf_cursor(gb) - 1;
     if (scan >= 0 && buf_char(gb, scan) == '\n') scan--;
 
     while (scan >= 0) {
-        int line_start = scan;
+        int64_t line_start = scan;
         while (line_start > 0 && buf_char(gb, line_start - 1) != '\n') line_start--;
 
         int has_content = 0;
-        for (int i = line_start; i <= scan; i++) {
+        for (int64_t i = line_start; i <= scan; i++) {
             char c = buf_char(gb, i);
             if (c != ' ' && c != '\t') { has_content = 1; break; }
         }
         if (has_content) {
-            for (int i = line_start; i <= scan; i++) {
+            for (int64_t i = line_start; i <= scan; i++) {
                 char c = buf_char(gb, i);
                 if (c != ' ' && c != '\t') break;
-                insert_char(gb, c);
+                edit_insert_char(gb, c);
             }
             return;
         }
@@ -102,69 +1082,340 @@ static void auto_indent(GapBuffer *gb)
     }
 }
 
-static int find_line_offset(const GapBuffer *gb, int target_line)
+/* Offset of the first byte of the line that holds pos */
+static int64_t line_start_offset(const Buffer *gb, int64_t pos)
 {
-    if (target_line <= 1) return 0;
-    int line = 1;
-    for (int i = 0; i < gb->gap_start; i++) {
-        if (gb->buffer[i] == '\n') { line++; if (line == target_line) return i + 1; }
+    int64_t n;
+    const char *data;
+    while ((n = buf_chunk_before(gb, pos, &data)) > 0) {
+        for (int64_t i = n; i > 0; i--) {
+            if (data[i - 1] == '\n') return pos - n + i;
+        }
+        pos -= n;
     }
-    for (int i = gb->gap_end; i < gb->capacity; i++) {
-        if (gb->buffer[i] == '\n') {
-            line++;
-            if (line == target_line) return gb->gap_start + (i + 1 - gb->gap_end);
+    return 0;
+}
+
+/* Offset just past the newline ending the line that holds pos */
+static int64_t next_line_offset(const Buffer *gb, int64_t pos)
+{
+    int64_t n;
+    const char *data;
+    while ((n = buf_chunk(gb, pos, &data)) > 0) {
+        const char *p = memchr(data, '\n', (size_t)n);
+        if (p) return pos + (p - data) + 1;
+        pos += n;
+    }
+    return buf_length(gb);
+}
+
+/* Write the whole text to fd and flush it to disk; 0 on error */
+static int write_text(int fd, const Buffer *gb)
+{
+    int64_t pos = 0, n;
+    const char *data;
+    while ((n = buf_chunk(gb, pos, &data)) > 0) {
+        int64_t done = 0;
+        while (done < n) {
+            ssize_t w = write(fd, data + done, (size_t)(n - done));
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0) return 0;
+            done += w;
         }
+        pos += n;
     }
-    return gb->length;
+    return fsync(fd) == 0;
 }
 
-static void load_file(const char *filename, GapBuffer *gb)
+/*
+ * Save through symlinks to the real file. A file the buffer still maps is
+ * replaced by writing a temporary beside it, with the same owner and mode,
+ * and renaming it over, so the mapped pages never change underneath. When
+ * that cannot keep the file's identity (other hard links, a directory we
+ * cannot write, an owner we cannot set) or nothing is mapped, the file is
+ * rewritten in place, after copying out whatever is still mapped.
+ */
+static void save_file(const char *filename, Buffer *gb)
 {
-    FILE *f = fopen(filename, "r");
-    if (!f) return;
-    int ch;
-    while ((ch = fgetc(f)) != EOF) insert_char(gb, (char)ch);
-    fclose(f);
+    char path[PATH_MAX];
+    if (!realpath(filename, path)) snprintf(path, sizeof(path), "%s", filename);
+
+    struct stat st;
+    if (buf_maps_file(gb) && stat(path, &st) == 0 && st.st_nlink == 1) {
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s", path);
+        char *slash = strrchr(dir, '/');
+        if (!slash)           strcpy(dir, ".");
+        else if (slash == dir) dir[1] = '\0';
+        else                  *slash = '\0';
+
+        char tmp[PATH_MAX + 8];
+        snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+        int fd = access(dir, W_OK) == 0 ? mkstemp(tmp) : -1;
+        if (fd >= 0 && fchown(fd, st.st_uid, st.st_gid) == 0 && fchmod(fd, st.st_mode & 07777) == 0) {
+            int ok = write_text(fd, gb);
+            if (close(fd) == 0 && ok && rename(tmp, path) == 0) return;
+            perror("Error saving file");
+            unlink(tmp);
+            return;
+        }
+        if (fd >= 0) { close(fd); unlink(tmp); }
+    }
+
+    if (!buf_detach(gb)) { perror("Error saving file"); return; }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) { perror("Error saving file"); return; }
+    int ok = write_text(fd, gb);
+    if (close(fd) != 0 || !ok) perror("Error saving file");
 }
 
-static void save_file(const char *filename, const GapBuffer *gb)
+/*
+ * The screen is drawn from the lines around the cursor only. Each frame is
+ * built in one buffer and sent with a single write(), and a row is only
+ * sent again when its text differs from the last frame, so the output per
+ * command does not grow with the file.
+ */
+#define HEADER_ROWS 3
+#define COUNT_ON_SHOW (1LL << 20)   /* texts up to this size are counted to number every frame */
+
+typedef struct {
+    char   *out;            /* frame being built */
+    size_t  out_len;
+    size_t  out_cap;
+    char  **rows;           /* text of every row in the last frame */
+    int     nrows;
+    int     ncols;
+    int64_t top;            /* offset of the first line in the window */
+    int     stale;          /* the terminal no longer shows the last frame */
+} Screen;
+
+static Screen screen = { .stale = 1 };
+
+static void out_append(const char *s, size_t n)
 {
-    FILE *out = fopen(filename, "w");
-    if (!out) { perror("Error saving file"); return; }
-    fwrite(gb->buffer,               1, (size_t)gb->gap_start,             out);
-    fwrite(gb->buffer + gb->gap_end, 1, (size_t)(gb->capacity - gb->gap_end), out);
-    fclose(out);
+    if (screen.out_len + n > screen.out_cap) {
+        size_t cap = screen.out_cap * 2 + n + 4096;
+        char *out  = realloc(screen.out, cap);
+        if (!out) { perror("Fatal: out of memory"); exit(1); }
+        screen.out     = out;
+        screen.out_cap = cap;
+    }
+    memcpy(screen.out + screen.out_len, s, n);
+    screen.out_len += n;
 }
 
-static void refresh_screen(const char *filename, const GapBuffer *gb)
+static void screen_size(int *rows, int *cols)
 {
-    printf("\033[2J\033[H");
-    double usage = (gb->capacity > 0) ? ((double)gb->length / gb->capacity) * 100.0 : 0.0;
-    printf("--- STATUS [%s] | Used: %d/%d bytes (%.1f%%) ---\n", filename, gb->length, gb->capacity, usage);
-    printf("--- :m [L] | :d [L] | :d *[L] | :d *x y* | :t | :n | :w | ESVA ---\n\n");
+    struct winsize ws;
+    *rows = 24;
+    *cols = 80;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0 && ws.ws_col > 0) {
+        *rows = ws.ws_row;
+        *cols = ws.ws_col;
+    } else {
+        const char *r = getenv("LINES"), *c = getenv("COLUMNS");
+        if (r && atoi(r) > 0) *rows = atoi(r);
+        if (c && atoi(c) > 0) *cols = atoi(c);
+    }
+    if (*rows < HEADER_ROWS + 5) *rows = HEADER_ROWS + 5;
+    if (*cols < 20)              *cols = 20;
+}
 
-    int line = 1;
-    printf("%2d: ", line);
-    for (int i = 0; i < gb->gap_start; i++) {
-        putchar(gb->buffer[i]);
-        if (gb->buffer[i] == '\n') printf("%2d: ", ++line);
+/* Queue row r (0-based) if its text changed since the last frame */
+static void set_row(int r, const char *text)
+{
+    if (!screen.stale && strcmp(screen.rows[r], text) == 0) return;
+    char move[32];
+    int n = snprintf(move, sizeof(move), "\033[%d;1H", r + 1);
+    out_append(move, (size_t)n);
+    out_append(text, strlen(text));
+    out_append("\033[K", 3);
+    free(screen.rows[r]);
+    screen.rows[r] = strdup(text);
+    if (!screen.rows[r]) { perror("Fatal: out of memory"); exit(1); }
+}
+
+/* Display width of byte c at column col; continuation bytes of UTF-8 take none */
+static int cell_width(unsigned char c, int col)
+{
+    if (c == '\t')               return 8 - col % 8;
+    if (c >= 0x80 && c < 0xc0)   return 0;
+    return 1;
+}
+
+/* A header row: text clipped to cols cells, control bytes shown as '?' */
+static void header_row(char *row, size_t cap, const char *text, int cols)
+{
+    size_t n   = 0;
+    int    col = 0;
+    for (const unsigned char *p = (const unsigned char *)text; *p && n + 1 < cap; p++) {
+        int w = cell_width(*p, col);
+        if (col + w > cols) break;
+        row[n++] = *p < 0x20 && *p != '\t' ? '?' : (char)*p;
+        col += w;
     }
-    printf("\033[7m|\033[0m");
-    for (int i = gb->gap_end; i < gb->capacity; i++) {
-        putchar(gb->buffer[i]);
-        if (gb->buffer[i] == '\n') printf("%2d: ", ++line);
+    row[n] = '\0';
+}
+
+/* Line number ('?' while not counted), then [start, end) clipped to cols
+ * cells, with the cursor marker; a cursor past the right edge scrolls its
+ * own row sideways */
+static void render_line(const Buffer *gb, int64_t line, int64_t start, int64_t end, int64_t cursor,
+                        int cols, char *row, size_t cap)
+{
+    int n     = line > 0 ? snprintf(row, cap, "%2" PRId64 ": ", line) : snprintf(row, cap, " ?: ");
+    int width = cols - n;
+    int col   = 0;
+    int64_t from = start;
+
+    if (cursor >= start && cursor <= end) {
+        int64_t i = start;
+        for (; i < cursor && col < width && i - start < 4 * (int64_t)width; i++) col += cell_width((unsigned char)buf_char(gb, i), col);
+        if (i < cursor || col >= width) {
+            int back = 0;
+            for (from = cursor; from > start; from--) {
+                unsigned char c = (unsigned char)buf_char(gb, from - 1);
+                int w = c == '\t' ? 8 : cell_width(c, 0);
+                if (back + w > width / 2) break;
+                back += w;
+            }
+            while (from < cursor && cell_width((unsigned char)buf_char(gb, from), 0) == 0) from++;
+        }
+        col = 0;
     }
-    putchar('\n');
+
+    int full = 0;
+    for (int64_t pos = from; !full; ) {
+        if (pos == cursor) {
+            if (col + 1 > width) break;
+            n += snprintf(row + n, cap - (size_t)n, "\033[7m|\033[0m");
+            col++;
+        }
+        if (pos >= end) break;
+        const char *data;
+        int64_t len = buf_chunk(gb, pos, &data);
+        if (len > end - pos) len = end - pos;
+        if (cursor > pos && cursor - pos < len) len = cursor - pos;
+        for (int64_t i = 0; i < len; i++) {
+            unsigned char c = (unsigned char)data[i];
+            int w = cell_width(c, col);
+            if (col + w > width || (size_t)n + 16 >= cap) { full = 1; break; }
+            if (c == '\t') {
+                for (int k = 0; k < w; k++) row[n++] = ' ';
+            } else {
+                row[n++] = (c < 0x20 || c == 0x7f) ? '?' : (char)c;
+            }
+            col += w;
+        }
+        pos += len;
+    }
+    row[n] = '\0';
+}
+
+static void refresh_screen(const char *filename, Buffer *gb)
+{
+    int rows, cols;
+    screen_size(&rows, &cols);
+    if (rows != screen.nrows || cols != screen.ncols) {
+        for (int r = 0; r < screen.nrows; r++) free(screen.rows[r]);
+        free(screen.rows);
+        screen.rows = calloc((size_t)rows, sizeof(char *));
+        if (!screen.rows) { perror("Fatal: out of memory"); exit(1); }
+        screen.nrows = rows;
+        screen.ncols = cols;
+        screen.stale = 1;
+    }
+    screen.out_len = 0;
+    if (screen.stale) out_append("\033[H\033[2J", 7);
+
+    /* Rows left for text: the header above, the command prompt and one
+     * spare row below, so the newline after a command never scrolls */
+    int     text_rows = rows - HEADER_ROWS - 2;
+    int64_t cursor    = buf_cursor(gb);
+    int64_t length    = buf_length(gb);
+
+    /* The window is anchored by offset and moved by scanning for newlines
+     * around the cursor, so drawing reads only the lines it shows; in a
+     * large text, line numbers are shown where they are known without
+     * counting more */
+    int64_t cur_start = line_start_offset(gb, cursor);
+    if (screen.top > length) screen.top = length;
+    screen.top = line_start_offset(gb, screen.top);
+    if (cur_start < screen.top) {
+        screen.top = cur_start;
+    } else {
+        int64_t line_at = screen.top;
+        for (int r = 1; r < text_rows && line_at < cur_start; r++) line_at = next_line_offset(gb, line_at);
+        if (line_at < cur_start) {
+            screen.top = cur_start;
+            for (int r = 1; r < text_rows && screen.top > 0; r++) screen.top = line_start_offset(gb, screen.top - 1);
+        }
+    }
+    int     count    = length <= COUNT_ON_SHOW;
+    int64_t cur_line = count ? find_line_number(gb, cursor) : known_line_number(gb, cursor);
+    int64_t top_line = count ? find_line_number(gb, screen.top) : known_line_number(gb, screen.top);
+
+    size_t cap = (size_t)cols * 4 + 64;
+    char  *row = malloc(cap);
+    char   stats[128], text[512];
+    if (!row) { perror("Fatal: out of memory"); exit(1); }
+    buffer_stats(gb, stats, sizeof(stats));
+    char ln[24];
+    if (cur_line > 0) snprintf(ln, sizeof(ln), "%" PRId64, cur_line); else snprintf(ln, sizeof(ln), "?");
+    snprintf(text, sizeof(text), "--- STATUS [%s] | Ln %s | %s ---", filename, ln, stats);
+    header_row(row, cap, text, cols);
+    set_row(0, row);
+    header_row(row, cap, "--- :m [L] | :d [L] | :d *[L] | :d *x y* | :t | :n | :u | :r | :w | ESVA ---", cols);
+    set_row(1, row);
+    header_row(row, cap, message, cols);
+    set_row(2, row);
+    message[0] = '\0';
+
+    int64_t start = screen.top;
+    for (int r = 0; r < text_rows; r++) {
+        if (start > length) {
+            set_row(HEADER_ROWS + r, "");
+            continue;
+        }
+        /* The last line is the one without a newline, maybe empty */
+        int64_t next = next_line_offset(gb, start);
+        int     last = next == length && (next == start || buf_char(gb, next - 1) != '\n');
+        render_line(gb, top_line > 0 ? top_line + r : -1, start, last ? length : next - 1, cursor, cols, row, cap);
+        set_row(HEADER_ROWS + r, row);
+        start = last ? length + 1 : next;
+    }
+    free(row);
+
+    char move[32];
+    int n = snprintf(move, sizeof(move), "\033[%d;1H\033[J", rows - 1);
+    out_append(move, (size_t)n);
+    screen.stale = 0;
+
     fflush(stdout);
+    size_t done = 0;
+    while (done < screen.out_len) {
+        ssize_t w = write(STDOUT_FILENO, screen.out + done, screen.out_len - done);
+        if (w <= 0) break;
+        done += (size_t)w;
+    }
+}
+
+/* Tell once that the mapped file shrank under the buffer; 1 if it did */
+static int report_map_faults(void)
+{
+    if (!map_faults) return 0;
+    map_faults = 0;
+    snprintf(message, sizeof(message), "File shrank on disk: text past its new end reads as NUL bytes");
+    return 1;
 }
 
-static int parse_int(const char *s, int *out)
+static int parse_int(const char *s, int64_t *out)
 {
     if (!s || !*s) return 0;
     char *end;
-    long v = strtol(s, &end, 10);
+    long long v = strtoll(s, &end, 10);
     if (end == s || v < 0) return 0;
-    *out = (int)v;
+    *out = (int64_t)v;
     return 1;
 }
 
@@ -172,72 +1423,73 @@ int main(void)
 {
     char filename[256];
     char line[1024];
-    GapBuffer *gb = create_buffer(INITIAL_CAPACITY);
+    Buffer *gb = create_buffer(INITIAL_CAPACITY);
 
     printf("Enter filename: ");
     fflush(stdout);
-    if (scanf("%255s", filename) != 1) { free(gb->buffer); free(gb); return 1; }
+    if (scanf("%255s", filename) != 1) { free_buffer(gb); return 1; }
     getchar();
 
     load_file(filename, gb);
 
     while (1) {
+        report_map_faults();
         refresh_screen(filename, gb);
+        if (report_map_faults()) refresh_screen(filename, gb);
         if (!fgets(line, sizeof(line), stdin)) break;
 
         size_t len = strlen(line);
         if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+        /* An echoed command wider than the screen wrapped and maybe scrolled it */
+        if ((int)len >= screen.ncols - 1) screen.stale = 1;
 
         if (strcmp(line, "ESVA") == 0) break;
 
+        journal.group++;
+
         if (strcmp(line, ":w") == 0) { save_file(filename, gb); continue; }
 
         if (strncmp(line, ":m ", 3) == 0) {
-            int target = 1;
-            if (parse_int(line + 3, &target)) move_gap(gb, find_line_offset(gb, target));
+            int64_t target = 1;
+            if (parse_int(line + 3, &target)) move_cursor(gb, find_line_offset(gb, target));
             continue;
         }
 
         if (strncmp(line, ":d ", 3) == 0) {
             const char *cmd = line + 3;
             if (*cmd == '*') {
-                int x = -1, y = -1;
-                if (sscanf(cmd + 1, "%d %d", &x, &y) == 2 && x >= 1 && y >= x) {
-                    int start = find_line_offset(gb, x);
-                    int end   = find_line_offset(gb, y + 1);
-                    if (end > start) { move_gap(gb, start); gb->gap_end += (end - start); gb->length -= (end - start); }
+                int64_t x = -1, y = -1;
+                if (sscanf(cmd + 1, "%" SCNd64 " %" SCNd64, &x, &y) == 2 && x >= 1 && y >= x) {
+                    int64_t start = find_line_offset(gb, x);
+                    int64_t end   = find_line_offset(gb, y + 1);
+                    if (end > start) edit_delete_range(gb, start, end);
                 } else if (x >= 1) {
-                    int start   = find_line_offset(gb, x);
-                    int deleted = gb->length - start;
-                    move_gap(gb, start);
-                    gb->gap_end = gb->capacity;
-                    gb->length -= deleted;
+                    edit_delete_range(gb, find_line_offset(gb, x), buf_length(gb));
                 }
             } else {
-                int target = -1;
+                int64_t target = -1;
                 if (parse_int(cmd, &target) && target >= 1) {
-                    move_gap(gb, find_line_offset(gb, target));
-                    while (gb->gap_end < gb->capacity) {
-                        char c = gb->buffer[gb->gap_end++];
-                        gb->length--;
-                        if (c == '\n') break;
-                    }
+                    int64_t start = find_line_offset(gb, target);
+                    edit_delete_range(gb, start, next_line_offset(gb, start));
                 }
             }
             continue;
         }
 
-        if (strcmp(line, ":t") == 0) { insert_char(gb, '\t'); continue; }
+        if (strcmp(line, ":u") == 0) { undo(gb); continue; }
+
+        if (strcmp(line, ":r") == 0) { redo(gb); continue; }
+
+        if (strcmp(line, ":t") == 0) { edit_insert_char(gb, '\t'); continue; }
 
-        if (strcmp(line, ":n") == 0) { insert_char(gb, '\n'); auto_indent(gb); continue; }
+        if (strcmp(line, ":n") == 0) { edit_insert_char(gb, '\n'); auto_indent(gb); continue; }
 
-        for (size_t i = 0; i < len; i++) insert_char(gb, line[i]);
-        insert_char(gb, '\n');
+        for (size_t i = 0; i < len; i++) edit_insert_char(gb, line[i]);
+        edit_insert_char(gb, '\n');
         if (len > 0) auto_indent(gb);
     }
 
     save_file(filename, gb);
-    free(gb->buffer);
-    free(gb);
+    free_buffer(gb);
     return 0;
 }
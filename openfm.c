@@ -1,5 +1,7 @@
 //this only works for ubuntu!
 
+#define _GNU_SOURCE // copy_file_range, renameat2
+
 #include <ncurses.h>
 #include <dirent.h>
 #include <sys/stat.h>
@@ -9,8 +11,28 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <setjmp.h>
 
 void load_directory(const char *path);
+void wait_for_directory_load();
+void refresh_listing();
+void search_publish(int done);
+void find_project_root(const char *dir, char *root, size_t len);
 
 /*
 ================================================================================
@@ -25,6 +47,7 @@ NAVIGATION:
   j / k           - Navigate (vim-style)
   Enter           - Open file in editor / Enter directory
   Backspace       - Go to parent directory
+  ESC             - Stop loading a large directory (keeps what has arrived)
   
 FILE OPERATIONS:
   Ctrl+D          - Delete selected file/folder
@@ -37,8 +60,11 @@ FILE CREATION:
   
 SEARCH:
   /               - Open search interface
+  Ctrl+G          - (in search) Include or skip ignored files
+  Ctrl+T          - (in search) Switch between text, terms and regex
   
 GENERAL:
+  i               - Show directory cache statistics
   q / Q           - Quit the file manager
 
 MULTI-SELECT MOVE MODE (Ctrl+X):
@@ -71,48 +97,428 @@ NOTES:
   - Folders are sorted before files
   - Hidden files (starting with .) are not shown
   - File sizes are displayed in human-readable format (B, KB, MB, GB)
-  - Search includes folder names, file names, and file contents (up to 1MB)
+  - Sizes show as "..." until the background worker has fetched them;
+    start with --eager to stat everything before the first frame
+  - Recently visited listings are cached while the directory is unchanged;
+    --cache-mb N sets the cache memory budget (default 64)
+  - The listing follows changes made by other programs as they happen
+  - Copies (Ctrl+E) use one thread per CPU; --copy-threads N overrides it
+  - Moves (Ctrl+X) never overwrite: an existing name in the destination is
+    reported and left alone. Moves to another filesystem copy, then delete
+  - Search includes folder names, file names, and file contents of files up
+    to 64MB; --search-max-mb N changes the limit
+  - Binary files are skipped; UTF-16 files (with or without a BOM) are
+    searched as text
+  - Search skips what .gitignore, .ignore and .git/info/exclude exclude;
+    Ctrl+G in the search window includes those files, or skips them again
+  - Names match fuzzily: the query's letters in order, so "fb" finds
+    FooBar.h. The best scoring names are listed first, then contents
+  - Ctrl+T in the search window reads the query as "|"-separated terms
+    (any one matches) or as a regex (see SEARCH PATTERNS below)
   - Maximum search depth: 3 levels
+  - Every match is kept, not just the 100 listed, so typing more narrows
+    them down instead of searching the tree again
+  - Search runs in the background: results fill in while it scans, and
+    every keystroke cancels the scan in progress
+  - Folders and files are searched by one thread per CPU; --search-threads N
+    overrides it
+  - --index keeps a trigram index per project so content search only reads
+    files that can match (see TRIGRAM INDEX below)
   
 ================================================================================
 */
 
-#define MAX_ENTRIES 1000
 #define MAX_PATH 4096
-#define MAX_SEARCH_RESULTS 100
-int selected_for_move[MAX_ENTRIES] = {0};
+#define MAX_SEARCH_RESULTS 100       // results listed in the search window
+#define SEARCH_MAX_MATCHES (1 << 20) // matches kept for refining a query
+#define SEARCH_READ_SMALL (64 * 1024) // smaller files are read(), larger ones mapped under a SIGBUS guard
+// Entries marked for moving, by name: picking the destination reloads the
+// listing, so entry indexes do not survive until the move runs
+char **move_names = NULL;
+unsigned char *move_is_dir = NULL;
 int move_count = 0;
 
 typedef struct {
-    char display[512];
-    char path[MAX_PATH];
+    char *display;
+    char *path;
+    int shown_off; // the part of path shown in display
     int type; // 0=folder, 1=filename, 2=content match
     int is_dir;
+    int score; // name matches: fuzzy_score(), higher is better
+    int display_len; // strlen(display), so ranking does not measure it per comparison
 } SearchResult;
 
+/*
+ * Directory listing store.
+ *
+ * Entries are small fixed-size records; names live in one contiguous arena
+ * and are referenced by offset, so the arena can grow (and move) freely.
+ * Full paths are never stored - entry_path() joins listing_dir and the name
+ * when one is actually needed. Both arrays grow geometrically and are reused
+ * across loads, so a listing costs roughly 16 bytes per entry plus its names.
+ */
 typedef struct {
-    char name[256];
-    char path[MAX_PATH];
-    int is_dir;
+    uint32_t name_off;  // offset of the NUL-terminated name in name_arena
+    uint16_t name_len;
+    uint8_t is_dir;
+    uint8_t flags;      // ENTRY_* bits
     off_t size;
 } Entry;
 
-Entry entries[MAX_ENTRIES];
+#define ENTRY_SIZE_PENDING 0x01 // size not fetched yet, see ensure_entry_size()
+#define ENTRY_TYPE_PENDING 0x02 // d_type was no help; sorted as a file until resolved
+#define ENTRY_SIZE_STALE   0x04 // size came from the listing cache; shown, but re-fetched
+#define ENTRY_META_PENDING (ENTRY_SIZE_PENDING | ENTRY_TYPE_PENDING | ENTRY_SIZE_STALE)
+
+#define UI_TICK_MS 100          // redraw interval while background work is in flight
+#define META_BATCH 32           // entries the metadata worker stats per lock round
+#define LOADER_BUF (1 << 20)    // getdents64 batch size used by the directory loader
+#define DIR_CACHE_MAX_DIRS 256  // listings kept by the directory cache, whatever their size
+#define JOB_MAX_ERRORS 64       // failures a file job remembers for its final report
+#define COPY_CHUNK (8 << 20)    // bytes per copy_file_range/sendfile call, between cancel checks
+#define COPY_BUF (1 << 20)      // aligned buffer for the read/write fallback
+#define COPY_SPLIT ((off_t)256 << 20) // files this large are copied in chunks by several workers
+
+Entry *entries = NULL;
 int entry_count = 0;
+int entry_capacity = 0;
+char *name_arena = NULL;
+size_t name_arena_len = 0;
+size_t name_arena_cap = 0;
+char listing_dir[MAX_PATH]; // directory the current listing was loaded from
+int listing_fd = -1;        // open descriptor of listing_dir, for fstatat()
+
+/*
+ * Lazy metadata. With lazy_metadata set, load_directory() only enumerates
+ * names and the metadata worker fills in sizes (and types d_type could not
+ * answer) in the background, starting with the rows around meta_focus.
+ * The worker reads and writes entries only under listing_lock, and the main
+ * thread holds it whenever it rebuilds or reorders the listing; bumping
+ * listing_generation makes the worker drop results for the old layout.
+ */
+int lazy_metadata = 1;
+pthread_mutex_t listing_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t meta_cond = PTHREAD_COND_INITIALIZER;
+unsigned long listing_generation = 0;
+int meta_pending = 0;       // entries still carrying a *_PENDING flag
+int meta_focus = 0;         // first row of the viewport
+int meta_window = 64;       // rows around meta_focus served first
+int meta_cursor = 0;        // sweep position for everything else
+int listing_resort_needed = 0;
+
+/*
+ * Streaming enumeration. The loader thread reads getdents64 batches and
+ * stages them (as Entry records naming staged_names) under listing_lock;
+ * the main thread merges staged entries into the sorted listing between
+ * frames. Bumping load_generation cancels a loader that is still running.
+ */
+pthread_cond_t load_cond = PTHREAD_COND_INITIALIZER;
+unsigned long load_generation = 0;
+int dir_loading = 0;        // a loader is still enumerating listing_dir
+int listing_partial = 0;    // the user cancelled the load with ESC
+char listing_notice[64] = ""; // why the listing changed folders by itself, shown until the next load
+Entry *staged = NULL;
+int staged_count = 0;
+int staged_capacity = 0;
+char *staged_names = NULL;
+size_t staged_names_len = 0;
+size_t staged_names_cap = 0;
+struct stat listing_stat;   // directory stat taken before enumeration, for the cache
+int listing_has_stat = 0;
+
+// inotify watch on listing_dir; its events are applied as deltas once the load is done
+int watch_fd = -1;
+int watch_wd = -1;
+// The parent of listing_dir: while listing_fd holds the folder open, the
+// kernel sends IN_DELETE_SELF only at the last close, so a delete is seen here
+int watch_parent_wd = -1;
+
+/*
+ * Directory listing cache. Completed listings are kept in an LRU list keyed
+ * by (dev, inode) and are only reused while the directory's mtime and ctime
+ * still match the values seen before it was enumerated. Memory is bounded by
+ * dir_cache_budget (--cache-mb); the least recently used listings go first.
+ */
+typedef struct DirCacheEntry {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct timespec ctime;
+    Entry *entries;         // real entries only, names rebased onto `names`
+    int count;
+    char *names;
+    size_t names_len;
+    size_t bytes;
+    struct DirCacheEntry *prev, *next;
+} DirCacheEntry;
+
+DirCacheEntry *dir_cache_head = NULL; // most recently used
+DirCacheEntry *dir_cache_tail = NULL;
+int dir_cache_count = 0;
+size_t dir_cache_bytes = 0;
+size_t dir_cache_budget = 64u << 20;
+unsigned long dir_cache_hits = 0;
+unsigned long dir_cache_misses = 0;
+unsigned long dir_cache_evictions = 0;
 int selected = 0;
 int scroll_offset = 0;
 char current_dir[MAX_PATH];
 
-SearchResult search_results[MAX_SEARCH_RESULTS];
+// Every match of search_query from search_root, sorted; longer queries
+// that contain search_query re-check only these: names are rescored and
+// content hits re-read on the pool
+SearchResult *search_results = NULL;
 int search_result_count = 0;
+int search_result_cap = 0;
+int search_truncated = 0; // stopped at SEARCH_MAX_MATCHES, refining could miss matches
+char search_query[256] = "";
+char search_root[MAX_PATH] = "";
+int search_ignored = 1;         // whether search_results skipped ignored entries
+int search_query_mode = 0;      // how search_query was read: SEARCH_TEXT, _TERMS or _REGEX
+pthread_mutex_t search_results_lock = PTHREAD_MUTEX_INITIALIZER; // search threads add concurrently
+// Best MAX_SEARCH_RESULTS of search_results[0, search_top_seen), as a heap
+// with the worst on top; results are only appended during a search, so
+// each publish pushes just the new ones. Under search_results_lock.
+int search_top[MAX_SEARCH_RESULTS];
+int search_top_count = 0;
+int search_top_seen = 0;
+int search_workers = 0;         // --search-threads, 0 = one per CPU
+
+// The search itself runs on a worker thread. The window asks for a query by
+// bumping search_generation, which also cancels the scan in progress; the
+// worker publishes the best MAX_SEARCH_RESULTS matches into search_view.
+pthread_mutex_t search_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t search_cond = PTHREAD_COND_INITIALIZER;
+atomic_uint search_generation;
+unsigned search_running = 0;    // generation the worker is searching for
+char search_request[256];
+char search_request_dir[MAX_PATH];
+int search_request_mode = 0;
+int search_request_ignore = 1;
+int search_worker_started = 0;
+SearchResult search_view[MAX_SEARCH_RESULTS];
+int search_view_count = 0;
+int search_view_total = 0;
+int search_view_truncated = 0;
+int search_view_done = 1;
+unsigned search_view_generation = 0;
+char search_view_error[128] = ""; // the query does not compile
+off_t search_max_file = 64 << 20; // --search-max-mb: contents of larger files are not searched
+int search_ignore = 1;          // skip what .gitignore/.ignore exclude; Ctrl+G in the search window
+int search_mode = 0;            // SEARCH_TEXT, _TERMS or _REGEX; Ctrl+T in the search window
 int search_selected = 0;
 int search_scroll = 0;
 
+const char *entry_name(const Entry *e) {
+    return name_arena + e->name_off;
+}
+
+// Build the full path of an entry of the current listing into buf
+void entry_path(const Entry *e, char *buf, size_t len) {
+    if (strcmp(listing_dir, "/") == 0) {
+        snprintf(buf, len, "/%s", entry_name(e));
+    } else {
+        snprintf(buf, len, "%s/%s", listing_dir, entry_name(e));
+    }
+}
+
+int is_special_entry(const Entry *e) {
+    const char *name = entry_name(e);
+    return strcmp(name, "..") == 0 ||
+           strcmp(name, "[+ New File]") == 0 ||
+           strcmp(name, "[+ New Folder]") == 0;
+}
+
+// Append an entry to the listing. Returns NULL (and adds nothing) when out of memory.
+Entry *append_entry(const char *name, int is_dir, off_t size) {
+    size_t len = strlen(name);
+    if (len > UINT16_MAX) return NULL;
+
+    if (entry_count == entry_capacity) {
+        int new_cap = entry_capacity ? entry_capacity * 2 : 256;
+        Entry *grown = realloc(entries, (size_t)new_cap * sizeof(Entry));
+        if (!grown) return NULL;
+        entries = grown;
+        entry_capacity = new_cap;
+    }
+
+    if (name_arena_len + len + 1 > name_arena_cap) {
+        size_t new_cap = name_arena_cap ? name_arena_cap : 4096;
+        while (name_arena_len + len + 1 > new_cap) new_cap *= 2;
+        if (new_cap > UINT32_MAX) return NULL;
+        char *grown = realloc(name_arena, new_cap);
+        if (!grown) return NULL;
+        name_arena = grown;
+        name_arena_cap = new_cap;
+    }
+
+    Entry *e = &entries[entry_count++];
+    e->name_off = (uint32_t)name_arena_len;
+    e->name_len = (uint16_t)len;
+    e->is_dir = is_dir ? 1 : 0;
+    e->flags = 0;
+    e->size = size;
+    memcpy(name_arena + name_arena_len, name, len + 1);
+    name_arena_len += len + 1;
+    return e;
+}
+
+// Fetch the size of an entry whose type came from d_type alone
+void ensure_entry_size(Entry *e) {
+    if (!(e->flags & ENTRY_SIZE_PENDING)) return;
+    e->flags &= ~ENTRY_SIZE_PENDING;
+
+    struct stat st;
+    if (listing_fd >= 0 && fstatat(listing_fd, entry_name(e), &st, 0) == 0) {
+        e->size = st.st_size;
+    } else {
+        e->size = 0;
+    }
+}
+
+// Queue an entry for the metadata worker
+void mark_meta_pending(Entry *e, int flags) {
+    e->flags |= flags;
+    if (lazy_metadata) {
+        meta_pending++;
+        pthread_cond_signal(&meta_cond);
+    }
+}
+
+void clear_listing() {
+    entry_count = 0;
+    name_arena_len = 0;
+    meta_pending = 0;
+    meta_cursor = 0;
+    listing_generation++;
+}
+
 int compare_entries(const void *a, const void *b) {
-    Entry *ea = (Entry*)a, *eb = (Entry*)b;
+    const Entry *ea = a, *eb = b;
     if (ea->is_dir && !eb->is_dir) return -1;
     if (!ea->is_dir && eb->is_dir) return 1;
-    return strcmp(ea->name, eb->name);
+    return strcmp(entry_name(ea), entry_name(eb));
+}
+
+// Index of the first real entry, after "..", "[+ New File]" and "[+ New Folder]"
+int first_real_entry() {
+    if (entry_count == 0) return 0;
+    return strcmp(entry_name(&entries[0]), "..") == 0 ? 3 : 2;
+}
+
+void sort_listing() {
+    int start = first_real_entry();
+    if (entry_count > start + 1) {
+        qsort(entries + start, entry_count - start, sizeof(Entry), compare_entries);
+    }
+}
+
+// Re-sort after the worker discovered directories, keeping the selection
+void resort_listing() {
+    pthread_mutex_lock(&listing_lock);
+    char sel_name[256] = "";
+    if (selected < entry_count) {
+        snprintf(sel_name, sizeof(sel_name), "%s", entry_name(&entries[selected]));
+    }
+
+    sort_listing();
+    listing_generation++;
+    listing_resort_needed = 0;
+
+    for (int i = 0; i < entry_count; i++) {
+        if (strcmp(entry_name(&entries[i]), sel_name) == 0) {
+            scroll_offset += i - selected;
+            if (scroll_offset < 0) scroll_offset = 0;
+            selected = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&listing_lock);
+}
+
+// Pick up to `max` pending entries, viewport first. Called with listing_lock held.
+int collect_meta_batch(int *idx, char names[][256], int max) {
+    int n = 0;
+    int end = meta_focus + meta_window;
+    if (end > entry_count) end = entry_count;
+    for (int i = meta_focus; i < end && n < max; i++) {
+        if (entries[i].flags & ENTRY_META_PENDING) idx[n++] = i;
+    }
+
+    for (int scanned = 0; n < max && scanned < entry_count; scanned++) {
+        if (meta_cursor >= entry_count) meta_cursor = 0;
+        int i = meta_cursor++;
+        if (i >= meta_focus && i < end) continue;
+        if (entries[i].flags & ENTRY_META_PENDING) idx[n++] = i;
+    }
+
+    for (int k = 0; k < n; k++) {
+        snprintf(names[k], 256, "%s", entry_name(&entries[idx[k]]));
+    }
+    return n;
+}
+
+void *meta_worker(void *arg) {
+    (void)arg;
+    int idx[META_BATCH];
+    char names[META_BATCH][256];
+    struct stat st[META_BATCH];
+    int ok[META_BATCH];
+    int dfd = -1;
+    unsigned long dfd_generation = 0;
+
+    pthread_mutex_lock(&listing_lock);
+    for (;;) {
+        while (meta_pending == 0) pthread_cond_wait(&meta_cond, &listing_lock);
+
+        unsigned long generation = listing_generation;
+        if (dfd < 0 || dfd_generation != generation) {
+            if (dfd >= 0) close(dfd);
+            dfd = listing_fd >= 0 ? fcntl(listing_fd, F_DUPFD_CLOEXEC, 0) : -1;
+            dfd_generation = generation;
+        }
+        int n = collect_meta_batch(idx, names, META_BATCH);
+        if (n == 0) {
+            meta_pending = 0;
+            continue;
+        }
+        pthread_mutex_unlock(&listing_lock);
+
+        for (int k = 0; k < n; k++) {
+            ok[k] = dfd >= 0 && fstatat(dfd, names[k], &st[k], 0) == 0;
+        }
+
+        pthread_mutex_lock(&listing_lock);
+        if (generation != listing_generation) continue;
+        for (int k = 0; k < n; k++) {
+            Entry *e = &entries[idx[k]];
+            if (!(e->flags & ENTRY_META_PENDING)) continue;
+            if ((e->flags & ENTRY_TYPE_PENDING) && ok[k] && S_ISDIR(st[k].st_mode)) {
+                e->is_dir = 1;
+                listing_resort_needed = 1;
+            }
+            e->size = ok[k] ? st[k].st_size : 0;
+            e->flags &= ~ENTRY_META_PENDING;
+            meta_pending--;
+        }
+    }
+    return NULL;
+}
+
+void start_meta_worker() {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, meta_worker, NULL) == 0) {
+        pthread_detach(tid);
+    } else {
+        lazy_metadata = 0;
+    }
+}
+
+int background_work_pending() {
+    pthread_mutex_lock(&listing_lock);
+    int pending = dir_loading || staged_count > 0 || meta_pending > 0 || listing_resort_needed;
+    pthread_mutex_unlock(&listing_lock);
+    return pending;
 }
 
 void format_size(off_t size, char *buf) {
@@ -122,98 +528,1102 @@ void format_size(off_t size, char *buf) {
     else sprintf(buf, "%.2fG", size/(1024.0*1024*1024));
 }
 
-void duplicate_entry() {
-    // Check if we have a valid selection
-    if (entry_count == 0) return;
-    
-    Entry *e = &entries[selected];
-    
-    // Don't allow duplicating special entries
-    if (strcmp(e->name, "..") == 0 || 
-        strcmp(e->name, "[+ New File]") == 0 ||
-        strcmp(e->name, "[+ New Folder]") == 0) {
+/*
+================================================================================
+                               WORK POOL
+================================================================================
+A small work-stealing thread pool. Each worker owns a deque: it pushes and
+pops at the tail (depth first, cache friendly) while idle workers steal
+from the head of the others. Tasks embed a PoolTask as their first member
+and may submit further tasks from inside run().
+*/
+
+typedef struct PoolTask {
+    void (*run)(struct PoolTask *task, int worker);
+} PoolTask;
+
+typedef struct {
+    pthread_mutex_t lock;
+    PoolTask **items;           // ring buffer, [head, tail) modulo cap
+    long head, tail, cap;
+} TaskDeque;
+
+typedef struct WorkPool WorkPool;
+
+typedef struct {
+    WorkPool *pool;
+    int index;
+} PoolWorker;
+
+struct WorkPool {
+    int nworkers;
+    TaskDeque *deques;
+    pthread_t *threads;
+    PoolWorker *workers;
+    atomic_long queued;         // tasks sitting in deques
+    atomic_long pending;        // tasks queued or running
+    atomic_uint next_deque;     // round robin for submissions from outside
+    atomic_int stop;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t work_cond;   // workers sleep here when every deque is empty
+    pthread_cond_t done_cond;   // pool_wait() sleeps here
+};
+
+int deque_push(TaskDeque *d, PoolTask *task) {
+    pthread_mutex_lock(&d->lock);
+    if (d->tail - d->head == d->cap) {
+        long new_cap = d->cap ? d->cap * 2 : 256;
+        PoolTask **grown = malloc((size_t)new_cap * sizeof(PoolTask *));
+        if (!grown) {
+            pthread_mutex_unlock(&d->lock);
+            return 0;
+        }
+        for (long i = d->head; i < d->tail; i++) grown[i - d->head] = d->items[i % d->cap];
+        free(d->items);
+        d->items = grown;
+        d->tail -= d->head;
+        d->head = 0;
+        d->cap = new_cap;
+    }
+    d->items[d->tail % d->cap] = task;
+    d->tail++;
+    pthread_mutex_unlock(&d->lock);
+    return 1;
+}
+
+PoolTask *deque_pop_tail(TaskDeque *d) {
+    PoolTask *task = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->tail > d->head) task = d->items[--d->tail % d->cap];
+    pthread_mutex_unlock(&d->lock);
+    return task;
+}
+
+PoolTask *deque_steal_head(TaskDeque *d) {
+    PoolTask *task = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->tail > d->head) task = d->items[d->head++ % d->cap];
+    pthread_mutex_unlock(&d->lock);
+    return task;
+}
+
+// Queue a task; `worker` is the submitting worker's index, or -1 from outside
+void pool_submit(WorkPool *pool, PoolTask *task, int worker) {
+    int d = worker >= 0 ? worker : (int)(atomic_fetch_add(&pool->next_deque, 1) % pool->nworkers);
+    atomic_fetch_add(&pool->pending, 1);
+    if (!deque_push(&pool->deques[d], task)) {
+        // Out of memory for the queue: run it right here instead
+        task->run(task, worker >= 0 ? worker : 0);
+        atomic_fetch_sub(&pool->pending, 1);
         return;
     }
-    
-    int height, width;
-    getmaxyx(stdscr, height, width);
+    atomic_fetch_add(&pool->queued, 1);
+    pthread_mutex_lock(&pool->idle_lock);
+    pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
 
-    WINDOW *win = newwin(9, 60, (height - 9) / 2, (width - 60) / 2);
+PoolTask *pool_find_task(WorkPool *pool, int self) {
+    PoolTask *task = deque_pop_tail(&pool->deques[self]);
+    for (int i = 1; !task && i < pool->nworkers; i++) {
+        task = deque_steal_head(&pool->deques[(self + i) % pool->nworkers]);
+    }
+    if (task) atomic_fetch_sub(&pool->queued, 1);
+    return task;
+}
+
+void *pool_worker_main(void *arg) {
+    PoolWorker *w = arg;
+    WorkPool *pool = w->pool;
+
+    for (;;) {
+        PoolTask *task = pool_find_task(pool, w->index);
+        if (!task) {
+            pthread_mutex_lock(&pool->idle_lock);
+            while (atomic_load(&pool->queued) == 0 && !atomic_load(&pool->stop)) {
+                pthread_cond_wait(&pool->work_cond, &pool->idle_lock);
+            }
+            pthread_mutex_unlock(&pool->idle_lock);
+            if (atomic_load(&pool->stop)) break;
+            continue;
+        }
+
+        task->run(task, w->index);
+        if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+            pthread_mutex_lock(&pool->idle_lock);
+            pthread_cond_broadcast(&pool->done_cond);
+            pthread_mutex_unlock(&pool->idle_lock);
+        }
+    }
+    return NULL;
+}
+
+// Online CPUs, used when a worker count of 0 ("auto") is asked for
+int default_worker_count() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+WorkPool *pool_create(int nworkers) {
+    if (nworkers <= 0) nworkers = default_worker_count();
+    WorkPool *pool = calloc(1, sizeof(WorkPool));
+    if (!pool) return NULL;
+    pool->deques = calloc((size_t)nworkers, sizeof(TaskDeque));
+    pool->threads = calloc((size_t)nworkers, sizeof(pthread_t));
+    pool->workers = calloc((size_t)nworkers, sizeof(PoolWorker));
+    if (!pool->deques || !pool->threads || !pool->workers) {
+        free(pool->deques);
+        free(pool->threads);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    for (int i = 0; i < nworkers; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+    }
+    for (int i = 0; i < nworkers; i++) {
+        if (pthread_create(&pool->threads[i], NULL, pool_worker_main, &pool->workers[i]) != 0) break;
+        pool->nworkers++;
+    }
+    if (pool->nworkers == 0) {
+        free(pool->deques);
+        free(pool->threads);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+// Block until every submitted task (and everything they submitted) has run
+void pool_wait(WorkPool *pool) {
+    pthread_mutex_lock(&pool->idle_lock);
+    while (atomic_load(&pool->pending) > 0) pthread_cond_wait(&pool->done_cond, &pool->idle_lock);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+// pool_wait() that gives up after `ms`; 1 once everything has run
+int pool_wait_for(WorkPool *pool, int ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (long)(ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&pool->idle_lock);
+    while (atomic_load(&pool->pending) > 0) {
+        if (pthread_cond_timedwait(&pool->done_cond, &pool->idle_lock, &deadline) == ETIMEDOUT) break;
+    }
+    int done = atomic_load(&pool->pending) == 0;
+    pthread_mutex_unlock(&pool->idle_lock);
+    return done;
+}
+
+void pool_destroy(WorkPool *pool) {
+    pthread_mutex_lock(&pool->idle_lock);
+    atomic_store(&pool->stop, 1);
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+    for (int i = 0; i < pool->nworkers; i++) pthread_join(pool->threads[i], NULL);
+
+    for (int i = 0; i < pool->nworkers; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].items);
+    }
+    pthread_mutex_destroy(&pool->idle_lock);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    free(pool->deques);
+    free(pool->threads);
+    free(pool->workers);
+    free(pool);
+}
+
+/*
+================================================================================
+                               FILE JOBS
+================================================================================
+Delete, copy and move run on a worker thread as a FileJob. run_file_job()
+keeps the UI alive meanwhile: it redraws the progress counters every tick,
+lets ESC set the cancel flag, and lists failed paths when the job ends.
+*/
+
+typedef struct FileJob {
+    const char *title;          // shown in the progress window, e.g. "DELETING"
+    void (*run)(struct FileJob *job);
+    atomic_long files;          // non-directories processed
+    atomic_long dirs;
+    atomic_llong bytes;
+    long items_total;           // top-level items in a batch, 0 when not a batch
+    atomic_long items_done;
+    atomic_int cancel;
+    atomic_int done;
+    pthread_mutex_t error_lock;
+    int error_count;
+    char errors[JOB_MAX_ERRORS][256];
+    void *arg;                  // job specific parameters
+} FileJob;
+
+FileJob *new_file_job(const char *title, void (*run)(FileJob *), void *arg) {
+    FileJob *job = calloc(1, sizeof(FileJob));
+    if (!job) return NULL;
+    job->title = title;
+    job->run = run;
+    job->arg = arg;
+    pthread_mutex_init(&job->error_lock, NULL);
+    return job;
+}
+
+void free_file_job(FileJob *job) {
+    pthread_mutex_destroy(&job->error_lock);
+    free(job);
+}
 
+int job_cancelled(FileJob *job) {
+    return atomic_load_explicit(&job->cancel, memory_order_relaxed);
+}
+
+void job_error(FileJob *job, const char *path, int err) {
+    pthread_mutex_lock(&job->error_lock);
+    if (job->error_count < JOB_MAX_ERRORS) {
+        size_t len = strlen(path);
+        // Keep the tail of long paths, it is the informative part
+        const char *shown = len > 180 ? path + len - 180 : path;
+        snprintf(job->errors[job->error_count], sizeof(job->errors[0]), "%s%s: %s",
+                 shown == path ? "" : "...", shown, strerror(err));
+    }
+    job->error_count++;
+    pthread_mutex_unlock(&job->error_lock);
+}
+
+void *file_job_thread(void *arg) {
+    FileJob *job = arg;
+    job->run(job);
+    atomic_store(&job->done, 1);
+    return NULL;
+}
+
+void draw_job_progress(WINDOW *win, FileJob *job) {
+    char bytes[20];
+    format_size((off_t)atomic_load(&job->bytes), bytes);
+
+    werase(win);
     box(win, 0, 0);
     wattron(win, COLOR_PAIR(1) | A_BOLD);
-    mvwprintw(win, 1, 2, "DUPLICATE");
+    mvwprintw(win, 1, 2, "%s", job->title);
     wattroff(win, COLOR_PAIR(1) | A_BOLD);
 
-    mvwprintw(win, 3, 2, "Duplicating: %s", e->name);
-    mvwprintw(win, 5, 2, "New name: ");
-    
-    // Pre-fill with original name + "_copy"
-    char default_name[256];
-    snprintf(default_name, sizeof(default_name), "%s_copy", e->name);
-    mvwprintw(win, 5, 12, "%s", default_name);
+    mvwprintw(win, 3, 2, "Files: %ld   Folders: %ld   Data: %s",
+              atomic_load(&job->files), atomic_load(&job->dirs), bytes);
+    pthread_mutex_lock(&job->error_lock);
+    mvwprintw(win, 4, 2, "Errors: %d", job->error_count);
+    pthread_mutex_unlock(&job->error_lock);
+    if (job->items_total > 0) {
+        long done = atomic_load(&job->items_done);
+        int bar = getmaxx(win) - 20;
+        int filled = (int)(done * bar / job->items_total);
+        mvwprintw(win, 5, 2, "[%-*.*s] %ld/%ld", bar, filled,
+                  "##################################################################", done, job->items_total);
+    }
+    mvwprintw(win, 6, 2, job_cancelled(job) ? "Cancelling..." : "ESC: Cancel");
     wrefresh(win);
+}
 
-    echo();
-    curs_set(1);
+// List what went wrong, if anything
+void show_job_report(FileJob *job) {
+    if (job->error_count == 0 && !job_cancelled(job)) return;
 
-    char newname[256];
-    mvwgetnstr(win, 5, 12, newname, 255);
+    int height, width;
+    getmaxyx(stdscr, height, width);
+    int shown = job->error_count < JOB_MAX_ERRORS ? job->error_count : JOB_MAX_ERRORS;
+    int win_height = shown + 8;
+    if (win_height > height - 2) win_height = height - 2;
+    int win_width = width - 10;
+    if (win_width > 100) win_width = 100;
 
-    noecho();
-    curs_set(0);
+    WINDOW *win = newwin(win_height, win_width, (height - win_height) / 2, (width - win_width) / 2);
+    box(win, 0, 0);
+    wattron(win, COLOR_PAIR(1) | A_BOLD);
+    mvwprintw(win, 1, 2, "%s %s", job->title, job_cancelled(job) ? "CANCELLED" : "FINISHED WITH ERRORS");
+    wattroff(win, COLOR_PAIR(1) | A_BOLD);
+
+    char bytes[20];
+    format_size((off_t)atomic_load(&job->bytes), bytes);
+    mvwprintw(win, 3, 2, "Files: %ld   Folders: %ld   Data: %s   Failed: %d",
+              atomic_load(&job->files), atomic_load(&job->dirs), bytes, job->error_count);
+    for (int i = 0; i < shown && 5 + i < win_height - 3; i++) {
+        mvwprintw(win, 5 + i, 2, "%.*s", win_width - 4, job->errors[i]);
+    }
+    mvwprintw(win, win_height - 2, 2, "Press any key to continue");
+    wrefresh(win);
+    wgetch(win);
     delwin(win);
+}
 
-    // If user just pressed enter without typing, use the default name
-    if (strlen(newname) == 0) {
-        strcpy(newname, default_name);
+// Run a job on a worker thread with a progress window; the caller frees it
+void run_file_job(FileJob *job) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, file_job_thread, job) != 0) {
+        file_job_thread(job);
+    } else {
+        int height, width;
+        getmaxyx(stdscr, height, width);
+        WINDOW *win = newwin(8, 60, (height - 8) / 2, (width - 60) / 2);
+        wtimeout(win, UI_TICK_MS);
+
+        while (!atomic_load(&job->done)) {
+            draw_job_progress(win, job);
+            if (wgetch(win) == 27) atomic_store(&job->cancel, 1);
+        }
+        delwin(win);
+        pthread_join(tid, NULL);
     }
+    show_job_report(job);
+}
 
-    if (strlen(newname) > 0 && strcmp(newname, e->name) != 0) {
-        char newpath[MAX_PATH];
-        snprintf(newpath, MAX_PATH, "%s/%s", current_dir, newname);
+// Delete engine: openat/unlinkat against directory fds, no shell involved
 
-        char cmd[MAX_PATH * 2 + 20];
-        
-        if (e->is_dir) {
-            // Copy directory recursively
-            snprintf(cmd, sizeof(cmd), "cp -r '%s' '%s' 2>/dev/null", e->path, newpath);
+typedef struct {
+    int dirfd;                  // directory holding the entry to delete
+    char name[256];
+    char path[MAX_PATH];        // for error reports
+} DeleteArgs;
+
+void delete_tree_at(FileJob *job, int parent_fd, const char *name, char *path, size_t path_len) {
+    if (job_cancelled(job)) return;
+
+    size_t len = path_len;
+    int n = snprintf(path + len, MAX_PATH - len, "/%s", name);
+    if (n > 0 && len + n < MAX_PATH) len += n;
+
+    struct stat st;
+    if (fstatat(parent_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        job_error(job, path, errno);
+        path[path_len] = '\0';
+        return;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        if (unlinkat(parent_fd, name, 0) == 0) {
+            atomic_fetch_add(&job->files, 1);
+            atomic_fetch_add(&job->bytes, st.st_size);
         } else {
-            // Copy file
-            snprintf(cmd, sizeof(cmd), "cp '%s' '%s' 2>/dev/null", e->path, newpath);
+            job_error(job, path, errno);
         }
-        
-        if (system(cmd) == 0) {
-            load_directory(current_dir);
-            
-            // Find and select the newly copied entry
-            for (int i = 0; i < entry_count; i++) {
-                if (strcmp(entries[i].name, newname) == 0) {
-                    selected = i;
-                    break;
-                }
+        path[path_len] = '\0';
+        return;
+    }
+
+    int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        job_error(job, path, errno);
+        if (fd >= 0) close(fd);
+        path[path_len] = '\0';
+        return;
+    }
+
+    struct dirent *ent;
+    while (!job_cancelled(job) && (ent = readdir(dir))) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+        delete_tree_at(job, dirfd(dir), ent->d_name, path, len);
+    }
+    closedir(dir);
+
+    if (!job_cancelled(job)) {
+        if (unlinkat(parent_fd, name, AT_REMOVEDIR) == 0) {
+            atomic_fetch_add(&job->dirs, 1);
+        } else {
+            job_error(job, path, errno);
+        }
+    }
+    path[path_len] = '\0';
+}
+
+void run_delete_job(FileJob *job) {
+    DeleteArgs *args = job->arg;
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s", args->path);
+    char *slash = strrchr(path, '/');
+    size_t base_len = slash ? (size_t)(slash - path) : 0;
+    path[base_len] = '\0';
+    delete_tree_at(job, args->dirfd, args->name, path, base_len);
+}
+
+// Copy engine: reflink when the filesystem can share extents, otherwise
+// copy_file_range (in-kernel, offloaded on NFS/XFS), then sendfile, then
+// pread/pwrite. Holes are skipped with SEEK_DATA/SEEK_HOLE; modes and
+// timestamps are carried over.
+//
+// Trees are copied by a WorkPool of copy_workers threads. A directory task
+// creates its destination before queueing its children, so parents always
+// exist first; each CopyDir counts its children in flight and applies its
+// mode and times once the last one is done. Files of COPY_SPLIT bytes and
+// more are split into chunk tasks that copy disjoint ranges in parallel.
+
+int copy_workers = 0;           // --copy-threads, 0 = one per CPU
+
+typedef struct {
+    int src_dirfd;              // directory holding the source entry
+    char src_name[256];
+    int dst_dirfd;              // directory to create the copy in
+    char dst_name[256];
+    char path[MAX_PATH];        // source path, for error reports
+} CopyArgs;
+
+typedef struct {
+    FileJob *job;
+    WorkPool *pool;             // NULL: tasks run inline, depth first
+} CopyContext;
+
+typedef struct CopyDir {
+    struct CopyDir *parent;     // NULL for the directory the copy starts in
+    CopyContext *ctx;
+    int src_fd;
+    int dst_fd;
+    struct stat st;
+    atomic_int refs;            // its own scan plus every child still in flight
+    char path[];                // source path, for error reports
+} CopyDir;
+
+typedef struct {
+    PoolTask task;
+    CopyDir *dir;               // directory holding the entry
+    char dst_name[256];
+    char name[];
+} CopyEntryTask;
+
+typedef struct CopyChunkTask CopyChunkTask;
+
+typedef struct {
+    CopyDir *dir;
+    CopyChunkTask *chunks;      // one allocation for all of the file's chunk tasks
+    int src_fd;
+    int dst_fd;
+    struct stat st;
+    atomic_int refs;            // chunks still in flight
+    atomic_int error;
+    char path[];
+} CopyFile;
+
+struct CopyChunkTask {
+    PoolTask task;
+    CopyFile *file;
+    off_t start;
+    off_t end;
+};
+
+// Copy [off, off + len) with the best mechanism that works; 0 or an errno.
+// sendfile() goes through the destination's file offset, so it is skipped
+// when several workers share dst_fd.
+int copy_range(FileJob *job, int src_fd, int dst_fd, off_t off, off_t len, int shared_dst) {
+    off_t end = off + len;
+
+    // copy_file_range: no user-space copy, and reflinks/server-side copies when possible
+    while (off < end && !job_cancelled(job)) {
+        size_t chunk = end - off > COPY_CHUNK ? COPY_CHUNK : (size_t)(end - off);
+        loff_t in = off, out = off;
+        ssize_t n = copy_file_range(src_fd, &in, dst_fd, &out, chunk, 0);
+        if (n <= 0) break;
+        off += n;
+        atomic_fetch_add(&job->bytes, n);
+    }
+    if (off >= end || job_cancelled(job)) return 0;
+
+    // sendfile: still in-kernel, writes at the destination's file offset
+    if (!shared_dst && lseek(dst_fd, off, SEEK_SET) == off) {
+        while (off < end && !job_cancelled(job)) {
+            size_t chunk = end - off > COPY_CHUNK ? COPY_CHUNK : (size_t)(end - off);
+            off_t in = off;
+            ssize_t n = sendfile(dst_fd, src_fd, &in, chunk);
+            if (n <= 0) break;
+            off += n;
+            atomic_fetch_add(&job->bytes, n);
+        }
+    }
+    if (off >= end || job_cancelled(job)) return 0;
+
+    // Last resort: large aligned buffer through user space
+    void *buf;
+    if (posix_memalign(&buf, 4096, COPY_BUF) != 0) return ENOMEM;
+    int err = 0;
+    while (off < end && !job_cancelled(job)) {
+        size_t chunk = end - off > COPY_BUF ? COPY_BUF : (size_t)(end - off);
+        ssize_t n = pread(src_fd, buf, chunk, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            err = n < 0 ? errno : EIO;
+            break;
+        }
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t w = pwrite(dst_fd, (char *)buf + done, n - done, off + done);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) {
+                err = w < 0 ? errno : EIO;
+                break;
             }
+            done += w;
         }
+        if (err) break;
+        off += n;
+        atomic_fetch_add(&job->bytes, n);
     }
+    free(buf);
+    return err;
+}
 
-    clear();
+// Copy the data segments of [start, end), leaving holes as holes; 0 or an errno
+int copy_data_range(FileJob *job, int src_fd, int dst_fd, off_t start, off_t end, int shared_dst) {
+    off_t pos = start;
+    while (pos < end && !job_cancelled(job)) {
+        off_t data = lseek(src_fd, pos, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) break; // only a hole is left
+            data = pos;                // no SEEK_DATA support: treat it all as data
+        }
+        if (data >= end) break;
+        off_t hole = lseek(src_fd, data, SEEK_HOLE);
+        if (hole < 0 || hole > end) hole = end;
+
+        int err = copy_range(job, src_fd, dst_fd, data, hole - data, shared_dst);
+        if (err) return err;
+        pos = hole;
+    }
+    return 0;
 }
 
-// Multi-select mode for moving files
-void multi_select_mode() {
-    int height, width;
-    getmaxyx(stdscr, height, width);
-    
-    // Clear all selections
-    memset(selected_for_move, 0, sizeof(selected_for_move));
-    move_count = 0;
-    
-    int selecting = 1;
-    int current_pos = selected;
-    
-    while (selecting) {
-        clear();
-        
+// Copy the contents of an open regular file; 0 or an errno
+int copy_file_data(FileJob *job, int src_fd, int dst_fd, off_t size) {
+    if (size == 0) return 0;
+
+    if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+        atomic_fetch_add(&job->bytes, size);
+        return 0;
+    }
+
+    int err = copy_data_range(job, src_fd, dst_fd, 0, size, 0);
+    if (err) return err;
+
+    // Recreate a trailing hole
+    if (ftruncate(dst_fd, size) != 0) return errno;
+    return 0;
+}
+
+void copy_metadata(int dst_fd, const struct stat *st) {
+    fchmod(dst_fd, st->st_mode & 07777);
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+    futimens(dst_fd, times);
+}
+
+void copy_file_at(FileJob *job, int src_parent, const char *src_name, int dst_parent,
+                  const char *dst_name, const struct stat *st, const char *path) {
+    int src_fd = openat(src_parent, src_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (src_fd < 0) {
+        job_error(job, path, errno);
+        return;
+    }
+    int dst_fd = openat(dst_parent, dst_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (dst_fd < 0) {
+        job_error(job, path, errno);
+        close(src_fd);
+        return;
+    }
+
+    int err = copy_file_data(job, src_fd, dst_fd, st->st_size);
+    if (err) job_error(job, path, err);
+
+    copy_metadata(dst_fd, st);
+    close(dst_fd);
+    close(src_fd);
+    if (!err) atomic_fetch_add(&job->files, 1);
+}
+
+void copy_symlink_at(FileJob *job, int src_parent, const char *src_name, int dst_parent,
+                     const char *dst_name, const struct stat *st, const char *path) {
+    char target[MAX_PATH];
+    ssize_t len = readlinkat(src_parent, src_name, target, sizeof(target) - 1);
+    if (len < 0) {
+        job_error(job, path, errno);
+        return;
+    }
+    target[len] = '\0';
+    if (symlinkat(target, dst_parent, dst_name) != 0) {
+        job_error(job, path, errno);
+        return;
+    }
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+    utimensat(dst_parent, dst_name, times, AT_SYMLINK_NOFOLLOW);
+    atomic_fetch_add(&job->files, 1);
+}
+
+void copy_submit(CopyContext *ctx, PoolTask *task, int worker) {
+    if (ctx->pool) {
+        pool_submit(ctx->pool, task, worker);
+    } else {
+        task->run(task, worker);
+    }
+}
+
+// Drop one reference; the last one finishes the directory
+void copy_dir_release(CopyDir *dir) {
+    if (atomic_fetch_sub(&dir->refs, 1) != 1) return;
+    if (dir->parent) {
+        // Mode and times last, copying the children touched them
+        copy_metadata(dir->dst_fd, &dir->st);
+        close(dir->dst_fd);
+        close(dir->src_fd);
+        atomic_fetch_add(&dir->ctx->job->dirs, 1);
+        copy_dir_release(dir->parent);
+    }
+    free(dir);
+}
+
+void copy_chunk_run(PoolTask *task, int worker) {
+    (void)worker;
+    CopyChunkTask *t = (CopyChunkTask *)task;
+    CopyFile *f = t->file;
+    FileJob *job = f->dir->ctx->job;
+
+    if (!job_cancelled(job)) {
+        int err = copy_data_range(job, f->src_fd, f->dst_fd, t->start, t->end, 1);
+        if (err) atomic_store(&f->error, err);
+    }
+
+    if (atomic_fetch_sub(&f->refs, 1) != 1) return;
+    int err = atomic_load(&f->error);
+    if (err) {
+        job_error(job, f->path, err);
+    } else {
+        atomic_fetch_add(&job->files, 1);
+    }
+    copy_metadata(f->dst_fd, &f->st);
+    close(f->dst_fd);
+    close(f->src_fd);
+    copy_dir_release(f->dir);
+    free(f->chunks);
+    free(f);
+}
+
+// Large file: reflink if possible, otherwise one chunk task per COPY_SPLIT bytes
+void copy_large_file(CopyDir *dir, const char *name, const char *dst_name,
+                     const struct stat *st, const char *path, int worker) {
+    FileJob *job = dir->ctx->job;
+    int src_fd = openat(dir->src_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (src_fd < 0) {
+        job_error(job, path, errno);
+        return;
+    }
+    int dst_fd = openat(dir->dst_fd, dst_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (dst_fd < 0) {
+        job_error(job, path, errno);
+        close(src_fd);
+        return;
+    }
+
+    if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+        atomic_fetch_add(&job->bytes, st->st_size);
+        atomic_fetch_add(&job->files, 1);
+        copy_metadata(dst_fd, st);
+        close(dst_fd);
+        close(src_fd);
+        return;
+    }
+    // Full size up front: chunks write at their own offsets, holes stay holes
+    if (ftruncate(dst_fd, st->st_size) != 0) {
+        job_error(job, path, errno);
+        close(dst_fd);
+        close(src_fd);
+        return;
+    }
+
+    long chunks = (long)((st->st_size + COPY_SPLIT - 1) / COPY_SPLIT);
+    CopyFile *f = malloc(sizeof(CopyFile) + strlen(path) + 1);
+    CopyChunkTask *tasks = malloc(chunks * sizeof(CopyChunkTask));
+    if (!f || !tasks) {
+        job_error(job, path, ENOMEM);
+        free(f);
+        free(tasks);
+        close(dst_fd);
+        close(src_fd);
+        return;
+    }
+    f->dir = dir;
+    f->src_fd = src_fd;
+    f->dst_fd = dst_fd;
+    f->st = *st;
+    f->chunks = tasks;
+    atomic_init(&f->refs, (int)chunks);
+    atomic_init(&f->error, 0);
+    strcpy(f->path, path);
+    atomic_fetch_add(&dir->refs, 1);
+
+    for (long i = 0; i < chunks; i++) {
+        CopyChunkTask *t = &tasks[i];
+        t->task.run = copy_chunk_run;
+        t->file = f;
+        t->start = (off_t)i * COPY_SPLIT;
+        t->end = t->start + COPY_SPLIT < st->st_size ? t->start + COPY_SPLIT : st->st_size;
+        copy_submit(dir->ctx, &t->task, worker);
+    }
+}
+
+void copy_entry_run(PoolTask *task, int worker);
+
+int copy_submit_entry(CopyDir *dir, const char *name, const char *dst_name, int worker) {
+    size_t len = strlen(name);
+    CopyEntryTask *t = malloc(sizeof(CopyEntryTask) + len + 1);
+    if (!t) return 0;
+    t->task.run = copy_entry_run;
+    t->dir = dir;
+    snprintf(t->dst_name, sizeof(t->dst_name), "%s", dst_name);
+    memcpy(t->name, name, len + 1);
+    atomic_fetch_add(&dir->refs, 1);
+    copy_submit(dir->ctx, &t->task, worker);
+    return 1;
+}
+
+void copy_directory(CopyDir *dir, const char *name, const char *dst_name,
+                    const struct stat *st, const char *path, int worker) {
+    FileJob *job = dir->ctx->job;
+    int src_fd = openat(dir->src_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    int scan_fd = src_fd >= 0 ? fcntl(src_fd, F_DUPFD_CLOEXEC, 0) : -1;
+    DIR *scan = scan_fd >= 0 ? fdopendir(scan_fd) : NULL;
+    if (!scan) {
+        job_error(job, path, errno);
+        if (scan_fd >= 0) close(scan_fd);
+        if (src_fd >= 0) close(src_fd);
+        return;
+    }
+
+    // The destination exists before any child is queued
+    int dst_fd = -1;
+    if (mkdirat(dir->dst_fd, dst_name, 0700) != 0 ||
+        (dst_fd = openat(dir->dst_fd, dst_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        job_error(job, path, errno);
+        closedir(scan);
+        close(src_fd);
+        return;
+    }
+
+    CopyDir *child = malloc(sizeof(CopyDir) + strlen(path) + 1);
+    if (!child) {
+        job_error(job, path, ENOMEM);
+        closedir(scan);
+        close(src_fd);
+        close(dst_fd);
+        return;
+    }
+    child->parent = dir;
+    child->ctx = dir->ctx;
+    child->src_fd = src_fd;
+    child->dst_fd = dst_fd;
+    child->st = *st;
+    atomic_init(&child->refs, 1);
+    strcpy(child->path, path);
+    atomic_fetch_add(&dir->refs, 1);
+
+    struct dirent *ent;
+    while (!job_cancelled(job) && (ent = readdir(scan))) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+        if (!copy_submit_entry(child, ent->d_name, ent->d_name, worker)) {
+            job_error(job, path, ENOMEM);
+            break;
+        }
+    }
+    closedir(scan);
+    copy_dir_release(child);
+}
+
+void copy_entry_run(PoolTask *task, int worker) {
+    CopyEntryTask *t = (CopyEntryTask *)task;
+    CopyDir *dir = t->dir;
+    FileJob *job = dir->ctx->job;
+
+    if (!job_cancelled(job)) {
+        char path[MAX_PATH];
+        snprintf(path, sizeof(path), "%s/%s", dir->path, t->name);
+
+        struct stat st;
+        if (fstatat(dir->src_fd, t->name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            job_error(job, path, errno);
+        } else if (S_ISREG(st.st_mode)) {
+            if (st.st_size >= COPY_SPLIT && dir->ctx->pool && dir->ctx->pool->nworkers > 1) {
+                copy_large_file(dir, t->name, t->dst_name, &st, path, worker);
+            } else {
+                copy_file_at(job, dir->src_fd, t->name, dir->dst_fd, t->dst_name, &st, path);
+            }
+        } else if (S_ISLNK(st.st_mode)) {
+            copy_symlink_at(job, dir->src_fd, t->name, dir->dst_fd, t->dst_name, &st, path);
+        } else if (S_ISDIR(st.st_mode)) {
+            copy_directory(dir, t->name, t->dst_name, &st, path, worker);
+        } else {
+            job_error(job, path, EOPNOTSUPP); // devices, fifos, sockets
+        }
+    }
+
+    copy_dir_release(dir);
+    free(t);
+}
+
+void copy_tree(FileJob *job, CopyArgs *args) {
+    CopyContext ctx = { .job = job, .pool = pool_create(copy_workers) };
+
+    // The starting point: the directories holding the source and the copy
+    char base[MAX_PATH];
+    snprintf(base, sizeof(base), "%s", args->path);
+    char *slash = strrchr(base, '/');
+    if (slash) *slash = '\0';
+
+    CopyDir *root = malloc(sizeof(CopyDir) + strlen(base) + 1);
+    if (!root) {
+        job_error(job, args->path, ENOMEM);
+    } else {
+        root->parent = NULL;
+        root->ctx = &ctx;
+        root->src_fd = args->src_dirfd;
+        root->dst_fd = args->dst_dirfd;
+        atomic_init(&root->refs, 1); // released below, after the pool drains
+        strcpy(root->path, base);
+        if (!copy_submit_entry(root, args->src_name, args->dst_name, -1)) {
+            job_error(job, args->path, ENOMEM);
+        }
+        if (ctx.pool) pool_wait(ctx.pool);
+        copy_dir_release(root);
+    }
+    if (ctx.pool) pool_destroy(ctx.pool);
+}
+
+void run_copy_job(FileJob *job) {
+    copy_tree(job, job->arg);
+}
+
+// Move engine: renameat2() with RENAME_NOREPLACE for each item of a batch, so
+// an existing target is reported instead of overwritten. Items on another
+// filesystem (EXDEV) are copied and the source is deleted only once the copy
+// finished without errors.
+
+typedef struct {
+    int src_dirfd;
+    int dst_dirfd;
+    char src_dir[MAX_PATH];
+    char dst_dir[MAX_PATH];
+    int count;
+    char **names;
+    unsigned char *is_dir;
+    atomic_int moved;
+} MoveArgs;
+
+int rename_noreplace(int src_dirfd, const char *src, int dst_dirfd, const char *dst) {
+    if (renameat2(src_dirfd, src, dst_dirfd, dst, RENAME_NOREPLACE) == 0) return 0;
+    if (errno != EINVAL && errno != ENOSYS) return errno;
+
+    // No RENAME_NOREPLACE on this filesystem: check, then rename
+    struct stat st;
+    if (fstatat(dst_dirfd, dst, &st, AT_SYMLINK_NOFOLLOW) == 0) return EEXIST;
+    return renameat(src_dirfd, src, dst_dirfd, dst) == 0 ? 0 : errno;
+}
+
+// Copy + delete for an item on another filesystem; 1 when the source is gone
+int move_across_devices(FileJob *job, MoveArgs *args, const char *name, const char *path) {
+    CopyArgs copy;
+    copy.src_dirfd = args->src_dirfd;
+    copy.dst_dirfd = args->dst_dirfd;
+    snprintf(copy.src_name, sizeof(copy.src_name), "%s", name);
+    snprintf(copy.dst_name, sizeof(copy.dst_name), "%s", name);
+    snprintf(copy.path, sizeof(copy.path), "%s", path);
+
+    int errors = job->error_count;
+    long files = atomic_load(&job->files);
+    long dirs = atomic_load(&job->dirs);
+    long long bytes = atomic_load(&job->bytes);
+    copy_tree(job, &copy);
+    if (job_cancelled(job) || job->error_count != errors) {
+        // Take the partial copy back out, so the source stays the only one
+        // and the move can be retried. The delete runs as a job of its own,
+        // since it stops at once when its job is cancelled.
+        FileJob *cleanup = new_file_job("DELETING", NULL, NULL);
+        if (cleanup) {
+            char del_path[MAX_PATH];
+            snprintf(del_path, sizeof(del_path), "%s", args->dst_dir);
+            delete_tree_at(cleanup, args->dst_dirfd, name, del_path, strlen(del_path));
+            pthread_mutex_lock(&job->error_lock);
+            for (int i = 0; i < cleanup->error_count && i < JOB_MAX_ERRORS; i++) {
+                if (job->error_count + i < JOB_MAX_ERRORS) {
+                    memcpy(job->errors[job->error_count + i], cleanup->errors[i], sizeof(job->errors[0]));
+                }
+            }
+            job->error_count += cleanup->error_count;
+            pthread_mutex_unlock(&job->error_lock);
+            free_file_job(cleanup);
+        }
+        // Nothing of this item was moved
+        atomic_store(&job->files, files);
+        atomic_store(&job->dirs, dirs);
+        atomic_store(&job->bytes, bytes);
+        return 0;
+    }
+
+    // The copy already counted the files; the delete must not count them twice
+    files = atomic_load(&job->files);
+    dirs = atomic_load(&job->dirs);
+    bytes = atomic_load(&job->bytes);
+    char del_path[MAX_PATH];
+    snprintf(del_path, sizeof(del_path), "%s", args->src_dir);
+    delete_tree_at(job, args->src_dirfd, name, del_path, strlen(del_path));
+    atomic_store(&job->files, files);
+    atomic_store(&job->dirs, dirs);
+    atomic_store(&job->bytes, bytes);
+    return job->error_count == errors;
+}
+
+void run_move_job(FileJob *job) {
+    MoveArgs *args = job->arg;
+    for (int i = 0; i < args->count && !job_cancelled(job); i++) {
+        const char *name = args->names[i];
+        char path[MAX_PATH];
+        int n = snprintf(path, sizeof(path), "%s/%s", args->src_dir, name);
+        if (n < 0 || n >= (int)sizeof(path)) {
+            job_error(job, name, ENAMETOOLONG);
+            continue;
+        }
+
+        int err = rename_noreplace(args->src_dirfd, name, args->dst_dirfd, name);
+        if (err == 0) {
+            atomic_fetch_add(args->is_dir[i] ? &job->dirs : &job->files, 1);
+            atomic_fetch_add(&args->moved, 1);
+        } else if (err == EXDEV) {
+            struct stat st;
+            if (fstatat(args->dst_dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                job_error(job, path, EEXIST);
+            } else if (move_across_devices(job, args, name, path)) {
+                atomic_fetch_add(&args->moved, 1);
+            }
+        } else {
+            job_error(job, path, err);
+        }
+        atomic_fetch_add(&job->items_done, 1);
+    }
+}
+
+void duplicate_entry() {
+    // Check if we have a valid selection
+    if (entry_count == 0) return;
+    
+    Entry *e = &entries[selected];
+    
+    // Don't allow duplicating special entries
+    if (is_special_entry(e)) {
+        return;
+    }
+    
+    int height, width;
+    getmaxyx(stdscr, height, width);
+
+    WINDOW *win = newwin(9, 60, (height - 9) / 2, (width - 60) / 2);
+
+    box(win, 0, 0);
+    wattron(win, COLOR_PAIR(1) | A_BOLD);
+    mvwprintw(win, 1, 2, "DUPLICATE");
+    wattroff(win, COLOR_PAIR(1) | A_BOLD);
+
+    mvwprintw(win, 3, 2, "Duplicating: %s", entry_name(e));
+    mvwprintw(win, 5, 2, "New name: ");
+    
+    // Pre-fill with original name + "_copy"
+    char default_name[256];
+    snprintf(default_name, sizeof(default_name), "%s_copy", entry_name(e));
+    mvwprintw(win, 5, 12, "%s", default_name);
+    wrefresh(win);
+
+    echo();
+    curs_set(1);
+
+    char newname[256];
+    mvwgetnstr(win, 5, 12, newname, 255);
+
+    noecho();
+    curs_set(0);
+    delwin(win);
+
+    // If user just pressed enter without typing, use the default name
+    if (strlen(newname) == 0) {
+        strcpy(newname, default_name);
+    }
+
+    if (strlen(newname) > 0 && strcmp(newname, entry_name(e)) != 0) {
+        // Copy in-process: files, directories (recursively) and symlinks, which
+        // are recreated as links like cp -r does, also for a single file link
+        CopyArgs args;
+        args.src_dirfd = listing_fd;
+        args.dst_dirfd = listing_fd;
+        snprintf(args.src_name, sizeof(args.src_name), "%s", entry_name(e));
+        snprintf(args.dst_name, sizeof(args.dst_name), "%s", newname);
+        entry_path(e, args.path, sizeof(args.path));
+
+        FileJob *job = new_file_job("COPYING", run_copy_job, &args);
+        if (job) {
+            // The copy goes next to the original; a path could put a folder
+            // inside itself, and the copy would then walk into its own output
+            if (strchr(newname, '/')) {
+                job_error(job, newname, EINVAL);
+                show_job_report(job);
+            } else if (listing_fd >= 0) {
+                run_file_job(job);
+            }
+            free_file_job(job);
+        }
+
+        refresh_listing();
+
+        // Find and select the newly copied entry
+        for (int i = 0; i < entry_count; i++) {
+            if (strcmp(entry_name(&entries[i]), newname) == 0) {
+                selected = i;
+                break;
+            }
+        }
+    }
+
+    clear();
+}
+
+void clear_move_selection(void) {
+    for (int i = 0; move_names && i < move_count; i++) free(move_names[i]);
+    free(move_names);
+    free(move_is_dir);
+    move_names = NULL;
+    move_is_dir = NULL;
+    move_count = 0;
+}
+
+// Multi-select mode for moving files
+void multi_select_mode() {
+    int height, width;
+    getmaxyx(stdscr, height, width);
+
+    // Selections are indexed by entry, so the listing must stop changing
+    wait_for_directory_load();
+    
+    // Clear all selections, sized to the current listing
+    clear_move_selection();
+    int move_select_len = entry_count;
+    unsigned char *selected_for_move = calloc(entry_count > 0 ? (size_t)entry_count : 1, 1);
+    if (!selected_for_move) return;
+    
+    int selecting = 1;
+    int current_pos = selected;
+    
+    while (selecting) {
+        clear();
+        
         // Header
         attron(COLOR_PAIR(1) | A_BOLD);
         mvhline(0, 0, ' ', width);
@@ -222,14 +1632,13 @@ void multi_select_mode() {
         
         // File list with selection indicators
         int list_height = height - 3;
+        pthread_mutex_lock(&listing_lock);
         for (int i = scroll_offset; i < scroll_offset + list_height && i < entry_count; i++) {
             int y = i - scroll_offset + 1;
             Entry *e = &entries[i];
             
             // Skip special entries
-            if (strcmp(e->name, "..") == 0 || 
-                strcmp(e->name, "[+ New File]") == 0 ||
-                strcmp(e->name, "[+ New Folder]") == 0) {
+            if (is_special_entry(e)) {
                 continue;
             }
             
@@ -251,16 +1660,21 @@ void multi_select_mode() {
             // File/folder name
             if (e->is_dir) {
                 attron(COLOR_PAIR(4));
-                mvprintw(y, 6, "[\\] %s", e->name);
+                mvprintw(y, 6, "[\\] %s", entry_name(e));
                 attroff(COLOR_PAIR(4));
             } else {
-                mvprintw(y, 6, "[~] %s", e->name);
+                mvprintw(y, 6, "[~] %s", entry_name(e));
             }
             
             // Size
             if (!e->is_dir) {
+                if (!lazy_metadata) ensure_entry_size(e);
                 char size_str[20];
-                format_size(e->size, size_str);
+                if (e->flags & ENTRY_SIZE_PENDING) {
+                    strcpy(size_str, "...");
+                } else {
+                    format_size(e->size, size_str);
+                }
                 attron(COLOR_PAIR(3));
                 mvprintw(y, width - 12, "%10s", size_str);
                 attroff(COLOR_PAIR(3));
@@ -270,6 +1684,7 @@ void multi_select_mode() {
                 attroff(COLOR_PAIR(4));
             }
         }
+        pthread_mutex_unlock(&listing_lock);
         
         // Footer with count
         attron(COLOR_PAIR(1));
@@ -285,13 +1700,11 @@ void multi_select_mode() {
             case 27: // ESC
                 selecting = 0;
                 move_count = 0;
-                memset(selected_for_move, 0, sizeof(selected_for_move));
+                memset(selected_for_move, 0, (size_t)move_select_len);
                 break;
                 
             case ' ': // Space to toggle selection
-                if (strcmp(entries[current_pos].name, "..") != 0 &&
-                    strcmp(entries[current_pos].name, "[+ New File]") != 0 &&
-                    strcmp(entries[current_pos].name, "[+ New Folder]") != 0) {
+                if (current_pos < move_select_len && !is_special_entry(&entries[current_pos])) {
                     
                     if (selected_for_move[current_pos]) {
                         selected_for_move[current_pos] = 0;
@@ -333,6 +1746,23 @@ void multi_select_mode() {
                 break;
         }
     }
+
+    // Take the names now, while the indexes still match the marked rows
+    if (move_count > 0) {
+        move_names = calloc((size_t)move_count, sizeof(char *));
+        move_is_dir = calloc((size_t)move_count, 1);
+        int n = 0;
+        for (int i = 0; i < move_select_len && n < move_count && move_names && move_is_dir; i++) {
+            if (!selected_for_move[i]) continue;
+            move_names[n] = strdup(entry_name(&entries[i]));
+            move_is_dir[n] = entries[i].is_dir;
+            if (move_names[n]) n++;
+        }
+        if (!move_names || !move_is_dir) n = 0;
+        move_count = n;
+        if (n == 0) clear_move_selection();
+    }
+    free(selected_for_move);
     
     clear();
 }
@@ -378,7 +1808,7 @@ char* select_destination_folder() {
             Entry *e = &entries[i];
             
             // Only show folders and parent dir
-            if (!e->is_dir && strcmp(e->name, "..") != 0) continue;
+            if (!e->is_dir && strcmp(entry_name(e), "..") != 0) continue;
             
             int y = display_idx + 2;
             
@@ -388,11 +1818,11 @@ char* select_destination_folder() {
                 attroff(COLOR_PAIR(2) | A_REVERSE);
             }
             
-            if (strcmp(e->name, "..") == 0) {
+            if (strcmp(entry_name(e), "..") == 0) {
                 mvprintw(y, 2, "+- [\\] ..");
             } else {
                 attron(COLOR_PAIR(4));
-                mvprintw(y, 2, "|- [\\] %s", e->name);
+                mvprintw(y, 2, "|- [\\] %s", entry_name(e));
                 attroff(COLOR_PAIR(4));
             }
             
@@ -431,7 +1861,7 @@ char* select_destination_folder() {
                 // Count visible folders
                 int folder_count = 0;
                 for (int i = 0; i < entry_count; i++) {
-                    if (entries[i].is_dir || strcmp(entries[i].name, "..") == 0) {
+                    if (entries[i].is_dir || strcmp(entry_name(&entries[i]), "..") == 0) {
                         folder_count++;
                     }
                 }
@@ -445,9 +1875,9 @@ char* select_destination_folder() {
                 {
                     int folder_idx = 0;
                     for (int i = 0; i < entry_count; i++) {
-                        if (entries[i].is_dir || strcmp(entries[i].name, "..") == 0) {
+                        if (entries[i].is_dir || strcmp(entry_name(&entries[i]), "..") == 0) {
                             if (folder_idx == browse_selected) {
-                                if (strcmp(entries[i].name, "..") == 0) {
+                                if (strcmp(entry_name(&entries[i]), "..") == 0) {
                                     // Go to parent
                                     char *last_slash = strrchr(dest_path, '/');
                                     if (last_slash && last_slash != dest_path) {
@@ -457,7 +1887,7 @@ char* select_destination_folder() {
                                     }
                                 } else {
                                     // Enter the selected folder
-                                    strcpy(dest_path, entries[i].path);
+                                    entry_path(&entries[i], dest_path, MAX_PATH);
                                 }
                                 browse_selected = 0;
                                 break;
@@ -498,29 +1928,44 @@ char* select_destination_folder() {
 // Execute the move operation
 void execute_move(const char *dest_folder) {
     int moved = 0;
-    
-    for (int i = 0; i < entry_count; i++) {
-        if (selected_for_move[i]) {
-            Entry *e = &entries[i];
-            char dest_path[MAX_PATH];
-            snprintf(dest_path, MAX_PATH, "%s/%s", dest_folder, e->name);
-            
-            char cmd[MAX_PATH * 2 + 20];
-            snprintf(cmd, sizeof(cmd), "mv '%s' '%s' 2>/dev/null", e->path, dest_path);
-            
-            if (system(cmd) == 0) {
-                moved++;
-            }
+    int show_summary = 1;
+
+    // The job takes over the names marked in multi_select_mode
+    MoveArgs args;
+    memset(&args, 0, sizeof(args));
+    args.src_dirfd = listing_fd;
+    args.dst_dirfd = open(dest_folder, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    snprintf(args.src_dir, sizeof(args.src_dir), "%s", current_dir);
+    snprintf(args.dst_dir, sizeof(args.dst_dir), "%s", dest_folder);
+    args.names = move_names;
+    args.is_dir = move_is_dir;
+    args.count = move_count;
+    move_names = NULL;
+    move_is_dir = NULL;
+    move_count = 0;
+
+    if (args.dst_dirfd >= 0 && args.count > 0) {
+        FileJob *job = new_file_job("MOVING", run_move_job, &args);
+        if (job) {
+            job->items_total = args.count;
+            run_file_job(job);
+            show_summary = job->error_count == 0 && !job_cancelled(job);
+            free_file_job(job);
         }
+        moved = atomic_load(&args.moved);
     }
-    
-    // Clear selections
-    memset(selected_for_move, 0, sizeof(selected_for_move));
-    move_count = 0;
-    
+    if (args.dst_dirfd >= 0) close(args.dst_dirfd);
+    for (int i = 0; i < args.count; i++) free(args.names[i]);
+    free(args.names);
+    free(args.is_dir);
+
     // Reload directory
-    load_directory(current_dir);
-    
+    refresh_listing();
+    if (!show_summary) {
+        clear();
+        return;
+    }
+
     // Show result
     int height, width;
     getmaxyx(stdscr, height, width);
@@ -557,8 +2002,7 @@ void move_files_workflow() {
     
     if (dest == NULL) {
         // User cancelled
-        memset(selected_for_move, 0, sizeof(selected_for_move));
-        move_count = 0;
+        clear_move_selection();
         clear();
         return;
     }
@@ -618,85 +2062,642 @@ int check_and_setup_editor() {
     return result;
 }
 
-void load_directory(const char *path) {
-    DIR *dir = opendir(path);
-    if (!dir) return;
+typedef struct {
+    int fd;
+    unsigned long generation;
+} LoaderArgs;
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Stage one entry for the main thread. Called with listing_lock held.
+int stage_entry(const char *name, int is_dir, off_t size, int flags) {
+    size_t len = strlen(name);
+    if (staged_count == staged_capacity) {
+        int new_cap = staged_capacity ? staged_capacity * 2 : 1024;
+        Entry *grown = realloc(staged, (size_t)new_cap * sizeof(Entry));
+        if (!grown) return 0;
+        staged = grown;
+        staged_capacity = new_cap;
+    }
+    if (staged_names_len + len + 1 > staged_names_cap) {
+        size_t new_cap = staged_names_cap ? staged_names_cap : 65536;
+        while (staged_names_len + len + 1 > new_cap) new_cap *= 2;
+        char *grown = realloc(staged_names, new_cap);
+        if (!grown) return 0;
+        staged_names = grown;
+        staged_names_cap = new_cap;
+    }
 
-    entry_count = 0;
-    struct dirent *ent;
+    Entry *e = &staged[staged_count++];
+    e->name_off = (uint32_t)staged_names_len;
+    e->name_len = (uint16_t)len;
+    e->is_dir = is_dir;
+    e->flags = flags;
+    e->size = size;
+    memcpy(staged_names + staged_names_len, name, len + 1);
+    staged_names_len += len + 1;
+    return 1;
+}
 
-    // Add parent directory
-    if (strcmp(path, "/") != 0) {
-        Entry *e = &entries[entry_count];
-        strcpy(e->name, "..");
-        snprintf(e->path, MAX_PATH, "%s/..", path);
-        e->is_dir = 1;
-        entry_count++;
-    }
-
-    // Add "New File" option
-    Entry *new_e = &entries[entry_count];
-    strcpy(new_e->name, "[+ New File]");
-    strcpy(new_e->path, "");
-    new_e->is_dir = 0;
-    new_e->size = 0;
-    entry_count++;
-    
-    // Add "New Folder" option
-    Entry *new_f = &entries[entry_count];
-    strcpy(new_f->name, "[+ New Folder]");
-    strcpy(new_f->path, "");
-    new_f->is_dir = 0;
-    new_f->size = 0;
-    entry_count++;
-
-    while ((ent = readdir(dir)) && entry_count < MAX_ENTRIES) {
-        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
-        if (ent->d_name[0] == '.') continue;
+void *dir_loader(void *arg) {
+    LoaderArgs args = *(LoaderArgs *)arg;
+    free(arg);
+
+    char *buf = malloc(LOADER_BUF);
+    while (buf) {
+        long n = syscall(SYS_getdents64, args.fd, buf, LOADER_BUF);
+        if (n <= 0) break;
+
+        pthread_mutex_lock(&listing_lock);
+        int stale = args.generation != load_generation;
+        for (long off = 0; off < n && !stale; ) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + off);
+            off += d->d_reclen;
+            if (d->d_name[0] == '.') continue; // also skips "." and ".."
+
+            // d_type answers "is it a directory?" without a stat; sizes of
+            // plain files are fetched later, only for rows that get drawn.
+            // Symlinks and filesystems without d_type need fstatat(), which
+            // the metadata worker does when lazy_metadata is on.
+            if (d->d_type == DT_DIR) {
+                stage_entry(d->d_name, 1, 0, 0);
+            } else if (d->d_type != DT_UNKNOWN && d->d_type != DT_LNK) {
+                stage_entry(d->d_name, 0, 0, ENTRY_SIZE_PENDING);
+            } else if (lazy_metadata) {
+                stage_entry(d->d_name, 0, 0, ENTRY_SIZE_PENDING | ENTRY_TYPE_PENDING);
+            } else {
+                struct stat st;
+                pthread_mutex_unlock(&listing_lock);
+                int ok = fstatat(args.fd, d->d_name, &st, 0) == 0;
+                pthread_mutex_lock(&listing_lock);
+                // Another load may have started while the lock was dropped
+                stale = args.generation != load_generation;
+                if (ok && !stale) stage_entry(d->d_name, S_ISDIR(st.st_mode), st.st_size, 0);
+            }
+        }
+        if (stale) {
+            pthread_mutex_unlock(&listing_lock);
+            break;
+        }
+        pthread_cond_broadcast(&load_cond);
+        pthread_mutex_unlock(&listing_lock);
+    }
 
-        Entry *e = &entries[entry_count];
-        strncpy(e->name, ent->d_name, 255);
-        snprintf(e->path, MAX_PATH, "%s/%s", path, ent->d_name);
+    pthread_mutex_lock(&listing_lock);
+    if (args.generation == load_generation) {
+        dir_loading = 0;
+        pthread_cond_broadcast(&load_cond);
+    }
+    pthread_mutex_unlock(&listing_lock);
 
-        struct stat st;
-        if (stat(e->path, &st) == 0) {
-            e->is_dir = S_ISDIR(st.st_mode);
-            e->size = st.st_size;
-            entry_count++;
+    free(buf);
+    close(args.fd);
+    return NULL;
+}
+
+// Sort entries [old_count, entry_count) and merge them into the sorted
+// listing, keeping the selected entry on the same screen row.
+void merge_new_entries(int old_count) {
+    int start = first_real_entry();
+    int k = entry_count - old_count;
+    if (k <= 0) return;
+    if (old_count < start) old_count = start;
+    qsort(entries + old_count, entry_count - old_count, sizeof(Entry), compare_entries);
+
+    Entry *tmp = malloc((size_t)k * sizeof(Entry));
+    if (!tmp) {
+        sort_listing();
+        return;
+    }
+    memcpy(tmp, entries + old_count, (size_t)k * sizeof(Entry));
+
+    int i = old_count - 1, j = k - 1, p = entry_count - 1;
+    int new_selected = selected;
+    while (j >= 0) {
+        if (i >= start && compare_entries(&entries[i], &tmp[j]) > 0) {
+            if (i == selected) new_selected = p;
+            entries[p--] = entries[i--];
+        } else {
+            entries[p--] = tmp[j--];
         }
     }
-    closedir(dir);
+    free(tmp);
 
-    if (entry_count > 3) {  // Changed from 2 to 3
-        int start = (strcmp(entries[0].name, "..") == 0) ? 3 : 2;  // Changed from 2:1 to 3:2
-        qsort(entries + start, entry_count - start, sizeof(Entry), compare_entries);
+    scroll_offset += new_selected - selected;
+    if (scroll_offset < 0) scroll_offset = 0;
+    selected = new_selected;
+}
+
+// Move staged entries into the listing. Called with listing_lock held.
+// While loading, merges are batched geometrically so a load costs O(n log n)
+// overall rather than O(n) per frame.
+void drain_staged_entries(int force) {
+    if (staged_count == 0) return;
+    int real = entry_count - first_real_entry();
+    if (!force && dir_loading && staged_count * 4 < real) return;
+
+    int old_count = entry_count;
+    for (int i = 0; i < staged_count; i++) {
+        Entry *s = &staged[i];
+        Entry *e = append_entry(staged_names + s->name_off, s->is_dir, s->size);
+        if (!e) break;
+        if (s->flags) mark_meta_pending(e, s->flags);
     }
+    staged_count = 0;
+    staged_names_len = 0;
 
-    selected = 0;
-    scroll_offset = 0;
+    merge_new_entries(old_count);
+    listing_generation++;
 }
 
-void create_new_folder() {
-    int height, width;
-    getmaxyx(stdscr, height, width);
+void dir_cache_unlink(DirCacheEntry *c) {
+    if (c->prev) c->prev->next = c->next; else dir_cache_head = c->next;
+    if (c->next) c->next->prev = c->prev; else dir_cache_tail = c->prev;
+    c->prev = c->next = NULL;
+}
 
-    WINDOW *win = newwin(7, 60, (height - 7) / 2, (width - 60) / 2);
+void dir_cache_push_front(DirCacheEntry *c) {
+    c->prev = NULL;
+    c->next = dir_cache_head;
+    if (dir_cache_head) dir_cache_head->prev = c;
+    dir_cache_head = c;
+    if (!dir_cache_tail) dir_cache_tail = c;
+}
 
-    box(win, 0, 0);
-    wattron(win, COLOR_PAIR(1) | A_BOLD);
-    mvwprintw(win, 1, 2, "CREATE NEW FOLDER");
-    wattroff(win, COLOR_PAIR(1) | A_BOLD);
+void dir_cache_drop(DirCacheEntry *c) {
+    dir_cache_unlink(c);
+    dir_cache_bytes -= c->bytes;
+    dir_cache_count--;
+    free(c->entries);
+    free(c->names);
+    free(c);
+}
 
-    mvwprintw(win, 3, 2, "Enter folder name: ");
-    wrefresh(win);
+DirCacheEntry *dir_cache_find(dev_t dev, ino_t ino) {
+    for (DirCacheEntry *c = dir_cache_head; c; c = c->next) {
+        if (c->dev == dev && c->ino == ino) return c;
+    }
+    return NULL;
+}
 
-    echo();
-    curs_set(1);
+int timespec_equal(struct timespec a, struct timespec b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
 
-    char foldername[256];
-    mvwgetnstr(win, 3, 21, foldername, 255);
-    
-    // Add this check here:
+// Snapshot the current (complete) listing. Called with listing_lock held.
+void dir_cache_store(const struct stat *st) {
+    DirCacheEntry *old = dir_cache_find(st->st_dev, st->st_ino);
+    if (old) dir_cache_drop(old);
+
+    int start = first_real_entry();
+    int count = entry_count - start;
+    size_t names_len = 0;
+    for (int i = start; i < entry_count; i++) names_len += entries[i].name_len + 1;
+
+    size_t bytes = sizeof(DirCacheEntry) + (size_t)count * sizeof(Entry) + names_len;
+    if (bytes > dir_cache_budget) return;
+
+    DirCacheEntry *c = calloc(1, sizeof(DirCacheEntry));
+    if (!c) return;
+    c->entries = malloc((size_t)(count > 0 ? count : 1) * sizeof(Entry));
+    c->names = malloc(names_len > 0 ? names_len : 1);
+    if (!c->entries || !c->names) {
+        free(c->entries);
+        free(c->names);
+        free(c);
+        return;
+    }
+
+    size_t off = 0;
+    for (int i = 0; i < count; i++) {
+        Entry *src = &entries[start + i];
+        c->entries[i] = *src;
+        c->entries[i].name_off = (uint32_t)off;
+        memcpy(c->names + off, entry_name(src), src->name_len + 1);
+        off += src->name_len + 1;
+    }
+    c->dev = st->st_dev;
+    c->ino = st->st_ino;
+    c->mtime = st->st_mtim;
+    c->ctime = st->st_ctim;
+    c->count = count;
+    c->names_len = names_len;
+    c->bytes = bytes;
+
+    dir_cache_push_front(c);
+    dir_cache_count++;
+    dir_cache_bytes += bytes;
+    while (dir_cache_tail && dir_cache_tail != c &&
+           (dir_cache_bytes > dir_cache_budget || dir_cache_count > DIR_CACHE_MAX_DIRS)) {
+        dir_cache_drop(dir_cache_tail);
+        dir_cache_evictions++;
+    }
+}
+
+// Append a cached listing after the special entries. Called with listing_lock held.
+// Returns 0 on a miss (or a stale entry, which is dropped).
+int dir_cache_restore(const struct stat *st) {
+    DirCacheEntry *c = dir_cache_find(st->st_dev, st->st_ino);
+    if (!c || !timespec_equal(c->mtime, st->st_mtim) || !timespec_equal(c->ctime, st->st_ctim)) {
+        if (c) dir_cache_drop(c);
+        dir_cache_misses++;
+        return 0;
+    }
+
+    if (entry_count + c->count > entry_capacity) {
+        int new_cap = entry_capacity ? entry_capacity : 256;
+        while (new_cap < entry_count + c->count) new_cap *= 2;
+        Entry *grown = realloc(entries, (size_t)new_cap * sizeof(Entry));
+        if (!grown) return 0;
+        entries = grown;
+        entry_capacity = new_cap;
+    }
+    if (name_arena_len + c->names_len > name_arena_cap) {
+        size_t new_cap = name_arena_cap ? name_arena_cap : 4096;
+        while (new_cap < name_arena_len + c->names_len) new_cap *= 2;
+        char *grown = realloc(name_arena, new_cap);
+        if (!grown) return 0;
+        name_arena = grown;
+        name_arena_cap = new_cap;
+    }
+
+    uint32_t base = (uint32_t)name_arena_len;
+    memcpy(name_arena + name_arena_len, c->names, c->names_len);
+    name_arena_len += c->names_len;
+    for (int i = 0; i < c->count; i++) {
+        Entry *e = &entries[entry_count++];
+        *e = c->entries[i];
+        e->name_off += base;
+        // Sizes may have changed without touching the directory mtime
+        if (!e->is_dir && !(e->flags & ENTRY_SIZE_PENDING)) e->flags |= ENTRY_SIZE_STALE;
+        int flags = e->flags & ENTRY_META_PENDING;
+        e->flags &= ~ENTRY_META_PENDING;
+        if (flags) mark_meta_pending(e, flags);
+    }
+
+    dir_cache_unlink(c);
+    dir_cache_push_front(c);
+    dir_cache_hits++;
+    return 1;
+}
+
+// Start enumerating path in the background; the listing fills in as
+// drain_staged_entries() runs from the main loop.
+void begin_directory_load(const char *path) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+
+    struct stat st;
+    int have_stat = fstat(fd, &st) == 0;
+
+    LoaderArgs *args = malloc(sizeof(LoaderArgs));
+    if (!args) {
+        close(fd);
+        return;
+    }
+
+    pthread_mutex_lock(&listing_lock);
+    // Keep the listing we are leaving, if it is complete
+    if (listing_has_stat && !dir_loading && !listing_partial && staged_count == 0) {
+        dir_cache_store(&listing_stat);
+    }
+
+    clear_listing();
+    listing_notice[0] = '\0';
+    strncpy(listing_dir, path, MAX_PATH - 1);
+    listing_dir[MAX_PATH - 1] = '\0';
+    if (listing_fd >= 0) close(listing_fd);
+    listing_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+
+    // Add parent directory
+    if (strcmp(path, "/") != 0) {
+        append_entry("..", 1, 0);
+    }
+
+    // Add "New File" and "New Folder" options
+    append_entry("[+ New File]", 0, 0);
+    append_entry("[+ New Folder]", 0, 0);
+
+    selected = 0;
+    scroll_offset = 0;
+    meta_focus = 0;
+
+    // Watch before enumerating so nothing created meanwhile is missed;
+    // events stay queued until the load has finished.
+    if (watch_fd >= 0) {
+        if (watch_wd >= 0) inotify_rm_watch(watch_fd, watch_wd);
+        watch_wd = inotify_add_watch(watch_fd, path,
+                                     IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                     IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+                                     IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+        if (watch_parent_wd >= 0 && watch_parent_wd != watch_wd) inotify_rm_watch(watch_fd, watch_parent_wd);
+        watch_parent_wd = -1;
+        if (strcmp(path, "/") != 0) {
+            char parent[MAX_PATH];
+            snprintf(parent, sizeof(parent), "%s", path);
+            char *slash = strrchr(parent, '/');
+            if (slash == parent) parent[1] = '\0';
+            else if (slash) *slash = '\0';
+            if (slash) watch_parent_wd = inotify_add_watch(watch_fd, parent, IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR);
+        }
+    }
+
+    staged_count = 0;
+    staged_names_len = 0;
+    listing_partial = 0;
+    listing_has_stat = have_stat;
+    if (have_stat) listing_stat = st;
+    load_generation++;
+
+    if (have_stat && dir_cache_restore(&st)) {
+        dir_loading = 0;
+        close(fd);
+        free(args);
+        pthread_mutex_unlock(&listing_lock);
+        return;
+    }
+
+    dir_loading = 1;
+    args->fd = fd;
+    args->generation = load_generation;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, dir_loader, args) == 0) {
+        pthread_detach(tid);
+    } else {
+        dir_loading = 0;
+        close(fd);
+        free(args);
+    }
+    pthread_mutex_unlock(&listing_lock);
+}
+
+// Block until the current load has finished and everything is merged
+void wait_for_directory_load() {
+    pthread_mutex_lock(&listing_lock);
+    while (dir_loading) {
+        pthread_cond_wait(&load_cond, &listing_lock);
+        drain_staged_entries(0);
+    }
+    drain_staged_entries(1);
+    pthread_mutex_unlock(&listing_lock);
+}
+
+// ESC while loading: stop the loader and keep what has arrived so far
+void cancel_directory_load() {
+    pthread_mutex_lock(&listing_lock);
+    if (dir_loading) {
+        load_generation++;
+        dir_loading = 0;
+        listing_partial = 1;
+    }
+    drain_staged_entries(1);
+    pthread_mutex_unlock(&listing_lock);
+}
+
+void load_directory(const char *path) {
+    begin_directory_load(path);
+    wait_for_directory_load();
+}
+
+void start_directory_watch() {
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+}
+
+int compare_entry_key(const Entry *e, const char *name, int is_dir) {
+    if (e->is_dir != is_dir) return e->is_dir ? -1 : 1;
+    return strcmp(entry_name(e), name);
+}
+
+// Binary search the sorted real entries; returns the slot where name
+// belongs and sets *found when it is already there.
+int find_entry_slot(const char *name, int is_dir, int *found) {
+    int lo = first_real_entry(), hi = entry_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int c = compare_entry_key(&entries[mid], name, is_dir);
+        if (c == 0) {
+            *found = 1;
+            return mid;
+        }
+        if (c < 0) lo = mid + 1; else hi = mid;
+    }
+    *found = 0;
+    return lo;
+}
+
+int find_entry(const char *name, int is_dir_hint) {
+    int found;
+    int idx = find_entry_slot(name, is_dir_hint, &found);
+    if (found) return idx;
+    idx = find_entry_slot(name, !is_dir_hint, &found);
+    return found ? idx : -1;
+}
+
+// The following delta helpers are called with listing_lock held.
+void remove_listing_entry(const char *name, int is_dir_hint) {
+    int idx = find_entry(name, is_dir_hint);
+    if (idx < 0) return;
+
+    if (entries[idx].flags & ENTRY_META_PENDING) meta_pending--;
+    memmove(&entries[idx], &entries[idx + 1], (size_t)(entry_count - idx - 1) * sizeof(Entry));
+    entry_count--;
+    if (selected > idx || selected >= entry_count) selected--;
+    if (selected < 0) selected = 0;
+    // Keep the window on the same entries, and never past the last one
+    if (scroll_offset > idx) scroll_offset--;
+    if (scroll_offset > selected) scroll_offset = selected;
+    listing_generation++;
+}
+
+void add_listing_entry(const char *name) {
+    struct stat st;
+    if (listing_fd < 0 || fstatat(listing_fd, name, &st, 0) != 0) return;
+    int is_dir = S_ISDIR(st.st_mode);
+
+    int found;
+    int idx = find_entry_slot(name, is_dir, &found);
+    if (found) {
+        entries[idx].size = st.st_size;
+        return;
+    }
+    if (find_entry(name, !is_dir) >= 0) remove_listing_entry(name, !is_dir);
+    idx = find_entry_slot(name, is_dir, &found);
+
+    if (!append_entry(name, is_dir, st.st_size)) return;
+    Entry added = entries[entry_count - 1];
+    memmove(&entries[idx + 1], &entries[idx], (size_t)(entry_count - 1 - idx) * sizeof(Entry));
+    entries[idx] = added;
+    if (selected >= idx) selected++;
+    listing_generation++;
+}
+
+void touch_listing_entry(const char *name, int is_dir_hint) {
+    int idx = find_entry(name, is_dir_hint);
+    if (idx < 0 || entries[idx].is_dir) return;
+    if (lazy_metadata) {
+        if (!(entries[idx].flags & ENTRY_META_PENDING)) mark_meta_pending(&entries[idx], ENTRY_SIZE_STALE);
+    } else {
+        entries[idx].flags |= ENTRY_SIZE_PENDING;
+    }
+}
+
+// The listed directory was renamed or deleted: follow a rename through the
+// open directory fd, otherwise go up to the nearest folder that still exists
+void relocate_listing() {
+    char path[MAX_PATH], link[64];
+    struct stat fd_st, st;
+    ssize_t n = -1;
+    if (listing_fd >= 0 && fstat(listing_fd, &fd_st) == 0 && fd_st.st_nlink > 0) {
+        snprintf(link, sizeof(link), "/proc/self/fd/%d", listing_fd);
+        n = readlink(link, path, sizeof(path) - 1);
+    }
+    int moved = n > 0 && (path[n] = '\0', path[0] == '/') && stat(path, &st) == 0 &&
+                st.st_dev == fd_st.st_dev && st.st_ino == fd_st.st_ino;
+    if (!moved) {
+        snprintf(path, sizeof(path), "%s", listing_dir);
+        do {
+            char *slash = strrchr(path, '/');
+            if (!slash) snprintf(path, sizeof(path), "/");
+            else if (slash == path) path[1] = '\0';
+            else *slash = '\0';
+        } while (strcmp(path, "/") != 0 && (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)));
+    }
+    snprintf(current_dir, sizeof(current_dir), "%s", path);
+    begin_directory_load(current_dir);
+    snprintf(listing_notice, sizeof(listing_notice), "%s", moved ? "folder was moved" : "folder was deleted");
+}
+
+// Apply queued inotify events to the listing. Returns 1 if anything was read.
+int apply_watch_events() {
+    if (watch_fd < 0) return 0;
+
+    pthread_mutex_lock(&listing_lock);
+    if (dir_loading || staged_count > 0) {
+        pthread_mutex_unlock(&listing_lock);
+        return 0;
+    }
+
+    // Stat before draining: later changes move mtime past this and
+    // invalidate the cache entry
+    struct stat st;
+    int have_stat = listing_fd >= 0 && fstat(listing_fd, &st) == 0;
+
+    char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int any = 0, reload = 0, gone = 0;
+    ssize_t n;
+    while ((n = read(watch_fd, buf, sizeof(buf))) > 0) {
+        any = 1;
+        for (char *p = buf; p < buf + n; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                reload = 1;
+                continue;
+            }
+            // Events about the directory itself carry no name
+            if (ev->wd == watch_wd && (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF))) {
+                gone = 1;
+                continue;
+            }
+            if (ev->wd == watch_parent_wd) {
+                const char *base = strrchr(listing_dir, '/');
+                if (ev->len > 0 && (ev->mask & IN_ISDIR) && base && strcmp(ev->name, base + 1) == 0) gone = 1;
+                continue;
+            }
+            if (ev->wd != watch_wd || ev->len == 0 || ev->name[0] == '.') continue;
+
+            int is_dir = (ev->mask & IN_ISDIR) != 0;
+            if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                remove_listing_entry(ev->name, is_dir);
+            } else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                add_listing_entry(ev->name);
+            } else if (ev->mask & (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE)) {
+                touch_listing_entry(ev->name, is_dir);
+            }
+        }
+    }
+    if (reload || gone) {
+        // Events were lost, so neither this listing nor a cached one can
+        // be trusted; the reload must enumerate the directory again
+        DirCacheEntry *c = have_stat ? dir_cache_find(st.st_dev, st.st_ino) : NULL;
+        if (c) dir_cache_drop(c);
+        listing_has_stat = 0;
+    } else if (have_stat) {
+        listing_stat = st;
+        listing_has_stat = 1;
+    }
+    pthread_mutex_unlock(&listing_lock);
+
+    if (gone) {
+        relocate_listing();
+    } else if (reload) {
+        begin_directory_load(listing_dir);
+    }
+    return any;
+}
+
+// Bring the listing up to date after a file operation in current_dir
+void refresh_listing() {
+    if (watch_fd >= 0 && watch_wd >= 0 && strcmp(listing_dir, current_dir) == 0) {
+        wait_for_directory_load();
+        apply_watch_events();
+    } else {
+        load_directory(current_dir);
+    }
+}
+
+// getch() for the main loop: sleeps in poll() on the terminal and the
+// directory watch, and returns ERR when the screen should just be redrawn.
+int ui_getch() {
+    nodelay(stdscr, TRUE);
+    int ch = getch();
+    nodelay(stdscr, FALSE);
+    if (ch != ERR) return ch;
+
+    pthread_mutex_lock(&listing_lock);
+    int watching = watch_fd >= 0 && !dir_loading;
+    pthread_mutex_unlock(&listing_lock);
+
+    struct pollfd fds[2] = {
+        { .fd = STDIN_FILENO, .events = POLLIN },
+        { .fd = watch_fd, .events = POLLIN },
+    };
+    int n = poll(fds, watching ? 2 : 1, background_work_pending() ? UI_TICK_MS : -1);
+    if (n <= 0) return ERR;
+    if (watching && (fds[1].revents & POLLIN)) apply_watch_events();
+    if (fds[0].revents & POLLIN) return getch();
+    return ERR;
+}
+
+void create_new_folder() {
+    int height, width;
+    getmaxyx(stdscr, height, width);
+
+    WINDOW *win = newwin(7, 60, (height - 7) / 2, (width - 60) / 2);
+
+    box(win, 0, 0);
+    wattron(win, COLOR_PAIR(1) | A_BOLD);
+    mvwprintw(win, 1, 2, "CREATE NEW FOLDER");
+    wattroff(win, COLOR_PAIR(1) | A_BOLD);
+
+    mvwprintw(win, 3, 2, "Enter folder name: ");
+    wrefresh(win);
+
+    echo();
+    curs_set(1);
+
+    char foldername[256];
+    mvwgetnstr(win, 3, 21, foldername, 255);
+    
+    // Add this check here:
     if (strlen(foldername) >= 255) {
         foldername[254] = '\0';
     }
@@ -711,11 +2712,11 @@ void create_new_folder() {
 
         // Create directory with default permissions (0755)
         if (mkdir(folderpath, 0755) == 0) {
-            load_directory(current_dir);
+            refresh_listing();
 
             // Find and select the newly created folder
             for (int i = 0; i < entry_count; i++) {
-                if (strcmp(entries[i].name, foldername) == 0) {
+                if (strcmp(entry_name(&entries[i]), foldername) == 0) {
                     selected = i;
                     break;
                 }
@@ -737,7 +2738,7 @@ void move_entry(Entry *e) {
     mvwprintw(win, 1, 2, "MOVE");
     wattroff(win, COLOR_PAIR(1) | A_BOLD);
 
-    mvwprintw(win, 3, 2, "Moving: %s", e->name);
+    mvwprintw(win, 3, 2, "Moving: %s", entry_name(e));
     mvwprintw(win, 4, 2, "From:   %s", current_dir);
     mvwprintw(win, 6, 2, "Enter destination path:");
     mvwprintw(win, 7, 2, "(relative or absolute)");
@@ -771,17 +2772,20 @@ void move_entry(Entry *e) {
         struct stat st;
         if (stat(resolved_dest, &st) == 0 && S_ISDIR(st.st_mode)) {
             // Destination is a directory, move file into it
-            snprintf(final_dest, MAX_PATH, "%s/%s", resolved_dest, e->name);
+            snprintf(final_dest, MAX_PATH, "%s/%s", resolved_dest, entry_name(e));
         } else {
             // Use as-is (for renaming during move)
             strncpy(final_dest, resolved_dest, MAX_PATH);
         }
 
+        char src_path[MAX_PATH];
+        entry_path(e, src_path, sizeof(src_path));
+
         char cmd[MAX_PATH * 2 + 20];
-        snprintf(cmd, sizeof(cmd), "mv '%s' '%s' 2>/dev/null", e->path, final_dest);
+        snprintf(cmd, sizeof(cmd), "mv '%s' '%s' 2>/dev/null", src_path, final_dest);
         
         if (system(cmd) == 0) {
-            load_directory(current_dir);
+            refresh_listing();
         }
     }
 
@@ -799,7 +2803,7 @@ void rename_entry(Entry *e) {
     mvwprintw(win, 1, 2, "RENAME");
     wattroff(win, COLOR_PAIR(1) | A_BOLD);
 
-    mvwprintw(win, 3, 2, "Current: %s", e->name);
+    mvwprintw(win, 3, 2, "Current: %s", entry_name(e));
     mvwprintw(win, 5, 2, "New name: ");
     wrefresh(win);
 
@@ -813,19 +2817,21 @@ void rename_entry(Entry *e) {
     curs_set(0);
     delwin(win);
 
-    if (strlen(newname) > 0 && strcmp(newname, e->name) != 0) {
+    if (strlen(newname) > 0 && strcmp(newname, entry_name(e)) != 0) {
+        char oldpath[MAX_PATH];
         char newpath[MAX_PATH];
+        entry_path(e, oldpath, sizeof(oldpath));
         snprintf(newpath, MAX_PATH, "%s/%s", current_dir, newname);
 
         char cmd[MAX_PATH * 2 + 20];
-        snprintf(cmd, sizeof(cmd), "mv '%s' '%s' 2>/dev/null", e->path, newpath);
+        snprintf(cmd, sizeof(cmd), "mv '%s' '%s' 2>/dev/null", oldpath, newpath);
         
         if (system(cmd) == 0) {
-            load_directory(current_dir);
+            refresh_listing();
             
             // Find and select the renamed entry
             for (int i = 0; i < entry_count; i++) {
-                if (strcmp(entries[i].name, newname) == 0) {
+                if (strcmp(entry_name(&entries[i]), newname) == 0) {
                     selected = i;
                     break;
                 }
@@ -847,14 +2853,30 @@ void draw_ui() {
     char *dir_name = strrchr(current_dir, '/');
     dir_name = dir_name ? dir_name + 1 : current_dir;
     if (strlen(dir_name) == 0) dir_name = "/";
-    mvprintw(0, 2, "[\\] %s", dir_name);
+    pthread_mutex_lock(&listing_lock);
+    drain_staged_entries(0);
+    if (dir_loading) {
+        mvprintw(0, 2, "[\\] %s  (loading %d entries... ESC to stop)", dir_name,
+                 entry_count - first_real_entry() + staged_count);
+    } else if (listing_partial) {
+        mvprintw(0, 2, "[\\] %s  (partial listing: %d entries)", dir_name,
+                 entry_count - first_real_entry());
+    } else if (listing_notice[0]) {
+        mvprintw(0, 2, "[\\] %s  (%s)", dir_name, listing_notice);
+    } else {
+        mvprintw(0, 2, "[\\] %s", dir_name);
+    }
     attroff(COLOR_PAIR(1) | A_BOLD);
 
     // File list
     int list_height = height - 3;
+    meta_focus = scroll_offset;
+    meta_window = list_height * 2;
     for (int i = scroll_offset; i < scroll_offset + list_height && i < entry_count; i++) {
         int y = i - scroll_offset + 1;
         Entry *e = &entries[i];
+        const char *name = entry_name(e);
+        const char *icon = (e->flags & ENTRY_TYPE_PENDING) ? "[?]" : e->is_dir ? "[\\]" : "[~]";
 
         if (i == selected) {
             attron(COLOR_PAIR(2) | A_REVERSE);
@@ -863,29 +2885,34 @@ void draw_ui() {
         }
 
         // Draw tree line
-        if (strcmp(e->name, "..") == 0) {
-            mvprintw(y, 2, "+- [\\] %s", e->name);
-        } else if (strcmp(e->name, "[+ New File]") == 0) {
+        if (strcmp(name, "..") == 0) {
+            mvprintw(y, 2, "+- [\\] %s", name);
+        } else if (strcmp(name, "[+ New File]") == 0) {
             attron(COLOR_PAIR(3) | A_BOLD);
-            mvprintw(y, 2, "+- %s", e->name);
+            mvprintw(y, 2, "+- %s", name);
             attroff(COLOR_PAIR(3) | A_BOLD);
-        } else if (strcmp(e->name, "[+ New Folder]") == 0) {
+        } else if (strcmp(name, "[+ New Folder]") == 0) {
             attron(COLOR_PAIR(4) | A_BOLD);  // Using green (COLOR_PAIR(4))
-            mvprintw(y, 2, "+- %s", e->name);
+            mvprintw(y, 2, "+- %s", name);
             attroff(COLOR_PAIR(4) | A_BOLD);
         } else {
             int is_last = (i == entry_count - 1);
             if (is_last) {
-                mvprintw(y, 2, "`- %s %s", e->is_dir ? "[\\]" : "[~]", e->name);
+                mvprintw(y, 2, "`- %s %s", icon, name);
             } else {
-                mvprintw(y, 2, "|- %s %s", e->is_dir ? "[\\]" : "[~]", e->name);
+                mvprintw(y, 2, "|- %s %s", icon, name);
             }
         }
 
-        // Size/type indicator
-        if (!e->is_dir && strcmp(e->name, "[+ New File]") != 0) {
+        // Size/type indicator, with a placeholder until the worker has it
+        if (!e->is_dir && strcmp(name, "[+ New File]") != 0) {
+            if (!lazy_metadata) ensure_entry_size(e);
             char size_str[20];
-            format_size(e->size, size_str);
+            if (e->flags & ENTRY_SIZE_PENDING) {
+                strcpy(size_str, "...");
+            } else {
+                format_size(e->size, size_str);
+            }
             attron(COLOR_PAIR(3));
             mvprintw(y, width - 12, "%10s", size_str);
             attroff(COLOR_PAIR(3));
@@ -895,6 +2922,7 @@ void draw_ui() {
             attroff(COLOR_PAIR(4));
         }
     }
+    pthread_mutex_unlock(&listing_lock);
 
     // Footer
     attron(COLOR_PAIR(1));
@@ -909,10 +2937,41 @@ void navigate_to(const char *path) {
     char resolved[MAX_PATH];
     if (realpath(path, resolved)) {
         strcpy(current_dir, resolved);
-        load_directory(current_dir);
+        begin_directory_load(current_dir);
     }
 }
 
+void show_cache_stats() {
+    int height, width;
+    getmaxyx(stdscr, height, width);
+
+    WINDOW *win = newwin(11, 50, (height - 11) / 2, (width - 50) / 2);
+    box(win, 0, 0);
+
+    wattron(win, COLOR_PAIR(1) | A_BOLD);
+    mvwprintw(win, 1, 2, "DIRECTORY CACHE");
+    wattroff(win, COLOR_PAIR(1) | A_BOLD);
+
+    pthread_mutex_lock(&listing_lock);
+    unsigned long lookups = dir_cache_hits + dir_cache_misses;
+    char used[20], budget[20];
+    format_size((off_t)dir_cache_bytes, used);
+    format_size((off_t)dir_cache_budget, budget);
+    mvwprintw(win, 3, 2, "Hits: %lu   Misses: %lu   (%.0f%% hit rate)", dir_cache_hits, dir_cache_misses,
+              lookups ? 100.0 * dir_cache_hits / lookups : 0.0);
+    mvwprintw(win, 4, 2, "Listings cached: %d (max %d)", dir_cache_count, DIR_CACHE_MAX_DIRS);
+    mvwprintw(win, 5, 2, "Memory: %s of %s budget", used, budget);
+    mvwprintw(win, 6, 2, "Evictions: %lu", dir_cache_evictions);
+    pthread_mutex_unlock(&listing_lock);
+
+    mvwprintw(win, 9, 2, "Press any key to continue");
+    wrefresh(win);
+    wgetch(win);
+    delwin(win);
+
+    clear();
+}
+
 void open_file(const char *path) {
     endwin();
     char cmd[MAX_PATH + 20];
@@ -972,10 +3031,10 @@ void create_new_file() {
         FILE *f = fopen(filepath, "w");
         if (f) {
             fclose(f);
-            load_directory(current_dir);
+            refresh_listing();
 
             for (int i = 0; i < entry_count; i++) {
-                if (strcmp(entries[i].name, filename) == 0) {
+                if (strcmp(entry_name(&entries[i]), filename) == 0) {
                     selected = i;
                     break;
                 }
@@ -997,7 +3056,7 @@ void delete_entry(Entry *e) {
     mvwprintw(win, 1, 2, "DELETE CONFIRMATION");
     wattroff(win, COLOR_PAIR(1) | A_BOLD);
 
-    mvwprintw(win, 3, 2, "Delete: %s", e->name);
+    mvwprintw(win, 3, 2, "Delete: %s", entry_name(e));
     if (e->is_dir) {
         wattron(win, A_BOLD);
         mvwprintw(win, 4, 2, "WARNING: Entire directory will be deleted!");
@@ -1011,15 +3070,18 @@ void delete_entry(Entry *e) {
     delwin(win);
 
     if (ch == 'y' || ch == 'Y') {
-        char cmd[MAX_PATH + 30];
-        if (e->is_dir) {
-            snprintf(cmd, sizeof(cmd), "rm -rf '%s' 2>/dev/null", e->path);
-        } else {
-            snprintf(cmd, sizeof(cmd), "rm '%s' 2>/dev/null", e->path);
+        DeleteArgs args;
+        args.dirfd = listing_fd;
+        snprintf(args.name, sizeof(args.name), "%s", entry_name(e));
+        entry_path(e, args.path, sizeof(args.path));
+
+        FileJob *job = new_file_job("DELETING", run_delete_job, &args);
+        if (job) {
+            if (args.dirfd >= 0) run_file_job(job);
+            free_file_job(job);
         }
-        system(cmd);
 
-        load_directory(current_dir);
+        refresh_listing();
         if (selected >= entry_count) selected = entry_count - 1;
         if (selected < 0) selected = 0;
     }
@@ -1027,302 +3089,4604 @@ void delete_entry(Entry *e) {
     clear();
 }
 
-int case_insensitive_strstr(const char *haystack, const char *needle) {
-    if (!*needle) return 1;
+// Case-insensitive substring search. ASCII folding only, like tolower() in
+// the C locale the program runs in. The vector kernels compare the first
+// and last needle bytes at 16 (SSE2) or 32 (AVX2) haystack positions at
+// once, folding case in registers, and verify the middle only where both
+// match. The kernel is picked once from the CPU's features.
 
-    int needle_len = strlen(needle);
-    int haystack_len = strlen(haystack);
+#define FOLD_MAX_NEEDLE 256     // longer needles use the scalar kernel
 
-    for (int i = 0; i <= haystack_len - needle_len; i++) {
-        int match = 1;
-        for (int j = 0; j < needle_len; j++) {
-            if (tolower(haystack[i + j]) != tolower(needle[j])) {
-                match = 0;
-                break;
-            }
-        }
-        if (match) return 1;
+static unsigned char fold_table[256];
+uint64_t fuzzy_bits[256]; // fuzzy_mask() bit of each byte
+
+void init_fold_table() {
+    for (int c = 0; c < 256; c++) fold_table[c] = (unsigned char)(c >= 'A' && c <= 'Z' ? c | 0x20 : c);
+    // Fuzzy prefilter: a bit per letter and digit, the rest share 28
+    for (int c = 0; c < 256; c++) {
+        int f = fold_table[c];
+        int bit = f >= 'a' && f <= 'z' ? f - 'a' : f >= '0' && f <= '9' ? 26 + f - '0' : 36 + f % 28;
+        fuzzy_bits[c] = 1ULL << bit;
     }
-    return 0;
 }
 
-void search_in_file(const char *filepath, const char *query, const char *display_path) {
-    if (search_result_count >= MAX_SEARCH_RESULTS) return;
+static inline int folded_equal(const unsigned char *h, const unsigned char *folded_needle, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (fold_table[h[i]] != folded_needle[i]) return 0;
+    }
+    return 1;
+}
 
-    FILE *f = fopen(filepath, "r");
-    if (!f) return;
+// Offset of the first match, or -1; needle is already folded and non-empty
+long find_folded_scalar(const unsigned char *h, size_t h_len, const unsigned char *needle, size_t n_len) {
+    if (n_len > h_len) return -1;
+    unsigned char first = needle[0];
+    for (size_t i = 0; i + n_len <= h_len; i++) {
+        if (fold_table[h[i]] == first && folded_equal(h + i + 1, needle + 1, n_len - 1)) return (long)i;
+    }
+    return -1;
+}
 
-    char line[1024];
-    int line_num = 1;
-    int found = 0;
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
 
-    while (fgets(line, sizeof(line), f) && !found) {
-        if (case_insensitive_strstr(line, query)) {
-            SearchResult *r = &search_results[search_result_count++];
-            r->type = 2; // content match
-            r->is_dir = 0;
-
-            // Trim line
-            int len = strlen(line);
-            if (len > 0 && line[len-1] == '\n') line[len-1] = '\0';
-
-            // Truncate if too long
-            if (strlen(line) > 60) {
-                line[57] = '.';
-                line[58] = '.';
-                line[59] = '.';
-                line[60] = '\0';
-            }
+__attribute__((target("sse2")))
+static inline __m128i fold16(__m128i x) {
+    // Bytes in 'A'..'Z' get 0x20 set: shift the range to the bottom of the signed bytes
+    __m128i shifted = _mm_add_epi8(x, _mm_set1_epi8((char)(0x80 - 'A')));
+    __m128i upper = _mm_cmplt_epi8(shifted, _mm_set1_epi8((char)(0x80 + 26)));
+    return _mm_or_si128(x, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
 
-            snprintf(r->display, sizeof(r->display), "[~] %s:%d: %s", display_path, line_num, line);
-            strncpy(r->path, filepath, MAX_PATH);
-            found = 1;
+__attribute__((target("sse2")))
+long find_folded_sse2(const unsigned char *h, size_t h_len, const unsigned char *needle, size_t n_len) {
+    if (n_len > h_len) return -1;
+    const __m128i first = _mm_set1_epi8((char)needle[0]);
+    const __m128i last = _mm_set1_epi8((char)needle[n_len - 1]);
+    size_t i = 0;
+    for (; i + n_len - 1 + 16 <= h_len; i += 16) {
+        __m128i a = fold16(_mm_loadu_si128((const __m128i *)(h + i)));
+        __m128i b = fold16(_mm_loadu_si128((const __m128i *)(h + i + n_len - 1)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (n_len <= 2 || folded_equal(h + i + bit + 1, needle + 1, n_len - 2)) return (long)(i + bit);
+            mask &= mask - 1;
         }
-        line_num++;
     }
-
-    fclose(f);
+    long tail = find_folded_scalar(h + i, h_len - i, needle, n_len);
+    return tail < 0 ? -1 : (long)i + tail;
 }
 
-void recursive_search(const char *base_path, const char *query, int max_depth, int current_depth) {
-    if (current_depth > max_depth || search_result_count >= MAX_SEARCH_RESULTS) return;
-
-    DIR *dir = opendir(base_path);
-    if (!dir) return;
+__attribute__((target("avx2")))
+static inline __m256i fold32(__m256i x) {
+    __m256i shifted = _mm256_add_epi8(x, _mm256_set1_epi8((char)(0x80 - 'A')));
+    __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(0x80 + 26)), shifted);
+    return _mm256_or_si256(x, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
 
-    struct dirent *ent;
-    while ((ent = readdir(dir)) && search_result_count < MAX_SEARCH_RESULTS) {
-        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
-        if (ent->d_name[0] == '.') continue;
+__attribute__((target("avx2")))
+long find_folded_avx2(const unsigned char *h, size_t h_len, const unsigned char *needle, size_t n_len) {
+    if (n_len > h_len) return -1;
+    const __m256i first = _mm256_set1_epi8((char)needle[0]);
+    const __m256i last = _mm256_set1_epi8((char)needle[n_len - 1]);
+    size_t i = 0;
+    for (; i + n_len - 1 + 32 <= h_len; i += 32) {
+        __m256i a = fold32(_mm256_loadu_si256((const __m256i *)(h + i)));
+        __m256i b = fold32(_mm256_loadu_si256((const __m256i *)(h + i + n_len - 1)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (n_len <= 2 || folded_equal(h + i + bit + 1, needle + 1, n_len - 2)) return (long)(i + bit);
+            mask &= mask - 1;
+        }
+    }
+    long tail = find_folded_scalar(h + i, h_len - i, needle, n_len);
+    return tail < 0 ? -1 : (long)i + tail;
+}
+#endif
 
-        char full_path[MAX_PATH];
-        snprintf(full_path, MAX_PATH, "%s/%s", base_path, ent->d_name);
+size_t count_newlines_scalar(const unsigned char *p, size_t len) {
+    size_t count = 0;
+    for (size_t i = 0; i < len; i++) count += p[i] == '\n';
+    return count;
+}
 
-        struct stat st;
-        if (stat(full_path, &st) != 0) continue;
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2,popcnt")))
+size_t count_newlines_sse2(const unsigned char *p, size_t len) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t count = 0, i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        count += __builtin_popcount((unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+    }
+    return count + count_newlines_scalar(p + i, len - i);
+}
 
-        int is_dir = S_ISDIR(st.st_mode);
+__attribute__((target("avx2,popcnt")))
+size_t count_newlines_avx2(const unsigned char *p, size_t len) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t count = 0, i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        count += __builtin_popcount((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl)));
+    }
+    return count + count_newlines_scalar(p + i, len - i);
+}
+#endif
+
+// Several literals at once (the "terms" search mode), folded. Up to
+// TEDDY_MAX_TERMS of at least two bytes go through the Teddy filter: term i
+// is in bucket i % TEDDY_BUCKETS, and lo[k][n] / hi[k][n] have the bit of
+// every bucket holding a term whose byte k has low / high nibble n. Two
+// pshufb lookups per fingerprint byte then give, for 16 or 32 positions at
+// once, the buckets that may start there. Others use the Aho-Corasick
+// automaton. See SEARCH PATTERNS.
+#define TEDDY_MAX_TERMS 64
+#define TEDDY_BUCKETS 8
 
-        // Check if name matches
-        if (case_insensitive_strstr(ent->d_name, query)) {
-            SearchResult *r = &search_results[search_result_count++];
-            r->type = is_dir ? 0 : 1;
-            r->is_dir = is_dir;
+typedef struct {
+    int count;
+    unsigned char **terms;
+    size_t *lens;
+    uint16_t (*delta)[256];     // Aho-Corasick: next state for every byte
+    uint8_t *out;               // a term ends in this state
+    int teddy_bytes;            // fingerprint length, 0 when Teddy is not used
+    uint8_t lo[3][16];
+    uint8_t hi[3][16];
+} LiteralSet;
+
+static inline int teddy_verify(const LiteralSet *ls, const unsigned char *s, size_t len, size_t pos, unsigned buckets) {
+    while (buckets) {
+        int b = __builtin_ctz(buckets);
+        buckets &= buckets - 1;
+        for (int i = b; i < ls->count; i += TEDDY_BUCKETS) {
+            if (pos + ls->lens[i] <= len && folded_equal(s + pos, ls->terms[i], ls->lens[i])) return 1;
+        }
+    }
+    return 0;
+}
 
-            // Make path relative to current_dir
-            char *rel_path = full_path + strlen(current_dir);
-            if (*rel_path == '/') rel_path++;
+// Start of the first term in s, or -1
+long teddy_find_scalar(const LiteralSet *ls, const unsigned char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (teddy_verify(ls, s, len, i, (1u << TEDDY_BUCKETS) - 1)) return (long)i;
+    }
+    return -1;
+}
 
-            if (is_dir) {
-                snprintf(r->display, sizeof(r->display), "[\\] %s", rel_path);
-            } else {
-                snprintf(r->display, sizeof(r->display), "[~] %s", rel_path);
-            }
-            strncpy(r->path, full_path, MAX_PATH);
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3")))
+long teddy_find_ssse3(const LiteralSet *ls, const unsigned char *s, size_t len) {
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    int m = ls->teddy_bytes;
+    __m128i lo[3], hi[3];
+    for (int k = 0; k < m; k++) {
+        lo[k] = _mm_loadu_si128((const __m128i *)ls->lo[k]);
+        hi[k] = _mm_loadu_si128((const __m128i *)ls->hi[k]);
+    }
+    size_t i = 0;
+    for (; i + 16 + m - 1 <= len; i += 16) {
+        __m128i res = _mm_set1_epi8((char)0xff);
+        for (int k = 0; k < m; k++) {
+            __m128i in = _mm_loadu_si128((const __m128i *)(s + i + k));
+            __m128i l = _mm_shuffle_epi8(lo[k], _mm_and_si128(in, nibble));
+            __m128i h = _mm_shuffle_epi8(hi[k], _mm_and_si128(_mm_srli_epi16(in, 4), nibble));
+            res = _mm_and_si128(res, _mm_and_si128(l, h));
         }
+        unsigned mask = ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(res, _mm_setzero_si128())) & 0xffff;
+        if (!mask) continue;
+        uint8_t lanes[16];
+        _mm_storeu_si128((__m128i *)lanes, res);
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (teddy_verify(ls, s, len, i + bit, lanes[bit])) return (long)(i + bit);
+            mask &= mask - 1;
+        }
+    }
+    long tail = teddy_find_scalar(ls, s + i, len - i);
+    return tail < 0 ? -1 : (long)i + tail;
+}
 
-        // Recurse into directories
-        if (is_dir) {
-            recursive_search(full_path, query, max_depth, current_depth + 1);
+__attribute__((target("avx2")))
+long teddy_find_avx2(const LiteralSet *ls, const unsigned char *s, size_t len) {
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    int m = ls->teddy_bytes;
+    __m256i lo[3], hi[3];
+    for (int k = 0; k < m; k++) {
+        lo[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)ls->lo[k]));
+        hi[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)ls->hi[k]));
+    }
+    size_t i = 0;
+    for (; i + 32 + m - 1 <= len; i += 32) {
+        __m256i res = _mm256_set1_epi8((char)0xff);
+        for (int k = 0; k < m; k++) {
+            __m256i in = _mm256_loadu_si256((const __m256i *)(s + i + k));
+            __m256i l = _mm256_shuffle_epi8(lo[k], _mm256_and_si256(in, nibble));
+            __m256i h = _mm256_shuffle_epi8(hi[k], _mm256_and_si256(_mm256_srli_epi16(in, 4), nibble));
+            res = _mm256_and_si256(res, _mm256_and_si256(l, h));
         }
-        // Search file contents for non-directories
-        else if (!is_dir && st.st_size < 1024 * 1024) { // Only search files < 1MB
-            char *rel_path = full_path + strlen(current_dir);
-            if (*rel_path == '/') rel_path++;
-            search_in_file(full_path, query, rel_path);
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(res, _mm256_setzero_si256()));
+        if (!mask) continue;
+        uint8_t lanes[32];
+        _mm256_storeu_si256((__m256i *)lanes, res);
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (teddy_verify(ls, s, len, i + bit, lanes[bit])) return (long)(i + bit);
+            mask &= mask - 1;
         }
     }
-
-    closedir(dir);
+    long tail = teddy_find_scalar(ls, s + i, len - i);
+    return tail < 0 ? -1 : (long)i + tail;
+}
+#endif
+
+long (*find_folded_kernel)(const unsigned char *, size_t, const unsigned char *, size_t) = find_folded_scalar;
+size_t (*count_newlines)(const unsigned char *, size_t) = count_newlines_scalar;
+const char *find_folded_name = "scalar";
+long (*teddy_kernel)(const LiteralSet *, const unsigned char *, size_t) = NULL; // NULL: no pshufb
+
+void init_search_kernels() {
+    init_fold_table();
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    int popcnt = __builtin_cpu_supports("popcnt");
+    if (__builtin_cpu_supports("avx2")) {
+        find_folded_kernel = find_folded_avx2;
+        find_folded_name = "avx2";
+        if (popcnt) count_newlines = count_newlines_avx2;
+        teddy_kernel = teddy_find_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        find_folded_kernel = find_folded_sse2;
+        find_folded_name = "sse2";
+        if (popcnt) count_newlines = count_newlines_sse2;
+        if (__builtin_cpu_supports("ssse3")) teddy_kernel = teddy_find_ssse3;
+    }
+#endif
 }
 
-int compare_search_results(const void *a, const void *b) {
-    SearchResult *ra = (SearchResult*)a;
-    SearchResult *rb = (SearchResult*)b;
+// Offset of needle in haystack[0, len) ignoring case, or -1
+long find_case_insensitive(const char *haystack, size_t len, const char *needle, size_t needle_len) {
+    if (needle_len == 0) return 0;
+    if (!fold_table['A']) init_fold_table();
+    unsigned char folded[FOLD_MAX_NEEDLE];
+    if (needle_len > FOLD_MAX_NEEDLE) {
+        // Rare enough to fold into a heap copy
+        unsigned char *big = malloc(needle_len);
+        if (!big) return -1;
+        for (size_t i = 0; i < needle_len; i++) big[i] = fold_table[(unsigned char)needle[i]];
+        long at = find_folded_scalar((const unsigned char *)haystack, len, big, needle_len);
+        free(big);
+        return at;
+    }
+    for (size_t i = 0; i < needle_len; i++) folded[i] = fold_table[(unsigned char)needle[i]];
+    return find_folded_kernel((const unsigned char *)haystack, len, folded, needle_len);
+}
 
-    if (ra->type != rb->type) return ra->type - rb->type;
-    return strcmp(ra->display, rb->display);
+int case_insensitive_strstr(const char *haystack, const char *needle) {
+    if (!*needle) return 1;
+    return find_case_insensitive(haystack, strlen(haystack), needle, strlen(needle)) >= 0;
 }
 
-void perform_search(const char *query) {
-    search_result_count = 0;
-    search_selected = 0;
-    search_scroll = 0;
+// Name matching is fuzzy, in the manner of fzf: the query's characters
+// must appear in the name in order, ignoring case. The shortest window
+// holding them is scored: every matched character earns FUZZY_MATCH, gaps
+// cost, and characters at the start of a word (after a separator, a case
+// change or a letter-digit change) or continuing a run earn bonuses. A
+// 64-bit mask of the characters present rejects most names before any
+// scanning.
+#define FUZZY_MATCH 16
+#define FUZZY_GAP_START (-3)
+#define FUZZY_GAP_EXTEND (-1)
+#define FUZZY_BOUNDARY 8            // first character of a word
+#define FUZZY_CAMEL 7               // lower to upper case, or into digits
+#define FUZZY_CONSECUTIVE 4         // run after a match that had no bonus
+#define FUZZY_MAX_QUERY 255
+
+enum { CHAR_OTHER, CHAR_LOWER, CHAR_UPPER, CHAR_DIGIT };
 
-    if (strlen(query) == 0) return;
+typedef struct {
+    unsigned char text[FUZZY_MAX_QUERY]; // folded
+    size_t len;
+    uint64_t mask;
+} FuzzyPattern;
+
+uint64_t fuzzy_mask(const unsigned char *s, size_t len) {
+    uint64_t mask = 0;
+    for (size_t i = 0; i < len; i++) mask |= fuzzy_bits[s[i]];
+    return mask;
+}
 
-    recursive_search(current_dir, query, 3, 0); // max depth 3
+void fuzzy_compile(FuzzyPattern *p, const char *query) {
+    if (!fold_table['A']) init_fold_table();
+    size_t len = strlen(query);
+    if (len > FUZZY_MAX_QUERY) len = FUZZY_MAX_QUERY;
+    for (size_t i = 0; i < len; i++) p->text[i] = fold_table[(unsigned char)query[i]];
+    p->len = len;
+    p->mask = fuzzy_mask(p->text, len);
+}
 
-    // Sort: folders first, then files, then content
-    qsort(search_results, search_result_count, sizeof(SearchResult), compare_search_results);
+int char_class(unsigned char c) {
+    if (c >= 'a' && c <= 'z') return CHAR_LOWER;
+    if (c >= 'A' && c <= 'Z') return CHAR_UPPER;
+    if (c >= '0' && c <= '9') return CHAR_DIGIT;
+    return c >= 0x80 ? CHAR_LOWER : CHAR_OTHER; // UTF-8 bytes count as letters
 }
 
-void show_search_ui() {
-    int height, width;
-    getmaxyx(stdscr, height, width);
+int fuzzy_bonus(int prev, int cls) {
+    if (cls == CHAR_OTHER) return 0;
+    if (prev == CHAR_OTHER) return FUZZY_BOUNDARY;
+    if ((prev == CHAR_LOWER && cls == CHAR_UPPER) || (prev != CHAR_DIGIT && cls == CHAR_DIGIT)) return FUZZY_CAMEL;
+    return 0;
+}
 
-    int win_height = height - 6;
-    int win_width = width - 10;
-    if (win_width > 100) win_width = 100;
+// Score of name against p, 0 when it does not match
+int fuzzy_score(const FuzzyPattern *p, const char *name, size_t len) {
+    if (p->len == 0) return 1;
+    const unsigned char *s = (const unsigned char *)name;
+    if (len < p->len || (p->mask & ~fuzzy_mask(s, len))) return 0;
+
+    // Forward to the end of the first full match, back to the latest start
+    size_t qi = 0, end = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (fold_table[s[i]] == p->text[qi] && ++qi == p->len) {
+            end = i + 1;
+            break;
+        }
+    }
+    if (qi < p->len) return 0;
+    size_t start = end;
+    for (qi = p->len; qi > 0; ) {
+        start--;
+        if (fold_table[s[start]] == p->text[qi - 1]) qi--;
+    }
 
-    WINDOW *win = newwin(win_height, win_width, 3, (width - win_width) / 2);
+    int score = 0, run = 0, in_gap = 0, first_bonus = 0;
+    qi = 0;
+    int prev = start > 0 ? char_class(s[start - 1]) : CHAR_OTHER;
+    for (size_t i = start; i < end; i++) {
+        int cls = char_class(s[i]);
+        if (qi < p->len && fold_table[s[i]] == p->text[qi]) {
+            int bonus = fuzzy_bonus(prev, cls);
+            if (run == 0) {
+                first_bonus = bonus;
+            } else {
+                // A run keeps the bonus of the word start it began at
+                if (bonus >= FUZZY_BOUNDARY && bonus > first_bonus) first_bonus = bonus;
+                if (first_bonus > bonus) bonus = first_bonus;
+                if (FUZZY_CONSECUTIVE > bonus) bonus = FUZZY_CONSECUTIVE;
+            }
+            score += FUZZY_MATCH + (qi == 0 ? bonus * 2 : bonus);
+            run++;
+            in_gap = 0;
+            qi++;
+        } else {
+            score += in_gap ? FUZZY_GAP_EXTEND : FUZZY_GAP_START;
+            in_gap = 1;
+            run = 0;
+            first_bonus = 0;
+        }
+        prev = cls;
+    }
+    return score > 0 ? score : 1;
+}
 
-    char query[256] = "";
-    int query_len = 0;
+/*
+================================================================================
+                              SEARCH PATTERNS
+================================================================================
+Ctrl+T in the search window switches how the query is read:
+
+  text      the query as typed, ignoring case; names match fuzzily
+  terms     literals separated by "|", ignoring case; any one matches
+  regex     a regular expression, ignoring case
+
+compile_search_pattern() turns the query into a SearchPattern once per
+search, and every thread and file of that search shares it.
+
+Terms go through the Teddy filter (see LiteralSet) when the CPU has
+pshufb, there are at most TEDDY_MAX_TERMS and none is shorter than two
+bytes; otherwise through an Aho-Corasick automaton, one table lookup per
+byte. A single term is plain text search.
+
+A regex is parsed into a tree, compiled into a Thompson NFA and run as a
+lazily built DFA: each set of NFA states a scan reaches becomes a DFA
+state whose transitions are filled in on first use, so matching costs one
+table lookup per byte and never backtracks. Bytes that no part of the
+pattern tells apart share a class, which keeps the tables small. Threads
+fill in transitions under the regex's lock and read them without it. Once
+RE_MAX_STATES states exist, scans step the NFA state sets directly, still
+in linear time. Syntax: . [] [^] [:alpha:] and the other classes, \d \w
+\s \D \W \S * + ? {m,n} | (...) ^ $; "." and negated classes never match a
+newline, so a match stays on one line.
+*/
 
-    int running = 1;
+enum { SEARCH_TEXT, SEARCH_TERMS, SEARCH_REGEX, SEARCH_MODES };
+const char *search_mode_names[SEARCH_MODES] = { "text", "terms", "regex" };
+
+void free_literal_set(LiteralSet *ls) {
+    if (!ls) return;
+    for (int i = 0; i < ls->count; i++) free(ls->terms[i]);
+    free(ls->terms);
+    free(ls->lens);
+    free(ls->delta);
+    free(ls->out);
+    free(ls);
+}
 
-    while (running) {
-        // Perform search
-        perform_search(query);
+// The "|"-separated terms of query; NULL when there are none
+LiteralSet *compile_literal_set(const char *query) {
+    LiteralSet *ls = calloc(1, sizeof(LiteralSet));
+    size_t qlen = strlen(query);
+    if (!ls) return NULL;
+    ls->terms = calloc(qlen / 2 + 1, sizeof(unsigned char *));
+    ls->lens = calloc(qlen / 2 + 1, sizeof(size_t));
+    if (!ls->terms || !ls->lens) {
+        free_literal_set(ls);
+        return NULL;
+    }
+    size_t total = 0;
+    for (const char *p = query; *p; ) {
+        size_t len = strcspn(p, "|");
+        if (len > 0) {
+            unsigned char *term = malloc(len);
+            if (!term) {
+                free_literal_set(ls);
+                return NULL;
+            }
+            for (size_t i = 0; i < len; i++) term[i] = fold_table[(unsigned char)p[i]];
+            ls->terms[ls->count] = term;
+            ls->lens[ls->count++] = len;
+            total += len;
+        }
+        p += len;
+        if (*p == '|') p++;
+    }
+    if (ls->count == 0) {
+        free_literal_set(ls);
+        return NULL;
+    }
+
+    // Aho-Corasick: the trie of the terms, then every missing edge filled
+    // in from the failure state, breadth first
+    size_t states = 1;
+    ls->delta = calloc(total + 1, sizeof(*ls->delta));
+    ls->out = calloc(total + 1, 1);
+    uint16_t *fail = calloc(total + 1, sizeof(uint16_t));
+    uint16_t *queue = malloc((total + 1) * sizeof(uint16_t));
+    if (!ls->delta || !ls->out || !fail || !queue) {
+        free(fail);
+        free(queue);
+        free_literal_set(ls);
+        return NULL;
+    }
+    for (int t = 0; t < ls->count; t++) {
+        size_t s = 0;
+        for (size_t i = 0; i < ls->lens[t]; i++) {
+            unsigned char c = ls->terms[t][i];
+            if (!ls->delta[s][c]) ls->delta[s][c] = (uint16_t)states++;
+            s = ls->delta[s][c];
+        }
+        ls->out[s] = 1;
+    }
+    size_t head = 0, tail = 0;
+    for (int c = 0; c < 256; c++) {
+        if (ls->delta[0][c]) queue[tail++] = ls->delta[0][c];
+    }
+    while (head < tail) {
+        uint16_t s = queue[head++];
+        ls->out[s] |= ls->out[fail[s]];
+        for (int c = 0; c < 256; c++) {
+            uint16_t next = ls->delta[s][c];
+            if (next) {
+                fail[next] = ls->delta[fail[s]][c];
+                queue[tail++] = next;
+            } else {
+                ls->delta[s][c] = ls->delta[fail[s]][c];
+            }
+        }
+    }
+    // Upper case bytes go where their folded selves go
+    for (size_t s = 0; s < states; s++) {
+        for (int c = 'A'; c <= 'Z'; c++) ls->delta[s][c] = ls->delta[s][c | 0x20];
+    }
+    free(fail);
+    free(queue);
+
+    size_t min_len = ls->lens[0];
+    for (int t = 1; t < ls->count; t++) {
+        if (ls->lens[t] < min_len) min_len = ls->lens[t];
+    }
+    if (teddy_kernel && ls->count <= TEDDY_MAX_TERMS && min_len >= 2) {
+        ls->teddy_bytes = min_len < 3 ? (int)min_len : 3;
+        for (int t = 0; t < ls->count; t++) {
+            uint8_t bit = 1u << (t % TEDDY_BUCKETS);
+            for (int k = 0; k < ls->teddy_bytes; k++) {
+                unsigned char c = ls->terms[t][k];
+                unsigned char upper = c >= 'a' && c <= 'z' ? c - 0x20 : c;
+                ls->lo[k][c & 15] |= bit;
+                ls->hi[k][c >> 4] |= bit;
+                ls->lo[k][upper & 15] |= bit;
+                ls->hi[k][upper >> 4] |= bit;
+            }
+        }
+    }
+    return ls;
+}
+
+// Where the first term in s starts (Teddy) or ends (Aho-Corasick), or -1
+long literal_set_find(const LiteralSet *ls, const unsigned char *s, size_t len) {
+    if (ls->teddy_bytes) return teddy_kernel(ls, s, len);
+    unsigned state = 0;
+    for (size_t i = 0; i < len; i++) {
+        state = ls->delta[state][s[i]];
+        if (ls->out[state]) return (long)i;
+    }
+    return -1;
+}
+
+#define RE_MAX_NODES 8192
+#define RE_MAX_STATES 4096
+#define RE_MAX_REPEAT 1000
+#define RE_MAX_WORK (1 << 20)   // re_compile steps; nested repeats multiply
+
+enum { RE_BYTES, RE_SPLIT, RE_BOL, RE_EOL, RE_MATCH };
+enum { AST_EMPTY, AST_SET, AST_CAT, AST_ALT, AST_REPEAT, AST_BOL, AST_EOL };
+
+typedef struct {
+    uint8_t type;
+    int a, b;                   // children
+    int min, max;               // AST_REPEAT; max -1 is unbounded
+    uint32_t set[8];            // AST_SET
+} ReAst;
+
+typedef struct {
+    const char *p;
+    ReAst *ast;
+    int count;
+    int cap;
+    const char *error;
+} ReParser;
+
+typedef struct {
+    uint8_t op;
+    int out, out1;              // RE_SPLIT follows both
+    uint32_t set[8];            // RE_BYTES
+} ReNode;
+
+// A set of NFA nodes: sparse set, plus a stack for closures
+typedef struct {
+    int *dense;
+    int *sparse;
+    int *stack;
+    int n;
+} ReSet;
+
+typedef struct {
+    int *nfa;                   // sorted: RE_BYTES, RE_MATCH and RE_EOL nodes
+    int n;
+    int accept;                 // a match ends before the next byte
+    int accept_eol;             // ... if the next byte ends the line
+    atomic_int next[];          // per byte class; -1 until first used
+} DfaState;
+
+typedef struct {
+    ReNode *nodes;
+    int node_count;
+    int node_cap;
+    int start;                  // NFA start node
+    int work;                   // re_compile steps left
+    uint8_t byte_class[256];
+    int classes;
+    pthread_mutex_t lock;       // adding states and transitions
+    DfaState **states;          // RE_MAX_STATES slots, never moved
+    atomic_int state_count;
+    int *table;                 // hash of the states, under lock
+    ReSet scratch[2];           // under lock
+    int dfa_start;
+} Regex;
+
+static inline int set_has(const uint32_t *set, unsigned char c) {
+    return set[c >> 5] >> (c & 31) & 1;
+}
+
+static inline void set_add(uint32_t *set, unsigned char c) {
+    set[c >> 5] |= 1u << (c & 31);
+}
+
+int re_ast(ReParser *ps, int type) {
+    if (ps->count == ps->cap) {
+        int cap = ps->cap ? ps->cap * 2 : 64;
+        ReAst *ast = realloc(ps->ast, cap * sizeof(ReAst));
+        if (!ast) {
+            ps->error = "out of memory";
+            return -1;
+        }
+        ps->ast = ast;
+        ps->cap = cap;
+    }
+    ReAst *a = &ps->ast[ps->count];
+    memset(a, 0, sizeof(*a));
+    a->type = type;
+    return ps->count++;
+}
+
+// Add \d \w \s (or their negations) to set; 0 if e is not one of them
+int re_class_escape(uint32_t *set, char e) {
+    uint32_t add[8] = {0};
+    switch (e | 0x20) {
+        case 'd':
+            for (int c = '0'; c <= '9'; c++) set_add(add, c);
+            break;
+        case 'w':
+            for (int c = 0; c < 256; c++) {
+                if (isalnum(c) || c == '_') set_add(add, c);
+            }
+            break;
+        case 's':
+            for (const char *p = " \t\n\r\f\v"; *p; p++) set_add(add, *p);
+            break;
+        default:
+            return 0;
+    }
+    int negate = e >= 'A' && e <= 'Z';
+    for (int i = 0; i < 8; i++) set[i] |= negate ? ~add[i] : add[i];
+    if (negate) set['\n' >> 5] &= ~(1u << ('\n' & 31));
+    return 1;
+}
+
+// The byte an escape stands for: \n \t \r \xHH, or the character itself
+unsigned char re_escape_byte(ReParser *ps) {
+    char e = *ps->p++;
+    switch (e) {
+        case 'n': return '\n';
+        case 't': return '\t';
+        case 'r': return '\r';
+        case 'x':
+            if (isxdigit((unsigned char)ps->p[0]) && isxdigit((unsigned char)ps->p[1])) {
+                char hex[3] = { ps->p[0], ps->p[1], 0 };
+                ps->p += 2;
+                return (unsigned char)strtol(hex, NULL, 16);
+            }
+            return 'x';
+        default:
+            return (unsigned char)e;
+    }
+}
+
+// Letters match in either case
+void re_fold_set(uint32_t *set) {
+    for (int c = 'a'; c <= 'z'; c++) {
+        if (set_has(set, c) || set_has(set, c - 0x20)) {
+            set_add(set, c);
+            set_add(set, c - 0x20);
+        }
+    }
+}
+
+int re_parse_alt(ReParser *ps);
+
+// [:name:] inside a class; 0 if p does not start one
+int re_named_class(ReParser *ps, uint32_t *set) {
+    static const struct { const char *name; int (*test)(int); } named[] = {
+        { "alpha", isalpha }, { "digit", isdigit }, { "alnum", isalnum }, { "space", isspace },
+        { "upper", isupper }, { "lower", islower }, { "punct", ispunct }, { "xdigit", isxdigit },
+        { "blank", isblank }, { "cntrl", iscntrl }, { "print", isprint }, { "graph", isgraph },
+    };
+    if (ps->p[0] != '[' || ps->p[1] != ':') return 0;
+    const char *end = strstr(ps->p + 2, ":]");
+    if (!end) return 0;
+    for (size_t i = 0; i < sizeof(named) / sizeof(named[0]); i++) {
+        if (strlen(named[i].name) == (size_t)(end - ps->p - 2) && strncmp(ps->p + 2, named[i].name, end - ps->p - 2) == 0) {
+            for (int c = 0; c < 128; c++) {
+                if (named[i].test(c)) set_add(set, c);
+            }
+            ps->p = end + 2;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int re_parse_class(ReParser *ps, int node) {
+    uint32_t *set = ps->ast[node].set;
+    int negate = *ps->p == '^';
+    if (negate) ps->p++;
+    int first = 1;
+    while (*ps->p && (*ps->p != ']' || first)) {
+        first = 0;
+        if (re_named_class(ps, set)) continue;
+        unsigned char lo;
+        if (*ps->p == '\\' && ps->p[1]) {
+            ps->p++;
+            if (re_class_escape(set, *ps->p)) {
+                ps->p++;
+                continue;
+            }
+            lo = re_escape_byte(ps);
+        } else {
+            lo = (unsigned char)*ps->p++;
+        }
+        unsigned char hi = lo;
+        if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+            ps->p++;
+            if (*ps->p == '\\' && ps->p[1]) {
+                ps->p++;
+                hi = re_escape_byte(ps);
+            } else {
+                hi = (unsigned char)*ps->p++;
+            }
+            if (hi < lo) {
+                ps->error = "bad range in []";
+                return -1;
+            }
+        }
+        for (unsigned c = lo; c <= hi; c++) set_add(set, c);
+    }
+    if (*ps->p != ']') {
+        ps->error = "missing ]";
+        return -1;
+    }
+    ps->p++;
+    re_fold_set(set);
+    if (negate) {
+        for (int i = 0; i < 8; i++) set[i] = ~set[i];
+        set['\n' >> 5] &= ~(1u << ('\n' & 31));
+    }
+    return node;
+}
+
+int re_parse_atom(ReParser *ps) {
+    char c = *ps->p;
+    int node;
+    switch (c) {
+        case '(':
+            ps->p++;
+            if (ps->p[0] == '?' && ps->p[1] == ':') ps->p += 2;
+            node = re_parse_alt(ps);
+            if (node < 0) return -1;
+            if (*ps->p != ')') {
+                ps->error = "missing )";
+                return -1;
+            }
+            ps->p++;
+            return node;
+        case '[':
+            ps->p++;
+            node = re_ast(ps, AST_SET);
+            return node < 0 ? -1 : re_parse_class(ps, node);
+        case '^':
+        case '$':
+            ps->p++;
+            return re_ast(ps, c == '^' ? AST_BOL : AST_EOL);
+        case '*':
+        case '+':
+        case '?':
+            ps->error = "nothing to repeat";
+            return -1;
+    }
+    node = re_ast(ps, AST_SET);
+    if (node < 0) return -1;
+    uint32_t *set = ps->ast[node].set;
+    if (c == '.') {
+        ps->p++;
+        memset(set, 0xff, 8 * sizeof(uint32_t));
+        set['\n' >> 5] &= ~(1u << ('\n' & 31));
+    } else if (c == '\\' && ps->p[1]) {
+        ps->p++;
+        if (re_class_escape(set, *ps->p)) {
+            ps->p++;
+        } else {
+            set_add(set, re_escape_byte(ps));
+        }
+    } else {
+        ps->p++;
+        set_add(set, (unsigned char)c);
+    }
+    re_fold_set(set);
+    return node;
+}
+
+// The count at ps->p into *count; 0 when there is none or it passes
+// RE_MAX_REPEAT, checked before it is narrowed to an int
+int re_parse_count(ReParser *ps, int *count) {
+    char *end;
+    errno = 0;
+    long n = strtol(ps->p, &end, 10);
+    if (end == ps->p || errno == ERANGE || n > RE_MAX_REPEAT) return 0;
+    ps->p = end;
+    *count = (int)n;
+    return 1;
+}
+
+int re_parse_repeat(ReParser *ps) {
+    int node = re_parse_atom(ps);
+    // "{" repeats only when a count follows; otherwise it is itself
+    while (node >= 0 && *ps->p && (*ps->p == '{' ? isdigit((unsigned char)ps->p[1]) : strchr("*+?", *ps->p) != NULL)) {
+        int min = 0, max = -1;
+        char q = *ps->p++;
+        if (q == '+') {
+            min = 1;
+        } else if (q == '?') {
+            max = 1;
+        } else if (q == '{') {
+            int ok = re_parse_count(ps, &min);
+            max = min;
+            if (ok && *ps->p == ',') {
+                ps->p++;
+                max = -1;
+                if (isdigit((unsigned char)*ps->p)) ok = re_parse_count(ps, &max);
+            }
+            if (!ok || *ps->p != '}' || (max >= 0 && max < min)) {
+                ps->error = "bad {m,n}";
+                return -1;
+            }
+            ps->p++;
+        }
+        if (*ps->p == '?') ps->p++; // lazy makes no difference to whether a line matches
+        int rep = re_ast(ps, AST_REPEAT);
+        if (rep < 0) return -1;
+        ps->ast[rep].a = node;
+        ps->ast[rep].min = min;
+        ps->ast[rep].max = max;
+        node = rep;
+    }
+    return node;
+}
+
+int re_parse_cat(ReParser *ps) {
+    int left = -1;
+    while (*ps->p && *ps->p != '|' && *ps->p != ')') {
+        int right = re_parse_repeat(ps);
+        if (right < 0) return -1;
+        if (left < 0) {
+            left = right;
+            continue;
+        }
+        int cat = re_ast(ps, AST_CAT);
+        if (cat < 0) return -1;
+        ps->ast[cat].a = left;
+        ps->ast[cat].b = right;
+        left = cat;
+    }
+    return left >= 0 ? left : re_ast(ps, AST_EMPTY);
+}
+
+int re_parse_alt(ReParser *ps) {
+    int left = re_parse_cat(ps);
+    while (left >= 0 && *ps->p == '|') {
+        ps->p++;
+        int right = re_parse_cat(ps);
+        if (right < 0) return -1;
+        int alt = re_ast(ps, AST_ALT);
+        if (alt < 0) return -1;
+        ps->ast[alt].a = left;
+        ps->ast[alt].b = right;
+        left = alt;
+    }
+    return left;
+}
+
+int re_emit(Regex *re, int op, int out, int out1, const uint32_t *set) {
+    if (re->node_count == re->node_cap) {
+        int cap = re->node_cap ? re->node_cap * 2 : 64;
+        ReNode *nodes = cap <= RE_MAX_NODES ? realloc(re->nodes, cap * sizeof(ReNode)) : NULL;
+        if (!nodes) return -1;
+        re->nodes = nodes;
+        re->node_cap = cap;
+    }
+    ReNode *n = &re->nodes[re->node_count];
+    n->op = op;
+    n->out = out;
+    n->out1 = out1;
+    if (set) memcpy(n->set, set, sizeof(n->set));
+    return re->node_count++;
+}
+
+// Compile ast so that it continues into node next; returns its first node.
+// Built back to front, so every node's successors already exist. Bounded
+// repeats compile their body once per count, so the steps are budgeted:
+// bodies that emit nothing, as in ((){1000}){1000}, never hit the node cap.
+int re_compile(Regex *re, const ReParser *ps, int ast, int next) {
+    if (next < 0 || --re->work < 0) return -1;
+    const ReAst *a = &ps->ast[ast];
+    switch (a->type) {
+        case AST_EMPTY:
+            return next;
+        case AST_SET:
+            return re_emit(re, RE_BYTES, next, -1, a->set);
+        case AST_BOL:
+            return re_emit(re, RE_BOL, next, -1, NULL);
+        case AST_EOL:
+            return re_emit(re, RE_EOL, next, -1, NULL);
+        case AST_CAT:
+            return re_compile(re, ps, a->a, re_compile(re, ps, a->b, next));
+        case AST_ALT: {
+            int left = re_compile(re, ps, a->a, next);
+            int right = re_compile(re, ps, a->b, next);
+            return left < 0 || right < 0 ? -1 : re_emit(re, RE_SPLIT, left, right, NULL);
+        }
+        default: { // AST_REPEAT
+            int r = next;
+            if (a->max < 0) {
+                int loop = re_emit(re, RE_SPLIT, -1, next, NULL);
+                int body = loop < 0 ? -1 : re_compile(re, ps, a->a, loop);
+                if (body < 0) return -1;
+                re->nodes[loop].out = body;
+                r = loop;
+            } else {
+                // x{0,k} is (x(x(...)?)?)?
+                for (int i = a->min; i < a->max && r >= 0; i++) {
+                    int body = re_compile(re, ps, a->a, r);
+                    r = body < 0 ? -1 : re_emit(re, RE_SPLIT, body, next, NULL);
+                }
+            }
+            for (int i = 0; i < a->min && r >= 0; i++) r = re_compile(re, ps, a->a, r);
+            return r;
+        }
+    }
+}
+
+int re_set_init(ReSet *s, int nodes) {
+    s->dense = malloc(nodes * sizeof(int));
+    s->sparse = malloc(nodes * sizeof(int));
+    s->stack = malloc(nodes * sizeof(int));
+    s->n = 0;
+    return s->dense && s->sparse && s->stack;
+}
+
+void re_set_free(ReSet *s) {
+    free(s->dense);
+    free(s->sparse);
+    free(s->stack);
+}
+
+static inline int re_set_add(ReSet *s, int x) {
+    if ((unsigned)s->sparse[x] < (unsigned)s->n && s->dense[s->sparse[x]] == x) return 0;
+    s->sparse[x] = s->n;
+    s->dense[s->n++] = x;
+    return 1;
+}
+
+// Add node x and everything reachable from it without input. ^ passes at
+// the start of a line, $ only when eol says the line ends here.
+void re_closure(const Regex *re, ReSet *s, int x, int bol, int eol) {
+    int top = 0;
+    if (re_set_add(s, x)) s->stack[top++] = x;
+    while (top > 0) {
+        const ReNode *n = &re->nodes[s->stack[--top]];
+        int next[2] = { -1, -1 };
+        if (n->op == RE_SPLIT) {
+            next[0] = n->out;
+            next[1] = n->out1;
+        } else if ((n->op == RE_BOL && bol) || (n->op == RE_EOL && eol)) {
+            next[0] = n->out;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (next[i] >= 0 && re_set_add(s, next[i])) s->stack[top++] = next[i];
+        }
+    }
+}
+
+// The states in (nfa, n) plus those a line end right here lets through
+void re_expand_eol(const Regex *re, const int *nfa, int n, ReSet *out) {
+    out->n = 0;
+    for (int i = 0; i < n; i++) {
+        if (re->nodes[nfa[i]].op == RE_EOL) {
+            re_closure(re, out, nfa[i], 0, 1);
+        } else {
+            re_set_add(out, nfa[i]);
+        }
+    }
+}
+
+int re_set_accepts(const Regex *re, const ReSet *s) {
+    for (int i = 0; i < s->n; i++) {
+        if (re->nodes[s->dense[i]].op == RE_MATCH) return 1;
+    }
+    return 0;
+}
+
+// After byte c: the successors of (nfa, n) on c, plus a fresh start since
+// a match may begin anywhere. tmp is scratch.
+void re_step(const Regex *re, const int *nfa, int n, unsigned char c, ReSet *tmp, ReSet *out) {
+    if (c == '\n') {
+        re_expand_eol(re, nfa, n, tmp);
+        nfa = tmp->dense;
+        n = tmp->n;
+    }
+    out->n = 0;
+    for (int i = 0; i < n; i++) {
+        const ReNode *node = &re->nodes[nfa[i]];
+        if (node->op == RE_BYTES && set_has(node->set, c)) re_closure(re, out, node->out, c == '\n', 0);
+    }
+    re_closure(re, out, re->start, c == '\n', 0);
+}
+
+int compare_ints(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return x < y ? -1 : x > y;
+}
+
+// The DFA state for the node set s (reordered), made if new; -1 when full.
+// Caller holds re->lock.
+int dfa_state(Regex *re, ReSet *s, ReSet *tmp) {
+    // Only nodes that read input, accept or wait for a line end matter
+    int n = 0;
+    for (int i = 0; i < s->n; i++) {
+        int op = re->nodes[s->dense[i]].op;
+        if (op == RE_BYTES || op == RE_MATCH || op == RE_EOL) s->dense[n++] = s->dense[i];
+    }
+    qsort(s->dense, n, sizeof(int), compare_ints);
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < n; i++) h = (h ^ (uint32_t)s->dense[i]) * 16777619u;
+
+    size_t mask = 2 * RE_MAX_STATES - 1;
+    size_t j = h & mask;
+    for (; re->table[j] >= 0; j = (j + 1) & mask) {
+        DfaState *d = re->states[re->table[j]];
+        if (d->n == n && memcmp(d->nfa, s->dense, n * sizeof(int)) == 0) return re->table[j];
+    }
+    int count = atomic_load(&re->state_count);
+    if (count == RE_MAX_STATES) return -1;
+    DfaState *d = malloc(sizeof(DfaState) + re->classes * sizeof(atomic_int) + n * sizeof(int));
+    if (!d) return -1;
+    d->nfa = (int *)(d->next + re->classes);
+    d->n = n;
+    memcpy(d->nfa, s->dense, n * sizeof(int));
+    for (int i = 0; i < re->classes; i++) atomic_init(&d->next[i], -1);
+    s->n = n;
+    d->accept = re_set_accepts(re, s);
+    re_expand_eol(re, d->nfa, n, tmp);
+    d->accept_eol = re_set_accepts(re, tmp);
+    re->states[count] = d;
+    re->table[j] = count;
+    atomic_store(&re->state_count, count + 1);
+    return count;
+}
+
+// Transition of state on c, made if new; -1 when the DFA is full
+int dfa_next(Regex *re, int state, unsigned char c) {
+    pthread_mutex_lock(&re->lock);
+    DfaState *d = re->states[state];
+    int next = atomic_load(&d->next[re->byte_class[c]]);
+    if (next < 0) {
+        re_step(re, d->nfa, d->n, c, &re->scratch[0], &re->scratch[1]);
+        next = dfa_state(re, &re->scratch[1], &re->scratch[0]);
+        if (next >= 0) atomic_store_explicit(&d->next[re->byte_class[c]], next, memory_order_release);
+    }
+    pthread_mutex_unlock(&re->lock);
+    return next;
+}
+
+// The DFA is full: go on from position i by stepping NFA state sets
+long regex_find_nfa(const Regex *re, const unsigned char *s, size_t len, size_t i, const DfaState *from) {
+    ReSet sets[3];
+    int ok = re_set_init(&sets[0], re->node_count) & re_set_init(&sets[1], re->node_count) &
+             re_set_init(&sets[2], re->node_count);
+    long found = -1;
+    if (ok) {
+        ReSet *cur = &sets[0], *next = &sets[1];
+        memcpy(cur->dense, from->nfa, from->n * sizeof(int));
+        cur->n = from->n;
+        for (; i < len && found < 0; i++) {
+            if (s[i] == '\n') {
+                re_expand_eol(re, cur->dense, cur->n, &sets[2]);
+                if (re_set_accepts(re, &sets[2])) {
+                    found = (long)i;
+                    break;
+                }
+            }
+            re_step(re, cur->dense, cur->n, s[i], &sets[2], next);
+            ReSet *t = cur;
+            cur = next;
+            next = t;
+            if (re_set_accepts(re, cur)) found = (long)i;
+        }
+        if (found < 0 && i == len && s[len - 1] != '\n') {
+            re_expand_eol(re, cur->dense, cur->n, &sets[2]);
+            if (re_set_accepts(re, &sets[2])) found = (long)len - 1;
+        }
+    }
+    for (int k = 0; k < 3; k++) re_set_free(&sets[k]);
+    return found;
+}
+
+// An offset inside the first line of s holding a match, or -1
+long regex_find(Regex *re, const unsigned char *s, size_t len) {
+    if (len == 0) return -1;
+    int state = re->dfa_start;
+    DfaState *d = re->states[state];
+    if (d->accept) return 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c == '\n' && d->accept_eol) return (long)i;
+        int next = atomic_load_explicit(&d->next[re->byte_class[c]], memory_order_acquire);
+        if (next < 0 && (next = dfa_next(re, state, c)) < 0) return regex_find_nfa(re, s, len, i, d);
+        state = next;
+        d = re->states[state];
+        if (d->accept) return (long)i;
+    }
+    return s[len - 1] != '\n' && d->accept_eol ? (long)len - 1 : -1;
+}
+
+void free_regex(Regex *re) {
+    if (!re) return;
+    int count = atomic_load(&re->state_count);
+    for (int i = 0; i < count; i++) free(re->states[i]);
+    free(re->states);
+    free(re->table);
+    free(re->nodes);
+    re_set_free(&re->scratch[0]);
+    re_set_free(&re->scratch[1]);
+    pthread_mutex_destroy(&re->lock);
+    free(re);
+}
+
+// Compile pattern; NULL with *error set when it is not valid
+Regex *compile_regex(const char *pattern, const char **error) {
+    ReParser ps = { .p = pattern };
+    int root = re_parse_alt(&ps);
+    if (root >= 0 && *ps.p == ')') {
+        ps.error = "unmatched )";
+        root = -1;
+    }
+    Regex *re = root >= 0 ? calloc(1, sizeof(Regex)) : NULL;
+    if (root >= 0 && !re) ps.error = "out of memory";
+    if (re) {
+        pthread_mutex_init(&re->lock, NULL);
+        int match = re_emit(re, RE_MATCH, -1, -1, NULL);
+        re->work = RE_MAX_WORK;
+        re->start = re_compile(re, &ps, root, match);
+        if (re->start < 0) ps.error = "pattern too large";
+    }
+    free(ps.ast);
+    if (ps.error) {
+        free_regex(re);
+        *error = ps.error;
+        return NULL;
+    }
+
+    // Byte classes: split the bytes by every set the pattern tests, and
+    // the newline apart since ^ and $ look at it
+    int map[256 * 2];
+    re->classes = 1;
+    memset(re->byte_class, 0, sizeof(re->byte_class));
+    for (int k = -1; k < re->node_count; k++) {
+        if (k >= 0 && re->nodes[k].op != RE_BYTES) continue;
+        for (int i = 0; i < 256 * 2; i++) map[i] = -1;
+        int classes = 0;
+        for (int c = 0; c < 256; c++) {
+            int in = k < 0 ? c == '\n' : set_has(re->nodes[k].set, c);
+            int key = re->byte_class[c] * 2 + in;
+            if (map[key] < 0) map[key] = classes++;
+        }
+        for (int c = 0; c < 256; c++) {
+            int in = k < 0 ? c == '\n' : set_has(re->nodes[k].set, c);
+            re->byte_class[c] = map[re->byte_class[c] * 2 + in];
+        }
+        re->classes = classes;
+    }
+
+    re->states = calloc(RE_MAX_STATES, sizeof(DfaState *));
+    re->table = malloc(2 * RE_MAX_STATES * sizeof(int));
+    if (!re->states || !re->table || !re_set_init(&re->scratch[0], re->node_count) ||
+        !re_set_init(&re->scratch[1], re->node_count)) {
+        free_regex(re);
+        *error = "out of memory";
+        return NULL;
+    }
+    memset(re->table, 0xff, 2 * RE_MAX_STATES * sizeof(int));
+    re->scratch[1].n = 0;
+    re_closure(re, &re->scratch[1], re->start, 1, 0);
+    re->dfa_start = dfa_state(re, &re->scratch[1], &re->scratch[0]);
+    if (re->dfa_start < 0) {
+        free_regex(re);
+        *error = "out of memory";
+        return NULL;
+    }
+    return re;
+}
+
+// A query compiled for one search
+typedef struct {
+    int mode;
+    char text[256];             // as typed
+    size_t len;
+    FuzzyPattern fuzzy;         // SEARCH_TEXT names
+    LiteralSet *terms;          // SEARCH_TERMS with more than one term
+    Regex *regex;               // SEARCH_REGEX
+} SearchPattern;
+
+// 0 with error filled in when the query does not compile
+int compile_search_pattern(SearchPattern *p, const char *query, int mode, char *error, size_t error_len) {
+    memset(p, 0, sizeof(*p));
+    p->mode = mode;
+    snprintf(p->text, sizeof(p->text), "%s", query);
+    p->len = strlen(p->text);
+    fuzzy_compile(&p->fuzzy, p->text);
+    if (mode == SEARCH_REGEX && !strpbrk(p->text, ".[]()*+?{}|^$\\")) {
+        // No operators: plain text, which the SIMD kernels find faster
+        return 1;
+    }
+    if (mode == SEARCH_REGEX) {
+        const char *msg = NULL;
+        p->regex = compile_regex(p->text, &msg);
+        if (!p->regex) {
+            snprintf(error, error_len, "%s", msg);
+            return 0;
+        }
+    } else if (mode == SEARCH_TERMS) {
+        p->terms = compile_literal_set(p->text);
+        if (!p->terms) {
+            snprintf(error, error_len, "no terms");
+            return 0;
+        }
+        if (p->terms->count == 1) {
+            // One term is plain text
+            p->len = p->terms->lens[0];
+            memcpy(p->text, p->terms->terms[0], p->len);
+            p->text[p->len] = '\0';
+            free_literal_set(p->terms);
+            p->terms = NULL;
+        }
+    }
+    return 1;
+}
+
+void free_search_pattern(SearchPattern *p) {
+    free_literal_set(p->terms);
+    free_regex(p->regex);
+    p->terms = NULL;
+    p->regex = NULL;
+}
+
+// An offset inside the first line of hay holding a match, or -1
+long pattern_find(const SearchPattern *p, const char *hay, size_t len) {
+    if (p->regex) return regex_find(p->regex, (const unsigned char *)hay, len);
+    if (p->terms) return literal_set_find(p->terms, (const unsigned char *)hay, len);
+    return find_case_insensitive(hay, len, p->text, p->len);
+}
+
+// How well a file or folder name matches; 0 when it does not
+int pattern_name_score(const SearchPattern *p, const char *name) {
+    size_t len = strlen(name);
+    if (p->mode == SEARCH_TEXT) return fuzzy_score(&p->fuzzy, name, len);
+    return pattern_find(p, name, len) >= 0;
+}
+
+// Record a match; 0 once SEARCH_MAX_MATCHES is reached
+int add_search_result(const char *path, const char *shown, int type, int is_dir, int score, const char *display) {
+    SearchResult r;
+    r.path = strdup(path);
+    r.display = strdup(display);
+    r.display_len = (int)strlen(display);
+    r.shown_off = (int)(shown - path);
+    r.type = type;
+    r.is_dir = is_dir;
+    r.score = score;
+
+    int added = 0;
+    pthread_mutex_lock(&search_results_lock);
+    if (search_result_count >= SEARCH_MAX_MATCHES) {
+        search_truncated = 1;
+    } else if (r.path && r.display) {
+        if (search_result_count == search_result_cap) {
+            int cap = search_result_cap ? search_result_cap * 2 : 256;
+            SearchResult *results = realloc(search_results, cap * sizeof(SearchResult));
+            if (results) {
+                search_results = results;
+                search_result_cap = cap;
+            }
+        }
+        if (search_result_count < search_result_cap) {
+            search_results[search_result_count++] = r;
+            added = 1;
+        }
+    }
+    pthread_mutex_unlock(&search_results_lock);
+
+    if (!added) {
+        free(r.path);
+        free(r.display);
+    }
+    return added;
+}
+
+void clear_search_results() {
+    for (int i = 0; i < search_result_count; i++) {
+        free(search_results[i].path);
+        free(search_results[i].display);
+    }
+    search_result_count = 0;
+    search_truncated = 0;
+    search_top_count = 0;
+    search_top_seen = 0;
+}
+
+// Content classes. The first CLASSIFY_BLOCK bytes decide: a BOM, NULs on
+// one side only (UTF-16 without a BOM), other NULs or too many invalid
+// UTF-8 sequences and control bytes (binary). Verdicts are cached by
+// (device, inode, mtime, size), so the walker can skip known binaries
+// without opening them.
+#define CLASSIFY_BLOCK 8192
+#define CLASS_CACHE_SIZE (1 << 16)  // direct mapped
+
+enum { FILE_UNKNOWN, FILE_TEXT, FILE_UTF16LE, FILE_UTF16BE, FILE_BINARY };
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    int64_t mtime_ns;
+    off_t size;
+    int kind;
+} FileClass;
+
+FileClass class_cache[CLASS_CACHE_SIZE];
+pthread_mutex_t class_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+FileClass *class_slot(const struct stat *st) {
+    uint64_t h = ((uint64_t)st->st_ino * 0x9E3779B97F4A7C15ULL) ^ (uint64_t)st->st_dev;
+    return &class_cache[(h >> 16) & (CLASS_CACHE_SIZE - 1)];
+}
+
+int cached_file_class(const struct stat *st) {
+    int64_t mtime = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    pthread_mutex_lock(&class_cache_lock);
+    FileClass *c = class_slot(st);
+    int kind = c->ino == st->st_ino && c->dev == st->st_dev && c->mtime_ns == mtime &&
+               c->size == st->st_size ? c->kind : FILE_UNKNOWN;
+    pthread_mutex_unlock(&class_cache_lock);
+    return kind;
+}
+
+void remember_file_class(const struct stat *st, int kind) {
+    pthread_mutex_lock(&class_cache_lock);
+    FileClass *c = class_slot(st);
+    c->dev = st->st_dev;
+    c->ino = st->st_ino;
+    c->mtime_ns = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    c->size = st->st_size;
+    c->kind = kind;
+    pthread_mutex_unlock(&class_cache_lock);
+}
+
+int file_known_binary(const struct stat *st) {
+    return cached_file_class(st) == FILE_BINARY;
+}
+
+int classify_content(const unsigned char *p, size_t len) {
+    if (len > CLASSIFY_BLOCK) len = CLASSIFY_BLOCK;
+    if (len >= 3 && p[0] == 0xEF && p[1] == 0xBB && p[2] == 0xBF) return FILE_TEXT;
+    if (len >= 2 && p[0] == 0xFF && p[1] == 0xFE) return FILE_UTF16LE;
+    if (len >= 2 && p[0] == 0xFE && p[1] == 0xFF) return FILE_UTF16BE;
+
+    size_t nul_even = 0, nul_odd = 0, suspicious = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (p[i] == 0) {
+            if (i & 1) nul_odd++; else nul_even++;
+        }
+    }
+    if (nul_even || nul_odd) {
+        // ASCII-range UTF-16 has a NUL in every other byte, always the same
+        // one. Characters like U+3000 and U+4E00 put theirs on the other
+        // side, so CJK text only tilts the count; binary data has NULs on
+        // both sides alike.
+        if (nul_odd >= nul_even * 4 && nul_odd * 10 >= len) return FILE_UTF16LE;
+        if (nul_even >= nul_odd * 4 && nul_even * 10 >= len) return FILE_UTF16BE;
+        return FILE_BINARY;
+    }
+
+    for (size_t i = 0; i < len; ) {
+        unsigned char c = p[i];
+        if (c < 0x80) {
+            if (c < 0x20 && c != '\t' && c != '\n' && c != '\r' && c != '\f' && c != '\v' && c != '\b' && c != 0x1b) {
+                suspicious++;
+            }
+            i++;
+            continue;
+        }
+        size_t need = c >= 0xF0 && c <= 0xF4 ? 3 : c >= 0xE0 ? 2 : c >= 0xC2 && c <= 0xDF ? 1 : 0;
+        if (c > 0xF4) need = 0;
+        if (need == 0) {
+            suspicious++;
+            i++;
+            continue;
+        }
+        if (i + need >= len) break; // cut off by the end of the block
+        size_t k = 1;
+        while (k <= need && (p[i + k] & 0xC0) == 0x80) k++;
+        if (k <= need) {
+            suspicious++;
+            i++;
+        } else {
+            i += need + 1;
+        }
+    }
+    return suspicious * 10 > len ? FILE_BINARY : FILE_TEXT;
+}
+
+// UTF-16 to UTF-8, unpaired surrogates become U+FFFD
+char *decode_utf16(const unsigned char *p, size_t len, int big_endian, size_t *out_len) {
+    char *out = malloc(len / 2 * 3 + 1);
+    if (!out) return NULL;
+    size_t n = 0;
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        uint32_t u = big_endian ? (uint32_t)(p[i] << 8 | p[i + 1]) : (uint32_t)(p[i + 1] << 8 | p[i]);
+        if (u >= 0xD800 && u <= 0xDBFF && i + 3 < len) {
+            uint32_t lo = big_endian ? (uint32_t)(p[i + 2] << 8 | p[i + 3]) : (uint32_t)(p[i + 3] << 8 | p[i + 2]);
+            if (lo >= 0xDC00 && lo <= 0xDFFF) {
+                u = 0x10000 + ((u - 0xD800) << 10) + (lo - 0xDC00);
+                i += 2;
+            } else {
+                u = 0xFFFD;
+            }
+        } else if (u >= 0xD800 && u <= 0xDFFF) {
+            u = 0xFFFD;
+        }
+        if (u < 0x80) {
+            out[n++] = (char)u;
+        } else if (u < 0x800) {
+            out[n++] = (char)(0xC0 | u >> 6);
+            out[n++] = (char)(0x80 | (u & 0x3F));
+        } else if (u < 0x10000) {
+            out[n++] = (char)(0xE0 | u >> 12);
+            out[n++] = (char)(0x80 | (u >> 6 & 0x3F));
+            out[n++] = (char)(0x80 | (u & 0x3F));
+        } else {
+            out[n++] = (char)(0xF0 | u >> 18);
+            out[n++] = (char)(0x80 | (u >> 12 & 0x3F));
+            out[n++] = (char)(0x80 | (u >> 6 & 0x3F));
+            out[n++] = (char)(0x80 | (u & 0x3F));
+        }
+    }
+    out[n] = '\0';
+    *out_len = n;
+    return out;
+}
+
+// A file's text in memory: read() into buf when small, mapped otherwise,
+// converted to UTF-8 when it is UTF-16. Binary files do not open.
+//
+// A mapped file can be truncated by whoever is still writing it, and then
+// touching the pages past its new end raises SIGBUS. Callers set
+// map_fault_jmp around opening and scanning a view, and the handler jumps
+// back there so the file is skipped instead of killing the process.
+static __thread sigjmp_buf *map_fault_jmp;
+static pthread_once_t map_fault_once = PTHREAD_ONCE_INIT;
+
+void map_fault_handler(int sig) {
+    if (map_fault_jmp) siglongjmp(*map_fault_jmp, 1);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+void install_map_fault_handler(void) {
+    // SA_NODEFER leaves SIGBUS unblocked after the jump, so sigsetjmp need
+    // not save the signal mask
+    struct sigaction sa = { .sa_handler = map_fault_handler, .sa_flags = SA_NODEFER };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, NULL);
+}
+
+typedef struct {
+    const char *data;           // the text, without a BOM
+    size_t len;
+    void *map;
+    size_t map_len;
+    char *decoded;
+    char buf[SEARCH_READ_SMALL];
+} FileView;
+
+void file_view_close(FileView *v) {
+    if (v->map) munmap(v->map, v->map_len);
+    free(v->decoded);
+    v->map = NULL;
+    v->decoded = NULL;
+}
+
+int file_view_open(FileView *v, const char *path) {
+    v->data = NULL;
+    v->len = 0;
+    v->map = NULL;
+    v->decoded = NULL;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    struct stat st;
+    int kind = FILE_UNKNOWN;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > search_max_file ||
+        (kind = cached_file_class(&st)) == FILE_BINARY) {
+        close(fd);
+        return 0;
+    }
+
+    const char *raw;
+    size_t raw_len;
+    if (st.st_size <= SEARCH_READ_SMALL) {
+        ssize_t n = read(fd, v->buf, sizeof(v->buf));
+        close(fd);
+        if (n < 0) return 0;
+        raw = v->buf;
+        raw_len = n;
+    } else {
+        pthread_once(&map_fault_once, install_map_fault_handler);
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) return 0;
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        v->map = map;
+        v->map_len = st.st_size;
+        raw = map;
+        raw_len = st.st_size;
+    }
+
+    if (kind == FILE_UNKNOWN) {
+        kind = classify_content((const unsigned char *)raw, raw_len);
+        remember_file_class(&st, kind);
+    }
+    const unsigned char *u = (const unsigned char *)raw;
+    if (kind == FILE_BINARY) {
+        file_view_close(v);
+        return 0;
+    } else if (kind == FILE_UTF16LE || kind == FILE_UTF16BE) {
+        int bom = raw_len >= 2 && ((u[0] == 0xFF && u[1] == 0xFE) || (u[0] == 0xFE && u[1] == 0xFF));
+        v->decoded = decode_utf16(u + 2 * bom, raw_len - 2 * bom, kind == FILE_UTF16BE, &v->len);
+        if (!v->decoded) {
+            file_view_close(v);
+            return 0;
+        }
+        v->data = v->decoded;
+    } else {
+        int bom = raw_len >= 3 && u[0] == 0xEF && u[1] == 0xBB && u[2] == 0xBF;
+        v->data = raw + 3 * bom;
+        v->len = raw_len - 3 * bom;
+    }
+    return 1;
+}
+
+// First line of the file holding query, formatted as a content result
+int find_in_file(const char *filepath, const SearchPattern *pat, const char *display_path, char *display, size_t display_len) {
+    FileView view = { 0 };
+    sigjmp_buf fault;
+    if (sigsetjmp(fault, 0)) {
+        // Truncated while mapped
+        map_fault_jmp = NULL;
+        file_view_close(&view);
+        return 0;
+    }
+    map_fault_jmp = &fault;
+    if (!file_view_open(&view, filepath)) {
+        map_fault_jmp = NULL;
+        return 0;
+    }
+
+    // Patterns match within a line; at is somewhere on the first one that matches
+    long at = pattern_find(pat, view.data, view.len);
+    if (at >= 0) {
+        const char *line = view.data + at;
+        while (line > view.data && line[-1] != '\n') line--;
+        const char *end = memchr(view.data + at, '\n', view.len - at);
+        size_t len = end ? (size_t)(end - line) : view.len - (line - view.data);
+        size_t line_num = 1 + count_newlines((const unsigned char *)view.data, line - view.data);
+
+        // Truncate if too long
+        if (len > 60) {
+            snprintf(display, display_len, "[~] %s:%zu: %.57s...", display_path, line_num, line);
+        } else {
+            snprintf(display, display_len, "[~] %s:%zu: %.*s", display_path, line_num, (int)len, line);
+        }
+    }
+
+    file_view_close(&view);
+    map_fault_jmp = NULL;
+    return at >= 0;
+}
+
+// display_path must point into filepath
+void search_in_file(const char *filepath, const SearchPattern *pat, const char *display_path) {
+    char display[512];
+    if (find_in_file(filepath, pat, display_path, display, sizeof(display))) {
+        add_search_result(filepath, display_path, 2, 0, 0, display); // content match
+    }
+}
+
+/*
+================================================================================
+                              IGNORE RULES
+================================================================================
+Search skips what .gitignore and .ignore exclude (Ctrl+G in the search
+window turns this off). Each folder that holds one of those files gets an
+IgnoreLevel with its rules compiled; folders without one share their
+parent's level, so a walk only pays for the files that exist. A level
+knows how long its folder's path is, so an entry is checked against each
+level with the part of the path below that folder.
+
+Rules follow git: the last matching rule wins, deeper files override
+shallower ones, "!" re-includes, a trailing "/" only matches folders, and
+a pattern with a "/" in it is anchored to its folder, otherwise it matches
+the name at any depth. Plain names and "*.ext" are compared directly;
+everything else runs as a small compiled glob. .git/info/exclude is read
+with the .gitignore next to it, at the lowest priority.
+*/
+
+enum { IGNORE_LITERAL, IGNORE_SUFFIX, IGNORE_GLOB };
+enum { GLOB_END, GLOB_CHAR, GLOB_ANY, GLOB_CLASS, GLOB_STAR, GLOB_DIRS, GLOB_REST };
+
+typedef struct {
+    uint8_t op;
+    uint8_t c;                  // GLOB_CHAR
+    uint16_t cls;               // GLOB_CLASS: index into the rule's classes
+} GlobOp;
+
+typedef struct {
+    uint8_t kind;
+    uint8_t negate;
+    uint8_t dir_only;
+    uint8_t anchored;           // matched against the path below the folder, not the name
+    uint16_t len;               // IGNORE_LITERAL / IGNORE_SUFFIX: length of text
+    char *text;
+    GlobOp *ops;
+    uint32_t (*classes)[8];     // 256-bit byte sets
+} IgnoreRule;
+
+typedef struct IgnoreLevel {
+    atomic_int refs;
+    struct IgnoreLevel *parent;
+    int base_len;               // paths of entries in this folder start their name here
+    int count;
+    IgnoreRule rules[];
+} IgnoreLevel;
+
+// Parse "[...]" at p into bits; returns the byte after "]", NULL if unterminated
+const char *glob_class(const char *p, uint32_t bits[8]) {
+    int negate = *p == '!' || *p == '^';
+    if (negate) p++;
+    memset(bits, 0, 8 * sizeof(uint32_t));
+    int first = 1;
+    while (*p && (*p != ']' || first)) {
+        unsigned char lo = *p == '\\' && p[1] ? *++p : *p;
+        unsigned char hi = lo;
+        if (p[1] == '-' && p[2] && p[2] != ']') {
+            p += 2;
+            hi = *p == '\\' && p[1] ? *++p : *p;
+        }
+        for (unsigned c = lo; c <= hi; c++) bits[c >> 5] |= 1u << (c & 31);
+        p++;
+        first = 0;
+    }
+    if (*p != ']') return NULL;
+    if (negate) {
+        for (int i = 0; i < 8; i++) bits[i] = ~bits[i];
+    }
+    bits['/' >> 5] &= ~(1u << ('/' & 31));
+    return p + 1;
+}
+
+// Compile one pattern (already stripped of "!", the trailing "/" and a
+// leading "/") into r; 0 when out of memory
+int compile_ignore_rule(IgnoreRule *r, const char *pat) {
+    size_t len = strlen(pat);
+    int wild = 0;
+    for (const char *p = pat; *p; p++) {
+        if (*p == '*' || *p == '?' || *p == '[' || *p == '\\') wild = 1;
+    }
+    if (!wild && len < 65536) {
+        r->kind = IGNORE_LITERAL;
+        r->text = strdup(pat);
+        r->len = len;
+        return r->text != NULL;
+    }
+    if (!r->anchored && pat[0] == '*' && pat[1] != '*' && len < 65536 && !strpbrk(pat + 1, "*?[\\")) {
+        r->kind = IGNORE_SUFFIX;
+        r->text = strdup(pat + 1);
+        r->len = len - 1;
+        return r->text != NULL;
+    }
+
+    r->kind = IGNORE_GLOB;
+    r->ops = malloc((len + 1) * sizeof(GlobOp));
+    r->classes = malloc((len / 2 + 1) * sizeof(*r->classes));
+    if (!r->ops || !r->classes) return 0;
+    int n = 0, classes = 0;
+    const char *p = pat;
+    while (*p) {
+        GlobOp *op = &r->ops[n++];
+        if (p[0] == '*' && p[1] == '*' && (p == pat || p[-1] == '/') && (p[2] == '/' || !p[2])) {
+            // "**/" is any number of whole folders, a final "**" everything below
+            op->op = p[2] ? GLOB_DIRS : GLOB_REST;
+            p += p[2] ? 3 : 2;
+        } else if (*p == '*') {
+            op->op = GLOB_STAR;
+            while (*p == '*') p++;
+        } else if (*p == '?') {
+            op->op = GLOB_ANY;
+            p++;
+        } else if (*p == '[' && glob_class(p + 1, r->classes[classes])) {
+            op->op = GLOB_CLASS;
+            op->cls = classes;
+            p = glob_class(p + 1, r->classes[classes++]);
+        } else {
+            if (*p == '\\' && p[1]) p++;
+            op->op = GLOB_CHAR;
+            op->c = *p++;
+        }
+    }
+    r->ops[n].op = GLOB_END;
+    return 1;
+}
+
+int glob_match(const IgnoreRule *r, const GlobOp *op, const char *s) {
+    for (;; op++) {
+        switch (op->op) {
+            case GLOB_END:
+                return *s == '\0';
+            case GLOB_CHAR:
+                if (*s != (char)op->c) return 0;
+                s++;
+                break;
+            case GLOB_ANY:
+                if (!*s || *s == '/') return 0;
+                s++;
+                break;
+            case GLOB_CLASS: {
+                unsigned char c = *s;
+                if (!c || !(r->classes[op->cls][c >> 5] >> (c & 31) & 1)) return 0;
+                s++;
+                break;
+            }
+            case GLOB_STAR:
+                while (1) {
+                    if (glob_match(r, op + 1, s)) return 1;
+                    if (!*s || *s == '/') return 0;
+                    s++;
+                }
+            case GLOB_DIRS:
+                while (1) {
+                    if (glob_match(r, op + 1, s)) return 1;
+                    s = strchr(s, '/');
+                    if (!s) return 0;
+                    s++;
+                }
+            case GLOB_REST:
+                return *s != '\0';
+        }
+    }
+}
+
+int ignore_rule_matches(const IgnoreRule *r, const char *rel, const char *name, size_t name_len) {
+    const char *s = r->anchored ? rel : name;
+    switch (r->kind) {
+        case IGNORE_LITERAL:
+            return strcmp(s, r->text) == 0;
+        case IGNORE_SUFFIX:
+            return name_len >= r->len && memcmp(name + name_len - r->len, r->text, r->len) == 0;
+        default:
+            return glob_match(r, r->ops, s);
+    }
+}
+
+// Is the entry at path (named name) excluded? Levels are checked deepest
+// first and, within a level, the last rule first: the first match decides.
+int ignore_match(const IgnoreLevel *level, const char *path, const char *name, int is_dir) {
+    size_t name_len = strlen(name);
+    for (; level; level = level->parent) {
+        const char *rel = path + level->base_len;
+        for (int i = level->count - 1; i >= 0; i--) {
+            const IgnoreRule *r = &level->rules[i];
+            if (r->dir_only && !is_dir) continue;
+            if (ignore_rule_matches(r, rel, name, name_len)) return !r->negate;
+        }
+    }
+    return 0;
+}
+
+void ignore_release(IgnoreLevel *level) {
+    while (level && atomic_fetch_sub(&level->refs, 1) == 1) {
+        IgnoreLevel *parent = level->parent;
+        for (int i = 0; i < level->count; i++) {
+            free(level->rules[i].text);
+            free(level->rules[i].ops);
+            free(level->rules[i].classes);
+        }
+        free(level);
+        level = parent;
+    }
+}
+
+IgnoreLevel *ignore_retain(IgnoreLevel *level) {
+    if (level) atomic_fetch_add(&level->refs, 1);
+    return level;
+}
+
+// Append the rules of one ignore file to *rules; returns the new count
+int read_ignore_file(int dir_fd, const char *name, IgnoreRule **rules, int count, int *cap) {
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return count;
+    char text[65536];
+    ssize_t n = read(fd, text, sizeof(text) - 1);
+    close(fd);
+    if (n <= 0) return count;
+    text[n] = '\0';
+
+    char *save;
+    for (char *line = strtok_r(text, "\r\n", &save); line; line = strtok_r(NULL, "\r\n", &save)) {
+        // Trailing spaces go unless escaped
+        size_t len = strlen(line);
+        while (len > 0 && line[len - 1] == ' ' && (len < 2 || line[len - 2] != '\\')) line[--len] = '\0';
+        if (len == 0 || line[0] == '#') continue;
+
+        IgnoreRule r = {0};
+        if (line[0] == '!') {
+            r.negate = 1;
+            line++;
+            len--;
+        }
+        if (len > 0 && line[len - 1] == '/') {
+            r.dir_only = 1;
+            line[--len] = '\0';
+        }
+        if (strchr(line, '/')) r.anchored = 1;
+        if (line[0] == '/') line++;
+        if (!*line) continue;
+
+        if (count == *cap) {
+            int grown = *cap ? *cap * 2 : 32;
+            IgnoreRule *bigger = realloc(*rules, grown * sizeof(IgnoreRule));
+            if (!bigger) break;
+            *rules = bigger;
+            *cap = grown;
+        }
+        if (!compile_ignore_rule(&r, line)) {
+            free(r.text);
+            free(r.ops);
+            free(r.classes);
+            break;
+        }
+        (*rules)[count++] = r;
+    }
+    return count;
+}
+
+// The level for the folder open at dir_fd, whose entries' names start at
+// base_len in the paths that will be checked. Takes a reference either way.
+IgnoreLevel *ignore_enter(IgnoreLevel *parent, int dir_fd, int base_len) {
+    IgnoreRule *rules = NULL;
+    int count = 0, cap = 0;
+    count = read_ignore_file(dir_fd, ".git/info/exclude", &rules, count, &cap);
+    count = read_ignore_file(dir_fd, ".gitignore", &rules, count, &cap);
+    count = read_ignore_file(dir_fd, ".ignore", &rules, count, &cap);
+    IgnoreLevel *level = count ? malloc(sizeof(IgnoreLevel) + count * sizeof(IgnoreRule)) : NULL;
+    if (!level) {
+        for (int i = 0; i < count; i++) {
+            free(rules[i].text);
+            free(rules[i].ops);
+            free(rules[i].classes);
+        }
+        free(rules);
+        return ignore_retain(parent);
+    }
+    atomic_init(&level->refs, 1);
+    level->parent = ignore_retain(parent);
+    level->base_len = base_len;
+    level->count = count;
+    memcpy(level->rules, rules, count * sizeof(IgnoreRule));
+    free(rules);
+    return level;
+}
+
+// Rules in effect above a search from dir: those of every folder from the
+// project root down to dir's parent. Never NULL unless out of memory, so a
+// NULL level means ignoring is off.
+IgnoreLevel *ignore_for_dir(const char *dir) {
+    char root[MAX_PATH];
+    find_project_root(dir, root, sizeof(root));
+    size_t dir_len = strlen(dir);
+
+    IgnoreLevel *level = calloc(1, sizeof(IgnoreLevel)); // no rules
+    if (!level) return NULL;
+    atomic_init(&level->refs, 1);
+    char path[MAX_PATH];
+    size_t len = strlen(root); // root is dir or a prefix of it
+    while (len < dir_len) {
+        memcpy(path, dir, len);
+        path[len] = '\0';
+        int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0) {
+            IgnoreLevel *next = ignore_enter(level, fd, (int)len + (path[len - 1] != '/'));
+            ignore_release(level);
+            level = next;
+            close(fd);
+        }
+        // Down one folder towards dir
+        const char *slash = strchr(dir + len + 1, '/');
+        len = slash ? (size_t)(slash - dir) : dir_len;
+    }
+    return level;
+}
+
+// A newer query was typed: drop this one
+int search_cancelled() {
+    return search_running != atomic_load_explicit(&search_generation, memory_order_relaxed);
+}
+
+// Between entries: stop when cancelled, show what has been found every tick
+int search_progress() {
+    if (search_truncated || search_cancelled()) return 0;
+    search_publish(0);
+    return 1;
+}
+
+// ignore is the level of base_path's parent, NULL to search everything
+void recursive_search(const char *base_path, const SearchPattern *pat, int max_depth, int current_depth, IgnoreLevel *ignore) {
+    if (current_depth > max_depth || !search_progress()) return;
+
+    DIR *dir = opendir(base_path);
+    if (!dir) return;
+    size_t base_len = strlen(base_path);
+    IgnoreLevel *level = ignore ? ignore_enter(ignore, dirfd(dir), (int)base_len + 1) : NULL;
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) && search_progress()) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+        if (ent->d_name[0] == '.') continue;
+
+        char full_path[MAX_PATH];
+        snprintf(full_path, MAX_PATH, "%s/%s", base_path, ent->d_name);
+
+        struct stat st;
+        if (stat(full_path, &st) != 0) continue;
+
+        int is_dir = S_ISDIR(st.st_mode);
+        if (level && ignore_match(level, full_path, ent->d_name, is_dir)) continue;
+
+        // Make path relative to the folder searched from
+        char *rel_path = full_path + strlen(search_root);
+        if (*rel_path == '/') rel_path++;
+
+        // Check if name matches
+        int score = pattern_name_score(pat, ent->d_name);
+        if (score) {
+            char display[512];
+            if (is_dir) {
+                snprintf(display, sizeof(display), "[\\] %s", rel_path);
+            } else {
+                snprintf(display, sizeof(display), "[~] %s", rel_path);
+            }
+            add_search_result(full_path, rel_path, is_dir ? 0 : 1, is_dir, score, display);
+        }
+
+        // Recurse into directories
+        if (is_dir) {
+            recursive_search(full_path, pat, max_depth, current_depth + 1, level);
+        }
+        // Search file contents for non-directories
+        else if (!is_dir && st.st_size <= search_max_file && !file_known_binary(&st)) {
+            search_in_file(full_path, pat, rel_path);
+        }
+    }
+
+    closedir(dir);
+    ignore_release(level);
+}
+
+// Parallel walk: folders and file contents are separate tasks on a WorkPool,
+// so directory reads, stats and scans of different files overlap. Every
+// task adds its matches under search_results_lock; perform_search() sorts
+// the lot with compare_search_results() at the end.
+
+typedef struct {
+    PoolTask task;
+    WorkPool *pool;
+    const SearchPattern *pat;   // outlives the pool
+    int depth;
+    int max_depth;
+    int shown_off;              // where the path relative to search_root starts
+    IgnoreLevel *ignore;        // folder tasks: the parent's level, NULL to search everything
+    char path[];
+} SearchTask;
+
+int search_stopped() {
+    return search_truncated || search_cancelled();
+}
+
+void search_task_run(PoolTask *task, int worker);
+
+SearchTask *new_search_task(WorkPool *pool, const SearchPattern *pat, const char *path, int shown_off, int depth, int max_depth,
+                            IgnoreLevel *ignore) {
+    size_t len = strlen(path);
+    SearchTask *t = malloc(sizeof(SearchTask) + len + 1);
+    if (!t) return NULL;
+    t->task.run = search_task_run;
+    t->pool = pool;
+    t->pat = pat;
+    t->depth = depth;
+    t->max_depth = max_depth;
+    t->shown_off = shown_off;
+    t->ignore = ignore_retain(ignore);
+    memcpy(t->path, path, len + 1);
+    return t;
+}
+
+// Scan one file's contents: on the pool when there is one, else right here
+void search_submit_file(WorkPool *pool, const SearchPattern *pat, const char *path, int shown_off, int worker) {
+    SearchTask *t = pool ? new_search_task(pool, pat, path, shown_off, -1, 0, NULL) : NULL;
+    if (t) {
+        pool_submit(pool, &t->task, worker);
+    } else {
+        search_in_file(path, pat, path + shown_off);
+    }
+}
+
+void search_dir_task(SearchTask *t, int worker) {
+    int fd = open(t->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    IgnoreLevel *level = t->ignore ? ignore_enter(t->ignore, fd, (int)strlen(t->path) + 1) : NULL;
+
+    char full_path[MAX_PATH];
+    struct dirent *ent;
+    while ((ent = readdir(dir)) && !search_stopped()) {
+        if (ent->d_name[0] == '.') continue;
+        int n = snprintf(full_path, MAX_PATH, "%s/%s", t->path, ent->d_name);
+        if (n < 0 || n >= MAX_PATH) continue;
+
+        struct stat st;
+        if (fstatat(dirfd(dir), ent->d_name, &st, 0) != 0) continue;
+        int is_dir = S_ISDIR(st.st_mode);
+        if (level && ignore_match(level, full_path, ent->d_name, is_dir)) continue;
+        const char *rel_path = full_path + t->shown_off;
+
+        int score = pattern_name_score(t->pat, ent->d_name);
+        if (score) {
+            char display[512];
+            snprintf(display, sizeof(display), "%s %s", is_dir ? "[\\]" : "[~]", rel_path);
+            add_search_result(full_path, rel_path, is_dir ? 0 : 1, is_dir, score, display);
+        }
+
+        if (is_dir) {
+            if (t->depth + 1 > t->max_depth) continue;
+            SearchTask *sub = new_search_task(t->pool, t->pat, full_path, t->shown_off, t->depth + 1, t->max_depth, level);
+            if (sub) pool_submit(t->pool, &sub->task, worker);
+        } else if (st.st_size <= search_max_file && !file_known_binary(&st)) {
+            search_submit_file(t->pool, t->pat, full_path, t->shown_off, worker);
+        }
+    }
+    closedir(dir);
+    ignore_release(level);
+}
+
+void search_task_run(PoolTask *task, int worker) {
+    SearchTask *t = (SearchTask *)task;
+    if (!search_stopped()) {
+        if (t->depth >= 0) {
+            search_dir_task(t, worker);
+        } else {
+            search_in_file(t->path, t->pat, t->path + t->shown_off);
+        }
+    }
+    ignore_release(t->ignore);
+    free(t);
+}
+
+// Queue the walk of dir; 0 when it has to run single-threaded instead
+int parallel_search(WorkPool *pool, const char *dir, const SearchPattern *pat, int max_depth, IgnoreLevel *ignore) {
+    SearchTask *t = pool ? new_search_task(pool, pat, dir, (int)strlen(dir) + 1, 0, max_depth, ignore) : NULL;
+    if (!t) return 0;
+    pool_submit(pool, &t->task, -1);
+    return 1;
+}
+
+// Name matches by score, folders and then shorter paths first among
+// equals; content matches after them
+int compare_search_results(const void *a, const void *b) {
+    SearchResult *ra = (SearchResult*)a;
+    SearchResult *rb = (SearchResult*)b;
+
+    if ((ra->type == 2) != (rb->type == 2)) return ra->type - rb->type;
+    if (ra->score != rb->score) return rb->score - ra->score;
+    if (ra->type != rb->type) return ra->type - rb->type;
+    if (ra->type != 2 && ra->display_len != rb->display_len) return ra->display_len < rb->display_len ? -1 : 1;
+    return strcmp(ra->display, rb->display);
+}
+
+/*
+================================================================================
+                              TRIGRAM INDEX
+================================================================================
+With --index, content search asks a per-project trigram index which files
+can contain the query, and only reads those. The project root is the
+nearest directory holding .git (or the current one), and the index lives
+in $XDG_CACHE_HOME/openfm (default ~/.cache/openfm).
+
+Opening the search starts a background pass over the project: it stats
+every entry and compares it with the index. New and modified files are
+kept in a dirty list that is searched directly; when too much changed, the
+index is rebuilt and swapped in. Queries shorter than a trigram, or made
+before an index exists, fall back to walking the tree.
+
+File layout: IndexHeader, IndexFile[file_count] sorted by path, the path
+names, IndexTrigram[tri_count] sorted by trigram, and the posting lists as
+varint-encoded deltas of file ids.
+*/
+
+#define INDEX_MAGIC "OFMTRI2"
+#define INDEX_MAX_DEPTH 64
+#define INDEX_REBUILD_DIRTY 1024    // rebuild once this many (or 10%) of the files changed
+
+typedef struct {
+    char magic[8];
+    uint32_t file_count;
+    uint32_t tri_count;
+    uint64_t names_len;
+    uint64_t postings_len;
+    int64_t max_file;           // search_max_file when built; another limit means a rebuild
+} IndexHeader;
+
+typedef struct {
+    uint64_t name_off;          // path relative to the root, in the names block
+    int64_t mtime_ns;
+    int64_t size;
+    uint32_t is_dir;
+    uint32_t unused;
+} IndexFile;
+
+typedef struct {
+    uint32_t tri;               // three case-folded bytes
+    uint32_t count;             // files in the posting list
+    uint64_t off;               // offset in the postings block
+} IndexTrigram;
+
+typedef struct {
+    char *rel;
+    int is_dir;
+} IndexDirty;
+
+typedef struct {
+    char root[MAX_PATH];
+    void *map;
+    size_t map_len;
+    const IndexHeader *hdr;
+    const IndexFile *files;
+    const char *names;
+    const IndexTrigram *tris;
+    const uint8_t *postings;
+    unsigned char *stale;       // changed or deleted since the build
+    IndexDirty *dirty;          // new or changed since the build
+    int dirty_count;
+    atomic_int refs;            // active_index, plus each search reading it
+} TrigramIndex;
+
+// One pass over the project: every entry below the root, sorted by path
+typedef struct {
+    IndexFile *files;           // name_off points into names
+    size_t count;
+    size_t cap;
+    char *names;
+    size_t names_len;
+    size_t names_cap;
+} IndexScan;
+
+int index_enabled = 0;          // --index
+pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+TrigramIndex *active_index = NULL;
+int index_worker_running = 0;
+char index_wanted_root[MAX_PATH] = ""; // project root index_prepare() last asked for
+// Why no index can be written; set once, shown by the search. Its own lock,
+// so the search window never waits behind a search holding index_lock.
+pthread_mutex_t index_error_lock = PTHREAD_MUTEX_INITIALIZER;
+char index_error[192] = "";
+
+static inline uint8_t fold_byte(uint8_t c) {
+    return c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+}
+
+// Nearest ancestor holding .git, or dir itself
+void find_project_root(const char *dir, char *root, size_t len) {
+    char probe[MAX_PATH];
+    snprintf(root, len, "%s", dir);
+    while (1) {
+        snprintf(probe, sizeof(probe), "%s/.git", root);
+        if (access(probe, F_OK) == 0) return;
+        char *slash = strrchr(root, '/');
+        if (!slash || slash == root) break;
+        *slash = '\0';
+    }
+    snprintf(root, len, "%s", dir);
+}
+
+// Create dir and any missing parents, like mkdir -p; 0 with errno set on failure
+int make_dirs(char *dir, mode_t mode) {
+    for (char *p = dir + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        int ok = mkdir(dir, mode) == 0 || errno == EEXIST;
+        *p = '/';
+        if (!ok) return 0;
+    }
+    if (mkdir(dir, mode) != 0 && errno != EEXIST) return 0;
+    struct stat st;
+    if (stat(dir, &st) != 0) return 0;
+    if (!S_ISDIR(st.st_mode)) {
+        errno = ENOTDIR;
+        return 0;
+    }
+    return 1;
+}
+
+// Where root's index lives, creating the cache directory if needed; 0 with
+// errno set, and the directory in path, when it cannot be created
+int index_file_path(const char *root, char *path, size_t len) {
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char dir[MAX_PATH];
+    int n = cache && *cache ? snprintf(dir, sizeof(dir), "%s/openfm", cache)
+                            : snprintf(dir, sizeof(dir), "%s/.cache/openfm", home ? home : "/tmp");
+    if (n < 0 || n >= (int)sizeof(dir)) {
+        snprintf(path, len, "%.*s", (int)sizeof(dir) - 1, dir);
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    if (!make_dirs(dir, 0700)) {
+        int err = errno;
+        snprintf(path, len, "%s", dir);
+        errno = err;
+        return 0;
+    }
+
+    uint64_t h = 1469598103934665603ULL; // FNV-1a
+    for (const char *p = root; *p; p++) h = (h ^ (uint8_t)*p) * 1099511628211ULL;
+    n = snprintf(path, len, "%s/trigram-%016llx.idx", dir, (unsigned long long)h);
+    if (n < 0 || (size_t)n >= len) {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    return 1;
+}
+
+const char *index_name(const TrigramIndex *idx, uint32_t id) {
+    return idx->names + idx->files[id].name_off;
+}
+
+void free_trigram_index(TrigramIndex *idx) {
+    if (!idx) return;
+    if (idx->map) munmap(idx->map, idx->map_len);
+    for (int i = 0; i < idx->dirty_count; i++) free(idx->dirty[i].rel);
+    free(idx->dirty);
+    free(idx->stale);
+    free(idx);
+}
+
+void release_trigram_index(TrigramIndex *idx) {
+    if (idx && atomic_fetch_sub(&idx->refs, 1) == 1) free_trigram_index(idx);
+}
+
+// Whether every offset a lookup follows stays inside the mapping: names
+// NUL-terminated within the names block, trigrams sorted, and each posting
+// list decoding to exactly its count of increasing file ids within its
+// bytes. A damaged or foreign file fails this and gets rebuilt.
+int index_valid(const TrigramIndex *idx) {
+    const IndexHeader *hdr = idx->hdr;
+    if (hdr->names_len % 8 != 0) return 0;
+    if (hdr->names_len ? idx->names[hdr->names_len - 1] != '\0' : hdr->file_count != 0) return 0;
+    for (uint32_t i = 0; i < hdr->file_count; i++) {
+        if (idx->files[i].name_off >= hdr->names_len) return 0;
+    }
+    for (uint32_t t = 0; t < hdr->tri_count; t++) {
+        const IndexTrigram *tri = &idx->tris[t];
+        uint64_t end = t + 1 < hdr->tri_count ? idx->tris[t + 1].off : hdr->postings_len;
+        if ((t > 0 && tri->tri <= idx->tris[t - 1].tri) || tri->off > end || end > hdr->postings_len) return 0;
+        const uint8_t *p = idx->postings + tri->off, *stop = idx->postings + end;
+        uint64_t id = 0;
+        for (uint32_t i = 0; i < tri->count; i++) {
+            uint64_t delta = 0;
+            int shift = 0;
+            while (p < stop && (*p & 0x80) && shift < 28) {
+                delta |= (uint64_t)(*p++ & 0x7f) << shift;
+                shift += 7;
+            }
+            if (p == stop || (*p & 0x80)) return 0;
+            delta |= (uint64_t)*p++ << shift;
+            if (i > 0 && delta == 0) return 0;
+            id = i ? id + delta : delta;
+            if (id >= hdr->file_count) return 0;
+        }
+        if (p != stop) return 0;
+    }
+    return 1;
+}
+
+TrigramIndex *load_trigram_index(const char *root) {
+    char path[MAX_PATH];
+    if (!index_file_path(root, path, sizeof(path))) return NULL;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(IndexHeader)) {
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    const IndexHeader *hdr = map;
+    // Each part is bounded by the file size first, so the sum cannot wrap
+    uint64_t size = st.st_size;
+    uint64_t need = hdr->names_len <= size && hdr->postings_len <= size ?
+                    sizeof(IndexHeader) + (uint64_t)hdr->file_count * sizeof(IndexFile) +
+                    hdr->names_len + (uint64_t)hdr->tri_count * sizeof(IndexTrigram) + hdr->postings_len : 0;
+    TrigramIndex *idx = calloc(1, sizeof(TrigramIndex));
+    if (memcmp(hdr->magic, INDEX_MAGIC, 8) != 0 || need != size ||
+        hdr->max_file != (int64_t)search_max_file || !idx) {
+        munmap(map, st.st_size);
+        free(idx);
+        return NULL;
+    }
+    snprintf(idx->root, sizeof(idx->root), "%s", root);
+    atomic_init(&idx->refs, 1);
+    idx->map = map;
+    idx->map_len = st.st_size;
+    idx->hdr = hdr;
+    idx->files = (const IndexFile *)(hdr + 1);
+    idx->names = (const char *)(idx->files + hdr->file_count);
+    // The trigram table follows the names, padded to 8 bytes when written
+    idx->tris = (const IndexTrigram *)(idx->names + hdr->names_len);
+    idx->postings = (const uint8_t *)(idx->tris + hdr->tri_count);
+    idx->stale = calloc(hdr->file_count ? hdr->file_count : 1, 1);
+    if (!idx->stale || !index_valid(idx)) {
+        free_trigram_index(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+int scan_add(IndexScan *scan, const char *rel, size_t rel_len, const struct stat *st, int is_dir) {
+    if (scan->count == scan->cap) {
+        size_t cap = scan->cap ? scan->cap * 2 : 4096;
+        IndexFile *files = realloc(scan->files, cap * sizeof(IndexFile));
+        if (!files) return 0;
+        scan->files = files;
+        scan->cap = cap;
+    }
+    if (scan->names_len + rel_len + 1 > scan->names_cap) {
+        size_t cap = scan->names_cap ? scan->names_cap * 2 : 1 << 16;
+        while (cap < scan->names_len + rel_len + 1) cap *= 2;
+        char *names = realloc(scan->names, cap);
+        if (!names) return 0;
+        scan->names = names;
+        scan->names_cap = cap;
+    }
+    IndexFile *f = &scan->files[scan->count++];
+    f->name_off = scan->names_len;
+    f->mtime_ns = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    f->size = st->st_size;
+    f->is_dir = is_dir;
+    f->unused = 0;
+    memcpy(scan->names + scan->names_len, rel, rel_len + 1);
+    scan->names_len += rel_len + 1;
+    return 1;
+}
+
+// The folders being scanned, innermost first
+typedef struct ScanAncestor {
+    dev_t dev;
+    ino_t ino;
+    const struct ScanAncestor *up;
+} ScanAncestor;
+
+// Same entries the search walker visits: no dot entries, nothing ignored,
+// symlinked folders followed. A folder that is already one of its own
+// ancestors is listed but not entered again; the walker only stops such a
+// loop at its depth limit.
+void scan_tree(IndexScan *scan, int dir_fd, char *rel, size_t rel_len, int depth, IgnoreLevel *ignore,
+               const ScanAncestor *up) {
+    IgnoreLevel *level = ignore_enter(ignore, dir_fd, rel_len ? (int)rel_len + 1 : 0);
+    DIR *dir = fdopendir(dir_fd);
+    if (!dir) {
+        close(dir_fd);
+        ignore_release(level);
+        return;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        if (ent->d_name[0] == '.') continue;
+        size_t len = rel_len;
+        int n = snprintf(rel + len, MAX_PATH - len, "%s%s", len ? "/" : "", ent->d_name);
+        if (n < 0 || len + n >= MAX_PATH) continue;
+        len += n;
+
+        struct stat st;
+        if (fstatat(dirfd(dir), ent->d_name, &st, 0) != 0) continue;
+        int is_dir = S_ISDIR(st.st_mode);
+        if (ignore_match(level, rel, ent->d_name, is_dir)) {
+            rel[rel_len] = '\0';
+            continue;
+        }
+        if (!scan_add(scan, rel, len, &st, is_dir)) break;
+
+        const ScanAncestor *a = up;
+        while (a && (a->dev != st.st_dev || a->ino != st.st_ino)) a = a->up;
+        if (is_dir && depth < INDEX_MAX_DEPTH && !a) {
+            ScanAncestor here = { st.st_dev, st.st_ino, up };
+            int fd = openat(dirfd(dir), ent->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd >= 0) scan_tree(scan, fd, rel, len, depth + 1, level, &here);
+        }
+        rel[rel_len] = '\0';
+    }
+    closedir(dir);
+    ignore_release(level);
+}
+
+const char *sort_scan_names;
+
+int compare_scan_files(const void *a, const void *b) {
+    return strcmp(sort_scan_names + ((const IndexFile *)a)->name_off,
+                  sort_scan_names + ((const IndexFile *)b)->name_off);
+}
+
+int scan_project(const char *root, IndexScan *scan) {
+    memset(scan, 0, sizeof(*scan));
+    int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    char rel[MAX_PATH] = "";
+    struct stat st;
+    ScanAncestor top = { 0, 0, NULL };
+    if (fstat(fd, &st) == 0) {
+        top.dev = st.st_dev;
+        top.ino = st.st_ino;
+    }
+    scan_tree(scan, fd, rel, 0, 0, NULL, &top); // the index covers the project root down
+    // Only the index worker sorts scans, one at a time
+    sort_scan_names = scan->names;
+    qsort(scan->files, scan->count, sizeof(IndexFile), compare_scan_files);
+    return 1;
+}
+
+void free_scan(IndexScan *scan) {
+    free(scan->files);
+    free(scan->names);
+}
+
+// Build-time posting list of one trigram
+typedef struct {
+    uint32_t key;               // trigram + 1, 0 marks a free slot
+    uint32_t last;              // last file id appended
+    uint32_t count;
+    uint32_t len;
+    uint32_t cap;
+    uint8_t *bytes;
+} TrigramPostings;
+
+typedef struct {
+    TrigramPostings *slots;
+    size_t cap;                 // power of two
+    size_t used;
+} TrigramTable;
+
+TrigramPostings *trigram_slot(TrigramTable *t, uint32_t tri) {
+    if (t->used * 2 >= t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 1 << 16;
+        TrigramPostings *slots = calloc(cap, sizeof(TrigramPostings));
+        if (!slots) return NULL;
+        for (size_t i = 0; i < t->cap; i++) {
+            if (!t->slots[i].key) continue;
+            size_t j = (t->slots[i].key * 2654435761u) & (cap - 1);
+            while (slots[j].key) j = (j + 1) & (cap - 1);
+            slots[j] = t->slots[i];
+        }
+        free(t->slots);
+        t->slots = slots;
+        t->cap = cap;
+    }
+    uint32_t key = tri + 1;
+    size_t j = (key * 2654435761u) & (t->cap - 1);
+    while (t->slots[j].key && t->slots[j].key != key) j = (j + 1) & (t->cap - 1);
+    if (!t->slots[j].key) {
+        t->slots[j].key = key;
+        t->used++;
+    }
+    return &t->slots[j];
+}
+
+int posting_append(TrigramPostings *p, uint32_t id) {
+    if (p->count > 0 && p->last == id) return 1; // already listed for this file
+    uint32_t delta = p->count ? id - p->last : id;
+    if (p->len + 5 > p->cap) {
+        uint32_t cap = p->cap ? p->cap * 2 : 16;
+        uint8_t *bytes = realloc(p->bytes, cap);
+        if (!bytes) return 0;
+        p->bytes = bytes;
+        p->cap = cap;
+    }
+    while (delta >= 0x80) {
+        p->bytes[p->len++] = (uint8_t)(delta | 0x80);
+        delta >>= 7;
+    }
+    p->bytes[p->len++] = (uint8_t)delta;
+    p->last = id;
+    p->count++;
+    return 1;
+}
+
+int compare_index_trigrams(const void *a, const void *b) {
+    uint32_t x = ((const IndexTrigram *)a)->tri, y = ((const IndexTrigram *)b)->tri;
+    return x < y ? -1 : x > y;
+}
+
+int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+// Add the trigrams of one file; 0 when out of memory
+int index_file_trigrams(TrigramTable *table, FileView *view, const char *path, uint32_t id) {
+    sigjmp_buf fault;
+    if (sigsetjmp(fault, 0)) {
+        // Truncated while mapped: the postings added so far stay, the
+        // index only narrows down the files a search reads
+        map_fault_jmp = NULL;
+        file_view_close(view);
+        return 1;
+    }
+    map_fault_jmp = &fault;
+    if (!file_view_open(view, path)) {
+        map_fault_jmp = NULL;
+        return 1;
+    }
+    const uint8_t *buf = (const uint8_t *)view->data;
+    size_t len = view->len;
+    int ok = 1;
+
+    for (size_t i = 0; i + 2 < len && ok; i++) {
+        // Queries are single lines, so trigrams spanning a newline never match
+        if (buf[i] == '\n' || buf[i + 1] == '\n' || buf[i + 2] == '\n') continue;
+        uint32_t tri = (uint32_t)fold_byte(buf[i]) << 16 | fold_byte(buf[i + 1]) << 8 | fold_byte(buf[i + 2]);
+        TrigramPostings *p = trigram_slot(table, tri);
+        ok = p && posting_append(p, id);
+    }
+    file_view_close(view);
+    map_fault_jmp = NULL;
+    return ok;
+}
+
+// Read every indexed file once and write the index next to the others
+int build_trigram_index(const char *root, IndexScan *scan) {
+    TrigramTable table = { 0 };
+    char path[MAX_PATH];
+    FileView *view = malloc(sizeof(FileView));
+    if (!view) return 0;
+    int ok = 1;
+
+    for (size_t id = 0; id < scan->count && ok; id++) {
+        IndexFile *f = &scan->files[id];
+        if (f->is_dir || f->size <= 0 || f->size > search_max_file) continue;
+        snprintf(path, sizeof(path), "%s/%s", root, scan->names + f->name_off);
+        ok = index_file_trigrams(&table, view, path, (uint32_t)id);
+    }
+    free(view);
+
+    IndexTrigram *tris = ok ? malloc((table.used ? table.used : 1) * sizeof(IndexTrigram)) : NULL;
+    uint64_t postings_len = 0;
+    size_t tri_count = 0;
+    if (tris) {
+        for (size_t i = 0; i < table.cap; i++) {
+            TrigramPostings *p = &table.slots[i];
+            if (!p->key) continue;
+            tris[tri_count].tri = p->key - 1;
+            tris[tri_count].count = p->count;
+            tris[tri_count].off = i; // the table slot until the offsets are known
+            tri_count++;
+        }
+        qsort(tris, tri_count, sizeof(IndexTrigram), compare_index_trigrams);
+    }
+
+    char index_path[MAX_PATH], tmp_path[MAX_PATH + 32];
+    int fd = -1;
+    if (tris && index_file_path(root, index_path, sizeof(index_path))) {
+        snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", index_path, (int)getpid());
+        fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    }
+    if (fd >= 0) {
+        // Names padded so the trigram table stays 8-byte aligned in the mapping
+        size_t names_len = (scan->names_len + 7) & ~(size_t)7;
+        static const char pad[8];
+        for (size_t i = 0; i < tri_count; i++) {
+            TrigramPostings *p = &table.slots[tris[i].off];
+            tris[i].off = postings_len;
+            postings_len += p->len;
+            p->last = (uint32_t)i; // now the trigram's rank, for writing in order below
+        }
+        IndexHeader hdr;
+        memcpy(hdr.magic, INDEX_MAGIC, 8);
+        hdr.file_count = (uint32_t)scan->count;
+        hdr.tri_count = (uint32_t)tri_count;
+        hdr.names_len = names_len;
+        hdr.postings_len = postings_len;
+        hdr.max_file = search_max_file;
+
+        ok = write_all(fd, &hdr, sizeof(hdr)) &&
+             write_all(fd, scan->files, scan->count * sizeof(IndexFile)) &&
+             write_all(fd, scan->names, scan->names_len) &&
+             write_all(fd, pad, names_len - scan->names_len) &&
+             write_all(fd, tris, tri_count * sizeof(IndexTrigram));
+        // Posting lists in trigram order, matching the offsets above
+        TrigramPostings **ranked = ok ? malloc((tri_count ? tri_count : 1) * sizeof(*ranked)) : NULL;
+        if (!ranked) ok = 0;
+        for (size_t i = 0; i < table.cap && ok; i++) {
+            if (table.slots[i].key) ranked[table.slots[i].last] = &table.slots[i];
+        }
+        for (size_t i = 0; i < tri_count && ok; i++) ok = write_all(fd, ranked[i]->bytes, ranked[i]->len);
+        free(ranked);
+        if (close(fd) != 0) ok = 0;
+        if (ok) ok = rename(tmp_path, index_path) == 0;
+        if (!ok) unlink(tmp_path);
+    } else {
+        ok = 0;
+    }
+
+    for (size_t i = 0; i < table.cap; i++) free(table.slots[i].bytes);
+    free(table.slots);
+    free(tris);
+    return ok;
+}
+
+// Compare a fresh scan with the index: mark what changed, list what is new
+int index_apply_scan(TrigramIndex *idx, IndexScan *scan) {
+    uint32_t n = idx->hdr->file_count;
+    size_t i = 0, j = 0, dirty_cap = 0;
+    memset(idx->stale, 1, n ? n : 1); // whatever the scan does not see is gone
+    for (int k = 0; k < idx->dirty_count; k++) free(idx->dirty[k].rel);
+    idx->dirty_count = 0;
+
+    while (j < scan->count) {
+        const char *name = scan->names + scan->files[j].name_off;
+        int cmp = i < n ? strcmp(index_name(idx, i), name) : 1;
+        if (cmp < 0) {
+            i++;
+            continue;
+        }
+        if (cmp == 0 && idx->files[i].mtime_ns == scan->files[j].mtime_ns &&
+            idx->files[i].size == scan->files[j].size) {
+            idx->stale[i] = 0;
+        } else {
+            if ((size_t)idx->dirty_count == dirty_cap) {
+                dirty_cap = dirty_cap ? dirty_cap * 2 : 64;
+                IndexDirty *dirty = realloc(idx->dirty, dirty_cap * sizeof(IndexDirty));
+                if (!dirty) return 0;
+                idx->dirty = dirty;
+            }
+            idx->dirty[idx->dirty_count].rel = strdup(name);
+            idx->dirty[idx->dirty_count].is_dir = scan->files[j].is_dir;
+            if (idx->dirty[idx->dirty_count].rel) idx->dirty_count++;
+        }
+        if (cmp == 0) i++;
+        j++;
+    }
+    size_t limit = n / 10 > INDEX_REBUILD_DIRTY ? n / 10 : INDEX_REBUILD_DIRTY;
+    return (size_t)idx->dirty_count <= limit;
+}
+
+// Scans root, then loads or rebuilds its index; installs it only if root is
+// still the project the user last asked for
+void index_refresh(const char *root) {
+    // Without a place to write it, scanning the tree would be wasted; the
+    // failure is kept so later searches show it instead of trying again
+    char path[MAX_PATH];
+    if (!index_file_path(root, path, sizeof(path))) {
+        int err = errno;
+        pthread_mutex_lock(&index_error_lock);
+        snprintf(index_error, sizeof(index_error), "Index off: %.140s: %s", path, strerror(err));
+        pthread_mutex_unlock(&index_error_lock);
+        return;
+    }
+
+    IndexScan scan;
+    if (!scan_project(root, &scan)) return;
+
+    // A fresh index is checked against the scan before it is used
+    TrigramIndex *idx = load_trigram_index(root);
+    if (!idx || !index_apply_scan(idx, &scan)) {
+        free_trigram_index(idx);
+        idx = build_trigram_index(root, &scan) ? load_trigram_index(root) : NULL;
+        if (idx) index_apply_scan(idx, &scan);
+    }
+
+    pthread_mutex_lock(&index_lock);
+    if (idx && strcmp(index_wanted_root, root) == 0) {
+        release_trigram_index(active_index);
+        active_index = idx;
+        idx = NULL;
+    }
+    pthread_mutex_unlock(&index_lock);
+    free_trigram_index(idx);
+    free_scan(&scan);
+}
+
+// Runs until index_wanted_root stops changing under it, so a project entered
+// while another was being indexed still gets its own index
+void *index_worker(void *arg) {
+    (void)arg;
+    char root[MAX_PATH] = "";
+    pthread_mutex_lock(&index_lock);
+    while (strcmp(root, index_wanted_root) != 0) {
+        snprintf(root, sizeof(root), "%s", index_wanted_root);
+        pthread_mutex_unlock(&index_lock);
+        index_refresh(root);
+        pthread_mutex_lock(&index_lock);
+    }
+    index_worker_running = 0;
+    pthread_mutex_unlock(&index_lock);
+    return NULL;
+}
+
+// Called when the search opens: pick the project's index and refresh it in the background
+void index_prepare(const char *dir) {
+    if (!index_enabled) return;
+    char root[MAX_PATH];
+    find_project_root(dir, root, sizeof(root));
+
+    pthread_mutex_lock(&index_error_lock);
+    int failed = index_error[0] != '\0';
+    pthread_mutex_unlock(&index_error_lock);
+    if (failed) return;
+
+    pthread_mutex_lock(&index_lock);
+    if (active_index && strcmp(active_index->root, root) != 0) {
+        release_trigram_index(active_index);
+        active_index = NULL;
+    }
+    // A running worker picks the new root up when it finishes its current one
+    snprintf(index_wanted_root, sizeof(index_wanted_root), "%s", root);
+    if (!index_worker_running) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, index_worker, NULL) == 0) {
+            pthread_detach(tid);
+            index_worker_running = 1;
+        }
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+int lookup_trigram(const TrigramIndex *idx, uint32_t tri) {
+    int lo = 0, hi = (int)idx->hdr->tri_count - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (idx->tris[mid].tri == tri) return mid;
+        if (idx->tris[mid].tri < tri) lo = mid + 1; else hi = mid - 1;
+    }
+    return -1;
+}
+
+uint32_t *decode_postings(const TrigramIndex *idx, int t, uint32_t *count) {
+    const IndexTrigram *tri = &idx->tris[t];
+    uint32_t *ids = malloc((tri->count ? tri->count : 1) * sizeof(uint32_t));
+    if (!ids) return NULL;
+    const uint8_t *p = idx->postings + tri->off;
+    uint32_t id = 0;
+    for (uint32_t i = 0; i < tri->count; i++) {
+        uint32_t delta = 0;
+        int shift = 0;
+        while (*p & 0x80) {
+            delta |= (uint32_t)(*p++ & 0x7f) << shift;
+            shift += 7;
+        }
+        delta |= (uint32_t)*p++ << shift;
+        id = i ? id + delta : delta;
+        ids[i] = id;
+    }
+    *count = tri->count;
+    return ids;
+}
+
+// Files that hold every trigram of the query; NULL with *count 0 when none do
+uint32_t *index_candidates(const TrigramIndex *idx, const char *query, size_t len, uint32_t *count) {
+    int lists[256];
+    int nlists = 0;
+    *count = 0;
+    for (size_t i = 0; i + 2 < len && nlists < 256; i++) {
+        uint32_t tri = (uint32_t)fold_byte(query[i]) << 16 | fold_byte(query[i + 1]) << 8 | fold_byte(query[i + 2]);
+        int t = lookup_trigram(idx, tri);
+        if (t < 0) return NULL;
+        lists[nlists++] = t;
+    }
+
+    if (nlists == 0) return NULL;
+
+    // Start from the shortest list and intersect the others into it
+    int shortest = 0;
+    for (int i = 1; i < nlists; i++) {
+        if (idx->tris[lists[i]].count < idx->tris[lists[shortest]].count) shortest = i;
+    }
+    uint32_t n;
+    uint32_t *cand = decode_postings(idx, lists[shortest], &n);
+    for (int i = 0; i < nlists && cand && n > 0; i++) {
+        if (i == shortest || lists[i] == lists[shortest]) continue;
+        uint32_t m;
+        uint32_t *other = decode_postings(idx, lists[i], &m);
+        if (!other) break;
+        uint32_t k = 0;
+        for (uint32_t a = 0, b = 0; a < n && b < m; ) {
+            if (cand[a] < other[b]) a++;
+            else if (cand[a] > other[b]) b++;
+            else { cand[k++] = cand[a]; a++; b++; }
+        }
+        n = k;
+        free(other);
+    }
+    *count = cand ? n : 0;
+    return cand;
+}
+
+// Files that can hold any of the terms: the union of their candidates
+uint32_t *index_terms_candidates(const TrigramIndex *idx, const LiteralSet *ls, uint32_t *count) {
+    uint32_t *all = NULL;
+    uint32_t n = 0;
+    for (int t = 0; t < ls->count; t++) {
+        uint32_t m;
+        uint32_t *cand = index_candidates(idx, (const char *)ls->terms[t], ls->lens[t], &m);
+        if (!cand || m == 0) {
+            free(cand);
+            continue;
+        }
+        uint32_t *merged = malloc((size_t)(n + m) * sizeof(uint32_t));
+        if (!merged) {
+            free(cand);
+            break;
+        }
+        uint32_t k = 0, a = 0, b = 0;
+        while (a < n || b < m) {
+            if (b == m || (a < n && all[a] < cand[b])) merged[k++] = all[a++];
+            else if (a == n || cand[b] < all[a]) merged[k++] = cand[b++];
+            else { merged[k++] = all[a++]; b++; }
+        }
+        free(all);
+        free(cand);
+        all = merged;
+        n = k;
+    }
+    *count = n;
+    return all;
+}
+
+// Entries below the current folder, at most as deep as the walker goes
+const char *index_scope_rel(const char *rel, const char *prefix, size_t prefix_len, int max_depth) {
+    if (prefix_len) {
+        if (strncmp(rel, prefix, prefix_len) != 0 || rel[prefix_len] != '/') return NULL;
+        rel += prefix_len + 1;
+    }
+    int depth = 0;
+    for (const char *p = rel; *p; p++) {
+        if (*p == '/' && ++depth > max_depth) return NULL;
+    }
+    return rel;
+}
+
+void index_add_name_match(const char *path, const char *shown, int is_dir, const SearchPattern *pat) {
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    int score = pattern_name_score(pat, base);
+    if (!score) return;
+    if (access(path, F_OK) != 0) return; // deleted since the last scan
+
+    char display[512];
+    snprintf(display, sizeof(display), "%s %s", is_dir ? "[\\]" : "[~]", shown);
+    add_search_result(path, shown, is_dir ? 0 : 1, is_dir, score, display);
+}
+
+// Can the trigram index narrow this pattern down? Text and every term
+// need a trigram; a regex always walks.
+int index_usable(const SearchPattern *pat) {
+    if (pat->regex) return 0;
+    if (!pat->terms) return pat->len >= 3;
+    for (int t = 0; t < pat->terms->count; t++) {
+        if (pat->terms->lens[t] < 3) return 0;
+    }
+    return 1;
+}
+
+// Answer a query from the index; 0 when the walker has to do it
+int index_search(const SearchPattern *pat, int max_depth, WorkPool *pool) {
+    if (!index_enabled || !index_usable(pat)) return 0;
+    // A reference keeps the index alive if a rebuild replaces it meanwhile,
+    // so the passes below run without index_lock
+    pthread_mutex_lock(&index_lock);
+    TrigramIndex *idx = active_index;
+    if (idx) atomic_fetch_add(&idx->refs, 1);
+    pthread_mutex_unlock(&index_lock);
+    size_t root_len = idx ? strlen(idx->root) : 0;
+    if (!idx || strncmp(search_root, idx->root, root_len) != 0 ||
+        (search_root[root_len] != '/' && search_root[root_len] != '\0')) {
+        release_trigram_index(idx);
+        return 0;
+    }
+    const char *prefix = search_root[root_len] == '/' ? search_root + root_len + 1 : "";
+    size_t prefix_len = strlen(prefix);
+    char path[MAX_PATH];
+
+    // Names come from the file table; changed entries are in the dirty list
+    size_t root_skip = root_len + 1;
+    for (uint32_t i = 0; i < idx->hdr->file_count && ((i & 1023) || search_progress()); i++) {
+        if (idx->stale[i]) continue;
+        const char *shown = index_scope_rel(index_name(idx, i), prefix, prefix_len, max_depth);
+        if (!shown) continue;
+        snprintf(path, sizeof(path), "%s/%s", idx->root, index_name(idx, i));
+        index_add_name_match(path, path + root_skip + (shown - index_name(idx, i)), idx->files[i].is_dir, pat);
+    }
+    for (int i = 0; i < idx->dirty_count && search_progress(); i++) {
+        const char *shown = index_scope_rel(idx->dirty[i].rel, prefix, prefix_len, max_depth);
+        if (!shown) continue;
+        snprintf(path, sizeof(path), "%s/%s", idx->root, idx->dirty[i].rel);
+        index_add_name_match(path, path + root_skip + (shown - idx->dirty[i].rel), idx->dirty[i].is_dir, pat);
+    }
+
+    // Contents: only the candidate files, plus whatever changed since the build
+    uint32_t count;
+    uint32_t *cand = pat->terms ? index_terms_candidates(idx, pat->terms, &count)
+                                : index_candidates(idx, pat->text, pat->len, &count);
+    for (uint32_t i = 0; i < count && search_progress(); i++) {
+        uint32_t id = cand[i];
+        if (idx->stale[id]) continue;
+        const char *shown = index_scope_rel(index_name(idx, id), prefix, prefix_len, max_depth);
+        if (!shown) continue;
+        snprintf(path, sizeof(path), "%s/%s", idx->root, index_name(idx, id));
+        search_submit_file(pool, pat, path, (int)(root_skip + (shown - index_name(idx, id))), -1);
+    }
+    free(cand);
+    for (int i = 0; i < idx->dirty_count && search_progress(); i++) {
+        if (idx->dirty[i].is_dir) continue;
+        const char *shown = index_scope_rel(idx->dirty[i].rel, prefix, prefix_len, max_depth);
+        if (!shown) continue;
+        snprintf(path, sizeof(path), "%s/%s", idx->root, idx->dirty[i].rel);
+        struct stat st;
+        if (stat(path, &st) == 0 && st.st_size <= search_max_file && !file_known_binary(&st)) {
+            search_submit_file(pool, pat, path, (int)(root_skip + (shown - idx->dirty[i].rel)), -1);
+        }
+    }
+    release_trigram_index(idx);
+    return 1;
+}
+
+// Narrow the previous results to a query that contains the previous one:
+// nothing else can match it, so names are rescored here and the files that
+// matched are re-read on the pool. The old set is taken out first, so every
+// result published meanwhile has been checked against the new query.
+void refine_search(const SearchPattern *pat) {
+    pthread_mutex_lock(&search_results_lock);
+    SearchResult *old = search_results;
+    int old_count = search_result_count;
+    search_results = NULL;
+    search_result_count = 0;
+    search_result_cap = 0;
+    search_top_count = 0;
+    search_top_seen = 0;
+    pthread_mutex_unlock(&search_results_lock);
+
+    WorkPool *pool = pool_create(search_workers);
+    for (int i = 0; i < old_count; i++) {
+        SearchResult *r = &old[i];
+        if (search_progress()) {
+            if (r->type == 2) {
+                search_submit_file(pool, pat, r->path, r->shown_off, -1);
+            } else {
+                // A subsequence of the name contains every shorter one
+                const char *base = strrchr(r->path, '/');
+                int score = pattern_name_score(pat, base ? base + 1 : r->path);
+                if (score) add_search_result(r->path, r->path + r->shown_off, r->type, r->is_dir, score, r->display);
+            }
+        }
+        free(r->path);
+        free(r->display);
+    }
+    free(old);
+    if (pool) {
+        while (!pool_wait_for(pool, UI_TICK_MS)) search_publish(0);
+        pool_destroy(pool);
+    }
+}
+
+// Search dir for query, read as mode says, into search_results; publishes
+// progress as it goes. With use_ignore, entries excluded by .gitignore/.ignore
+// are skipped.
+void perform_search(const char *query, const char *dir, int mode, int use_ignore) {
+    // Same query from the same folder: the results stand
+    if (strcmp(query, search_query) != 0 || strcmp(dir, search_root) != 0 || use_ignore != search_ignored ||
+        mode != search_query_mode) {
+        // Compiled once here, shared by every thread and file below
+        SearchPattern pat;
+        char error[128] = "";
+        int compiled = query[0] && compile_search_pattern(&pat, query, mode, error, sizeof(error));
+        pthread_mutex_lock(&search_lock);
+        snprintf(search_view_error, sizeof(search_view_error), "%s", error);
+        pthread_mutex_unlock(&search_lock);
+
+        if (!compiled) {
+            clear_search_results();
+        } else if (mode == SEARCH_TEXT && search_query_mode == SEARCH_TEXT && search_query[0] && !search_truncated &&
+                   strcmp(dir, search_root) == 0 && use_ignore == search_ignored &&
+                   case_insensitive_strstr(query, search_query)) {
+            refine_search(&pat);
+        } else {
+            clear_search_results();
+            snprintf(search_root, sizeof(search_root), "%s", dir);
+
+            // Folders and files go to the pool; this thread keeps publishing progress.
+            // The index holds no ignored files, so it only answers when they are skipped.
+            WorkPool *pool = pool_create(search_workers);
+            IgnoreLevel *ignore = use_ignore ? ignore_for_dir(dir) : NULL;
+            if (!(use_ignore && index_search(&pat, 3, pool)) && !parallel_search(pool, dir, &pat, 3, ignore)) {
+                recursive_search(dir, &pat, 3, 0, ignore); // max depth 3
+            }
+            if (pool) {
+                while (!pool_wait_for(pool, UI_TICK_MS)) search_publish(0);
+                pool_destroy(pool);
+            }
+            ignore_release(ignore);
+        }
+        if (compiled) free_search_pattern(&pat);
+        snprintf(search_query, sizeof(search_query), "%s", query);
+        snprintf(search_root, sizeof(search_root), "%s", dir);
+        search_ignored = use_ignore;
+        search_query_mode = mode;
+
+        if (search_cancelled()) {
+            // Partial results cannot be refined later
+            clear_search_results();
+            search_query[0] = '\0';
+            return;
+        }
+    }
+
+    // Sort: folders first, then files, then content. That moves the results
+    // the heap points at, and the best are now simply the first ones.
+    qsort(search_results, search_result_count, sizeof(SearchResult), compare_search_results);
+    search_top_count = 0;
+    search_top_seen = 0;
+    search_publish(1);
+}
+
+double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+int result_worse(int a, int b) {
+    return compare_search_results(&search_results[a], &search_results[b]) > 0;
+}
+
+void result_heap_down(int *heap, int n, int i) {
+    while (1) {
+        int worst = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && result_worse(heap[l], heap[worst])) worst = l;
+        if (r < n && result_worse(heap[r], heap[worst])) worst = r;
+        if (worst == i) return;
+        int t = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = t;
+        i = worst;
+    }
+}
+
+// Copy the best matches so far into search_view; at most once per tick
+// unless the search is done
+void search_publish(int done) {
+    static double last_publish;
+    double now = now_ms();
+    if (!done && now - last_publish < UI_TICK_MS) return;
+    last_publish = now;
+
+    // Top MAX_SEARCH_RESULTS in compare_search_results order: a heap with
+    // the worst of them on top, which each better new match replaces
+    pthread_mutex_lock(&search_results_lock);
+    for (int i = search_top_seen; i < search_result_count; i++) {
+        if (search_top_count < MAX_SEARCH_RESULTS) {
+            int j = search_top_count++;
+            while (j > 0 && result_worse(i, search_top[(j - 1) / 2])) {
+                search_top[j] = search_top[(j - 1) / 2];
+                j = (j - 1) / 2;
+            }
+            search_top[j] = i;
+        } else if (result_worse(search_top[0], i)) {
+            search_top[0] = i;
+            result_heap_down(search_top, search_top_count, 0);
+        }
+    }
+    search_top_seen = search_result_count;
+
+    // Taking the worst off the top n times leaves a copy best first
+    int top[MAX_SEARCH_RESULTS];
+    int n = search_top_count;
+    memcpy(top, search_top, n * sizeof(int));
+    for (int end = n - 1; end > 0; end--) {
+        int worst = top[0];
+        top[0] = top[end];
+        top[end] = worst;
+        result_heap_down(top, end, 0);
+    }
+
+    SearchResult view[MAX_SEARCH_RESULTS];
+    int copied = 0;
+    for (int i = 0; i < n; i++) {
+        view[copied] = search_results[top[i]];
+        view[copied].path = strdup(search_results[top[i]].path);
+        view[copied].display = strdup(search_results[top[i]].display);
+        if (view[copied].path && view[copied].display) {
+            copied++;
+        } else {
+            free(view[copied].path);
+            free(view[copied].display);
+        }
+    }
+    int total = search_result_count;
+    int truncated = search_truncated;
+    pthread_mutex_unlock(&search_results_lock);
+
+    pthread_mutex_lock(&search_lock);
+    for (int i = 0; i < search_view_count; i++) {
+        free(search_view[i].path);
+        free(search_view[i].display);
+    }
+    memcpy(search_view, view, copied * sizeof(SearchResult));
+    search_view_count = copied;
+    search_view_total = total;
+    search_view_truncated = truncated;
+    search_view_done = done;
+    search_view_generation = search_running;
+    pthread_mutex_unlock(&search_lock);
+}
+
+void *search_worker(void *arg) {
+    (void)arg;
+    char query[256];
+    char dir[MAX_PATH];
+    int mode, use_ignore;
+    pthread_mutex_lock(&search_lock);
+    while (1) {
+        while (search_running == atomic_load(&search_generation)) pthread_cond_wait(&search_cond, &search_lock);
+        search_running = atomic_load(&search_generation);
+        snprintf(query, sizeof(query), "%s", search_request);
+        snprintf(dir, sizeof(dir), "%s", search_request_dir);
+        mode = search_request_mode;
+        use_ignore = search_request_ignore;
+        pthread_mutex_unlock(&search_lock);
+
+        perform_search(query, dir, mode, use_ignore);
+
+        pthread_mutex_lock(&search_lock);
+    }
+    return NULL;
+}
+
+// Ask for a new search; whatever is running is abandoned at its next check
+void request_search(const char *query, const char *dir) {
+    pthread_mutex_lock(&search_lock);
+    snprintf(search_request, sizeof(search_request), "%s", query);
+    snprintf(search_request_dir, sizeof(search_request_dir), "%s", dir);
+    search_request_mode = search_mode;
+    search_request_ignore = search_ignore;
+    atomic_fetch_add(&search_generation, 1);
+    search_view_done = 0;
+    if (!search_worker_started) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, search_worker, NULL) == 0) {
+            pthread_detach(tid);
+            search_worker_started = 1;
+        }
+    }
+    pthread_cond_signal(&search_cond);
+    pthread_mutex_unlock(&search_lock);
+
+    if (!search_worker_started) {
+        // No thread: search right here, as before
+        search_running = atomic_load(&search_generation);
+        perform_search(query, dir, search_mode, search_ignore);
+    }
+}
+
+void show_search_ui() {
+    int height, width;
+    getmaxyx(stdscr, height, width);
+
+    int win_height = height - 6;
+    int win_width = width - 10;
+    if (win_width > 100) win_width = 100;
+
+    WINDOW *win = newwin(win_height, win_width, 3, (width - win_width) / 2);
+    keypad(win, TRUE);
+    wtimeout(win, UI_TICK_MS); // redraw as results come in
+
+    char query[256] = "";
+    char requested[256] = "";
+    int query_len = 0;
+    unsigned generation = atomic_load(&search_generation);
+
+    int running = 1;
+    index_prepare(current_dir);
+
+    while (running) {
+        // A changed query cancels the search in progress and starts a new one
+        if (strcmp(query, requested) != 0) {
+            snprintf(requested, sizeof(requested), "%s", query);
+            request_search(query, current_dir);
+            generation = atomic_load(&search_generation);
+            search_selected = 0;
+            search_scroll = 0;
+        }
+
+        // Draw window
+        werase(win);
+        box(win, 0, 0);
+
+        wattron(win, COLOR_PAIR(1) | A_BOLD);
+        mvwprintw(win, 0, 2, " SEARCH: %s (Ctrl+T) ", search_mode_names[search_mode]);
+        wattroff(win, COLOR_PAIR(1) | A_BOLD);
+
+        // Search input
+        wattron(win, COLOR_PAIR(3) | A_BOLD);
+        mvwprintw(win, 1, 2, "> %s", query);
+        wattroff(win, COLOR_PAIR(3) | A_BOLD);
+
+        // Separator
+        mvwhline(win, 2, 1, ACS_HLINE, win_width - 2);
+
+        // Results: whatever the worker has published for this query so far
+        int result_height = win_height - 5;
+        char index_note[sizeof(index_error)] = "";
+        if (index_enabled) {
+            pthread_mutex_lock(&index_error_lock);
+            snprintf(index_note, sizeof(index_note), "%s", index_error);
+            pthread_mutex_unlock(&index_error_lock);
+        }
+        pthread_mutex_lock(&search_lock);
+        int current = search_view_generation == generation;
+        int shown_count = current ? search_view_count : 0;
+        int total = current ? search_view_total : 0;
+        int searching = !current || !search_view_done;
+        if (search_selected >= shown_count) search_selected = shown_count > 0 ? shown_count - 1 : 0;
+
+        if (shown_count == 0 && strlen(query) > 0) {
+            wattron(win, COLOR_PAIR(3));
+            if (!searching && search_view_error[0]) {
+                mvwprintw(win, 4, 2, "Invalid %s: %s", search_mode_names[search_mode], search_view_error);
+            } else {
+                mvwprintw(win, 4, 2, searching ? "Searching..." : "No results found");
+            }
+            wattroff(win, COLOR_PAIR(3));
+        } else if (strlen(query) == 0) {
+            wattron(win, COLOR_PAIR(3));
+            mvwprintw(win, 4, 2, "Type to search...");
+            wattroff(win, COLOR_PAIR(3));
+        } else {
+            for (int i = search_scroll; i < search_scroll + result_height && i < shown_count; i++) {
+                int y = i - search_scroll + 3;
+                SearchResult *r = &search_view[i];
+
+                if (i == search_selected) {
+                    wattron(win, A_REVERSE);
+                }
+
+                // Color based on type
+                if (r->type == 0) { // folder
+                    wattron(win, COLOR_PAIR(4));
+                } else if (r->type == 1) { // filename
+                    wattron(win, COLOR_PAIR(3));
+                }
+
+                mvwprintw(win, y, 2, "%-*.*s", win_width - 4, win_width - 4, r->display);
+
+                if (r->type == 0) {
+                    wattroff(win, COLOR_PAIR(4));
+                } else if (r->type == 1) {
+                    wattroff(win, COLOR_PAIR(3));
+                }
+
+                if (i == search_selected) {
+                    wattroff(win, A_REVERSE);
+                }
+            }
+        }
+
+        if (shown_count == 0 && index_note[0]) {
+            mvwprintw(win, 5, 2, "%.*s", win_width - 4, index_note);
+        }
+
+        // Footer
+        wattron(win, COLOR_PAIR(1));
+        mvwhline(win, win_height - 2, 1, ' ', win_width - 2);
+        if (total > shown_count) {
+            mvwprintw(win, win_height - 2, 2, "Enter:Open | ESC:Close | ^G:%s | Results:%d%s (first %d shown)%s",
+                      search_ignore ? "Ignored hidden" : "Ignored shown",
+                      total, search_view_truncated ? "+" : "", shown_count, searching ? " | searching..." : "");
+        } else {
+            mvwprintw(win, win_height - 2, 2, "Enter:Open | ESC:Close | ^G:%s | Results:%d%s",
+                      search_ignore ? "Ignored hidden" : "Ignored shown",
+                      total, searching && strlen(query) > 0 ? " | searching..." : "");
+        }
+        wattroff(win, COLOR_PAIR(1));
+        pthread_mutex_unlock(&search_lock);
+
+        wrefresh(win);
+
+        int ch = wgetch(win);
+
+        switch(ch) {
+            case ERR: // tick: redraw with the latest results
+                break;
+
+            case 27: // ESC
+                running = 0;
+                break;
+
+            case KEY_BACKSPACE:
+            case 127:
+            case 8:
+                if (query_len > 0) {
+                    query[--query_len] = '\0';
+                }
+                break;
+
+            case KEY_UP:
+                if (search_selected > 0) {
+                    search_selected--;
+                    if (search_selected < search_scroll) {
+                        search_scroll = search_selected;
+                    }
+                }
+                break;
+
+            case KEY_DOWN:
+                if (search_selected < shown_count - 1) {
+                    search_selected++;
+                    if (search_selected >= search_scroll + result_height) {
+                        search_scroll = search_selected - result_height + 1;
+                    }
+                }
+                break;
+
+            case 10:
+            case 13: // Enter
+                if (shown_count > 0) {
+                    char path[MAX_PATH];
+                    pthread_mutex_lock(&search_lock);
+                    int ok = search_view_generation == generation && search_selected < search_view_count;
+                    int is_dir = ok && search_view[search_selected].is_dir;
+                    if (ok) snprintf(path, sizeof(path), "%s", search_view[search_selected].path);
+                    pthread_mutex_unlock(&search_lock);
+                    if (!ok) break;
+
+                    running = 0;
+                    delwin(win);
+                    request_search("", current_dir); // stop and let go of the results
+                    clear();
+                    refresh();
+
+                    if (is_dir) {
+                        navigate_to(path);
+                    } else {
+                        open_file(path);
+                        refresh_listing(); // Reload in case file was modified
+                    }
+                    return;
+                }
+                break;
+
+            case  18: // Ctrl+R for rename
+                if (entry_count > 0 && !is_special_entry(&entries[selected])) {
+                    rename_entry(&entries[selected]);
+                }
+                break;
+
+            case 7: // Ctrl+G: include what .gitignore/.ignore exclude, or skip it again
+                search_ignore = !search_ignore;
+                requested[0] = '\0'; // search again
+                break;
+
+            case 20: // Ctrl+T: text, terms, regex
+                search_mode = (search_mode + 1) % SEARCH_MODES;
+                requested[0] = '\0';
+                break;
+            
+            default:
+                if (ch >= 32 && ch < 127 && query_len < 255) {
+                    query[query_len++] = ch;
+                    query[query_len] = '\0';
+                }
+                break;
+        }
+    }
+
+    delwin(win);
+    request_search("", current_dir); // stop and let go of the results
+    clear();
+}
+
+#ifdef OPENFM_BENCH
+/*
+================================================================================
+                               BENCHMARKS
+================================================================================
+Built only with -DOPENFM_BENCH:
+
+  gcc -O2 -DOPENFM_BENCH openfm.c -lncurses -pthread -o openfm-bench
+  ./openfm-bench --bench listing [N ...]
+  ./openfm-bench --bench copy [small_files [big_files [big_mb]]]
+  ./openfm-bench --bench index [files]
+  ./openfm-bench --bench strstr [MB]
+  ./openfm-bench --bench scan [files [KB]]
+  ./openfm-bench --bench search [files]
+  ./openfm-bench --bench ignore [files]
+  ./openfm-bench --bench fuzzy [paths]
+  ./openfm-bench --bench patterns [MB]
+  ./openfm-bench --bench check
+
+Each benchmark builds its own fixture under $TMPDIR (default /tmp) and
+removes it afterwards.
+*/
+
+double bench_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// amount per second over ms; a run too short to time counts as one
+// microsecond, so tiny fixtures print a large rate rather than inf or 0
+double bench_rate(double amount, double ms) {
+    return amount * 1000.0 / (ms > 0.001 ? ms : 0.001);
+}
+
+// Create a scratch directory holding `count` empty files
+int bench_make_flat_dir(char *path, size_t len, long count) {
+    const char *tmp = getenv("TMPDIR");
+    snprintf(path, len, "%s/openfm-bench-XXXXXX", tmp ? tmp : "/tmp");
+    if (!mkdtemp(path)) return -1;
+
+    int dfd = open(path, O_RDONLY | O_DIRECTORY);
+    if (dfd < 0) return -1;
+    for (long i = 0; i < count; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "file_%07ld.txt", i);
+        int fd = openat(dfd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) { close(dfd); return -1; }
+        if (i % 10 == 0) write(fd, name, strlen(name));
+        close(fd);
+    }
+    close(dfd);
+    return 0;
+}
+
+void bench_remove_flat_dir(const char *path) {
+    DIR *dir = opendir(path);
+    if (dir) {
+        struct dirent *ent;
+        while ((ent = readdir(dir))) {
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+            unlinkat(dirfd(dir), ent->d_name, 0);
+        }
+        closedir(dir);
+    }
+    rmdir(path);
+}
+
+// The listing loop as it used to be: a joined path and a stat() per entry
+int bench_legacy_listing(const char *path) {
+    DIR *dir = opendir(path);
+    if (!dir) return 0;
+    int count = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        if (ent->d_name[0] == '.') continue;
+        char full_path[MAX_PATH];
+        snprintf(full_path, MAX_PATH, "%s/%s", path, ent->d_name);
+        struct stat st;
+        if (stat(full_path, &st) == 0) count++;
+    }
+    closedir(dir);
+    return count;
+}
+
+void bench_listing(long count) {
+    char path[MAX_PATH];
+    if (bench_make_flat_dir(path, sizeof(path), count) != 0) {
+        perror("bench: fixture");
+        return;
+    }
+
+    double legacy = 1e18, eager = 1e18, first = 1e18, full = 1e18, cached = 1e18;
+    size_t budget = dir_cache_budget;
+    for (int run = 0; run < 3; run++) {
+        dir_cache_budget = 0; // cold loads only
+        double t0 = bench_now_ms();
+        bench_legacy_listing(path);
+        double t1 = bench_now_ms();
+        lazy_metadata = 0;
+        load_directory(path);
+        double t2 = bench_now_ms();
+
+        // Streaming: first frame is ready once the first batch is merged
+        lazy_metadata = 1;
+        begin_directory_load(path);
+        pthread_mutex_lock(&listing_lock);
+        while (dir_loading && staged_count == 0) pthread_cond_wait(&load_cond, &listing_lock);
+        drain_staged_entries(1);
+        pthread_mutex_unlock(&listing_lock);
+        double t3 = bench_now_ms();
+        wait_for_directory_load();
+        double t4 = bench_now_ms();
+
+        // Revisit: served from the listing cache
+        dir_cache_budget = budget;
+        load_directory(path);
+        double t5 = bench_now_ms();
+
+        if (t1 - t0 < legacy) legacy = t1 - t0;
+        if (t2 - t1 < eager) eager = t2 - t1;
+        if (t3 - t2 < first) first = t3 - t2;
+        if (t4 - t2 < full) full = t4 - t2;
+        if (t5 - t4 < cached) cached = t5 - t4;
+    }
+
+    printf("listing %8ld entries: stat-per-entry %9.2f ms | eager %9.2f ms | "
+           "streaming first frame %8.2f ms, complete %9.2f ms | cached %8.2f ms\n",
+           count, legacy, eager, first, full, cached);
+    bench_remove_flat_dir(path);
+}
+
+// Run a copy or delete job to completion on the calling thread
+int bench_run_job(const char *title, void (*run)(FileJob *), void *arg) {
+    FileJob *job = new_file_job(title, run, arg);
+    if (!job) return -1;
+    file_job_thread(job);
+    int errors = job->error_count;
+    for (int i = 0; i < errors && i < JOB_MAX_ERRORS; i++) fprintf(stderr, "bench: %s\n", job->errors[i]);
+    free_file_job(job);
+    return errors;
+}
+
+// Delete name under dirfd; a name with slashes is resolved to its parent
+// first, since DeleteArgs holds a single path component
+void bench_remove_tree(int dirfd, const char *name, const char *path) {
+    DeleteArgs args;
+    int parent_fd = -1;
+    const char *slash = strrchr(name, '/');
+    if (slash) {
+        char parent[MAX_PATH];
+        int n = slash == name ? snprintf(parent, sizeof(parent), "/")
+                              : snprintf(parent, sizeof(parent), "%.*s", (int)(slash - name), name);
+        parent_fd = n >= 0 && n < (int)sizeof(parent) ? openat(dirfd, parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+        if (parent_fd < 0) {
+            fprintf(stderr, "bench: cannot remove %s: %s\n", path, strerror(n >= (int)sizeof(parent) ? ENAMETOOLONG : errno));
+            return;
+        }
+        dirfd = parent_fd;
+        name = slash + 1;
+    }
+    args.dirfd = dirfd;
+    int n = snprintf(args.name, sizeof(args.name), "%s", name);
+    int m = snprintf(args.path, sizeof(args.path), "%s", path);
+    if (n < 0 || n >= (int)sizeof(args.name) || m < 0 || m >= (int)sizeof(args.path)) {
+        fprintf(stderr, "bench: cannot remove %s: %s\n", path, strerror(ENAMETOOLONG));
+    } else {
+        bench_run_job("DELETING", run_delete_job, &args);
+    }
+    if (parent_fd >= 0) close(parent_fd);
+}
+
+// Copy `name` within `root` once per thread count and report the best of two runs
+void bench_copy_tree(int root_fd, const char *root, const char *name, const char *label,
+                     long files, off_t bytes) {
+    int counts[] = { 1, 4, default_worker_count() };
+    int saved = copy_workers;
+    for (int c = 0; c < 3; c++) {
+        if (c == 2 && (counts[2] == 1 || counts[2] == 4)) break;
+        copy_workers = counts[c];
+        double best = 1e18;
+        for (int run = 0; run < 2; run++) {
+            CopyArgs args;
+            args.src_dirfd = root_fd;
+            args.dst_dirfd = root_fd;
+            snprintf(args.src_name, sizeof(args.src_name), "%s", name);
+            snprintf(args.dst_name, sizeof(args.dst_name), "%s.copy", name);
+            snprintf(args.path, sizeof(args.path), "%s/%s", root, name);
+
+            double t0 = bench_now_ms();
+            bench_run_job("COPYING", run_copy_job, &args);
+            double t1 = bench_now_ms();
+            if (t1 - t0 < best) best = t1 - t0;
+
+            char copy_path[MAX_PATH];
+            snprintf(copy_path, sizeof(copy_path), "%s/%s.copy", root, name);
+            bench_remove_tree(root_fd, args.dst_name, copy_path);
+        }
+        printf("copy %-28s threads %3d: %9.2f ms  %10.0f files/s  %8.1f MB/s\n",
+               label, counts[c], best, bench_rate(files, best), bench_rate(bytes / 1048576.0, best));
+    }
+    copy_workers = saved;
+}
+
+void bench_copy(long small_files, long big_files, long big_mb) {
+    const char *tmp = getenv("TMPDIR");
+    char root[MAX_PATH];
+    snprintf(root, sizeof(root), "%s/openfm-bench-XXXXXX", tmp ? tmp : "/tmp");
+    if (!mkdtemp(root)) {
+        perror("bench: fixture");
+        return;
+    }
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY);
+    if (root_fd < 0) {
+        perror("bench: fixture");
+        return;
+    }
+
+    // Many small files, 1000 to a directory
+    char buf[4096];
+    memset(buf, 'x', sizeof(buf));
+    mkdirat(root_fd, "small", 0755);
+    for (long i = 0; i < small_files; i++) {
+        char name[64];
+        if (i % 1000 == 0) {
+            snprintf(name, sizeof(name), "small/d%05ld", i / 1000);
+            mkdirat(root_fd, name, 0755);
+        }
+        snprintf(name, sizeof(name), "small/d%05ld/f%07ld", i / 1000, i);
+        int fd = openat(root_fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) continue;
+        write(fd, buf, 512 + i % 3584);
+        close(fd);
+    }
+
+    // A few large files
+    mkdirat(root_fd, "big", 0755);
+    void *block = malloc(COPY_BUF);
+    if (block) memset(block, 'y', COPY_BUF);
+    for (long i = 0; i < big_files && block; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "big/f%03ld", i);
+        int fd = openat(root_fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) continue;
+        for (long mb = 0; mb < big_mb; mb++) write(fd, block, COPY_BUF);
+        close(fd);
+    }
+    free(block);
+
+    char label[64];
+    snprintf(label, sizeof(label), "%ld small files", small_files);
+    bench_copy_tree(root_fd, root, "small", label, small_files, 0);
+    snprintf(label, sizeof(label), "%ld x %ld MB files", big_files, big_mb);
+    bench_copy_tree(root_fd, root, "big", label, big_files, (off_t)big_files * big_mb << 20);
+
+    static const char *parts[] = { "small", "big" };
+    for (int i = 0; i < 2; i++) {
+        char path[MAX_PATH];
+        int n = snprintf(path, sizeof(path), "%s/%s", root, parts[i]);
+        bench_remove_tree(root_fd, parts[i], n >= 0 && n < (int)sizeof(path) ? path : parts[i]);
+    }
+    close(root_fd);
+    rmdir(root);
+}
+
+// Tree of `count` text files, 100 per folder, three levels deep; file i holds
+// the token "marker<i>" so every query below has a known handful of hits
+int bench_make_text_tree(char *root, size_t len, long count) {
+    static const char *words[] = { "alpha", "beta", "gamma", "delta", "search", "index", "buffer",
+                                   "window", "return", "struct", "static", "const", "while", "printf" };
+    const char *tmp = getenv("TMPDIR");
+    snprintf(root, len, "%s/openfm-bench-XXXXXX", tmp ? tmp : "/tmp");
+    if (!mkdtemp(root)) return -1;
+
+    char path[MAX_PATH], text[4096];
+    unsigned seed = 1;
+    for (long i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s/d%02ld", root, i / 10000);
+        mkdir(path, 0755);
+        snprintf(path, sizeof(path), "%s/d%02ld/s%03ld", root, i / 10000, i / 100 % 100);
+        mkdir(path, 0755);
+        snprintf(path, sizeof(path), "%s/d%02ld/s%03ld/file%07ld.c", root, i / 10000, i / 100 % 100, i);
+
+        size_t n = 0;
+        while (n < sizeof(text) - 64) {
+            seed = seed * 1103515245 + 12345;
+            n += snprintf(text + n, sizeof(text) - n, "%s%c", words[(seed >> 16) % 14], (seed >> 8) % 9 ? ' ' : '\n');
+        }
+        n += snprintf(text + n, sizeof(text) - n, "\nmarker%ld\n", i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return -1;
+        write(fd, text, n);
+        close(fd);
+    }
+    return 0;
+}
+
+void bench_index(long count) {
+    char root[MAX_PATH];
+    if (bench_make_text_tree(root, sizeof(root), count) != 0) {
+        perror("bench: fixture");
+        return;
+    }
+    // Keep the index out of the user's cache
+    char cache[MAX_PATH];
+    int n = snprintf(cache, sizeof(cache), "%s/.cache", root);
+    if (n < 0 || n >= (int)sizeof(cache)) {
+        fprintf(stderr, "bench: fixture: %s\n", strerror(ENAMETOOLONG));
+        bench_remove_tree(AT_FDCWD, root, root);
+        return;
+    }
+    mkdir(cache, 0700);
+    setenv("XDG_CACHE_HOME", cache, 1);
+    snprintf(current_dir, sizeof(current_dir), "%s", root);
+
+    const char *queries[] = { "marker4242", "MARKER77", "gamma delta", "printf" };
+    int walk_hits[4];
+    double walk[4], indexed[4];
+
+    index_enabled = 0;
+    for (int q = 0; q < 4; q++) {
+        double t0 = bench_now_ms();
+        search_query[0] = '\0'; // no refining between benchmark queries
+        perform_search(queries[q], current_dir, search_mode, search_ignore);
+        walk[q] = bench_now_ms() - t0;
+        walk_hits[q] = search_result_count;
+    }
+
+    index_enabled = 1;
+    double t0 = bench_now_ms();
+    index_prepare(current_dir);
+    for (int running = 1; running; ) {
+        usleep(1000);
+        pthread_mutex_lock(&index_lock);
+        running = index_worker_running;
+        pthread_mutex_unlock(&index_lock);
+    }
+    double build = bench_now_ms() - t0;
+
+    for (int q = 0; q < 4; q++) {
+        double t1 = bench_now_ms();
+        search_query[0] = '\0';
+        perform_search(queries[q], current_dir, search_mode, search_ignore);
+        indexed[q] = bench_now_ms() - t1;
+        printf("index %7ld files: %-12s walk %9.2f ms (%3d hits) | indexed %8.2f ms (%3d hits)\n",
+               count, queries[q], walk[q], walk_hits[q], indexed[q], search_result_count);
+    }
+    printf("index %7ld files: build %.2f ms\n", count, build);
 
-        // Draw window
-        werase(win);
-        box(win, 0, 0);
+    pthread_mutex_lock(&index_lock);
+    release_trigram_index(active_index);
+    active_index = NULL;
+    pthread_mutex_unlock(&index_lock);
 
-        wattron(win, COLOR_PAIR(1) | A_BOLD);
-        mvwprintw(win, 0, 2, " SEARCH ");
-        wattroff(win, COLOR_PAIR(1) | A_BOLD);
+    bench_remove_tree(AT_FDCWD, root, root);
+}
 
-        // Search input
-        wattron(win, COLOR_PAIR(3) | A_BOLD);
-        mvwprintw(win, 1, 2, "> %s", query);
-        wattroff(win, COLOR_PAIR(3) | A_BOLD);
+// case_insensitive_strstr() as it was, the reference for the kernels
+int bench_legacy_strstr(const char *haystack, const char *needle) {
+    if (!*needle) return 1;
 
-        // Separator
-        mvwhline(win, 2, 1, ACS_HLINE, win_width - 2);
+    int needle_len = strlen(needle);
+    int haystack_len = strlen(haystack);
 
-        // Results
-        int result_height = win_height - 5;
+    for (int i = 0; i <= haystack_len - needle_len; i++) {
+        int match = 1;
+        for (int j = 0; j < needle_len; j++) {
+            if (tolower(haystack[i + j]) != tolower(needle[j])) {
+                match = 0;
+                break;
+            }
+        }
+        if (match) return 1;
+    }
+    return 0;
+}
 
-        if (search_result_count == 0 && strlen(query) > 0) {
-            wattron(win, COLOR_PAIR(3));
-            mvwprintw(win, 4, 2, "No results found");
-            wattroff(win, COLOR_PAIR(3));
-        } else if (strlen(query) == 0) {
-            wattron(win, COLOR_PAIR(3));
-            mvwprintw(win, 4, 2, "Type to search...");
-            wattroff(win, COLOR_PAIR(3));
+typedef long (*FoldKernel)(const unsigned char *, size_t, const unsigned char *, size_t);
+
+// Random haystacks and needles, biased towards near misses and the bytes
+// around 'A'..'Z' and 'a'..'z' where case folding can go wrong
+long bench_differential(FoldKernel kernel, long rounds) {
+    static const char alphabet[] = "aAbBzZ@[`{01 \t\xc0\xe0\xff";
+    long failures = 0;
+    unsigned seed = 7;
+    char hay[300], needle[40];
+    for (long r = 0; r < rounds; r++) {
+        seed = seed * 1103515245 + 12345;
+        int h_len = (seed >> 8) % 299;
+        seed = seed * 1103515245 + 12345;
+        int n_len = 1 + (seed >> 8) % 12;
+        for (int i = 0; i < h_len; i++) {
+            seed = seed * 1103515245 + 12345;
+            hay[i] = alphabet[(seed >> 16) % (sizeof(alphabet) - 1)];
+        }
+        hay[h_len] = '\0';
+        seed = seed * 1103515245 + 12345;
+        if (h_len > n_len && seed % 2) {
+            // Take the needle from the haystack, flipping some cases
+            int at = (seed >> 8) % (h_len - n_len);
+            for (int i = 0; i < n_len; i++) {
+                seed = seed * 1103515245 + 12345;
+                char c = hay[at + i];
+                needle[i] = isalpha((unsigned char)c) && seed % 2 ? c ^ 0x20 : c;
+            }
         } else {
-            for (int i = search_scroll; i < search_scroll + result_height && i < search_result_count; i++) {
-                int y = i - search_scroll + 3;
-                SearchResult *r = &search_results[i];
+            for (int i = 0; i < n_len; i++) {
+                seed = seed * 1103515245 + 12345;
+                needle[i] = alphabet[(seed >> 16) % (sizeof(alphabet) - 1)];
+            }
+        }
+        needle[n_len] = '\0';
+
+        unsigned char folded[64];
+        for (int i = 0; i < n_len; i++) folded[i] = fold_table[(unsigned char)needle[i]];
+        int expect = bench_legacy_strstr(hay, needle);
+        long at = kernel((const unsigned char *)hay, h_len, folded, n_len);
+        int got = at >= 0;
+        if (got != expect || (got && !folded_equal((const unsigned char *)hay + at, folded, n_len))) {
+            if (failures++ < 5) fprintf(stderr, "mismatch: \"%s\" in \"%s\": %d vs %d\n", needle, hay, expect, got);
+        }
+    }
+    return failures;
+}
 
-                if (i == search_selected) {
-                    wattron(win, A_REVERSE);
-                }
+// len bytes of source-like words in lines of about 80 columns
+char *bench_make_text(size_t len) {
+    char *text = malloc(len + 1);
+    if (!text) return NULL;
+    static const char *words[] = { "Alpha", "beta", "GAMMA", "delta", "return", "struct", "while", "printf" };
+    unsigned seed = 3;
+    size_t n = 0, line_start = 0;
+    while (n < len) {
+        seed = seed * 1103515245 + 12345;
+        const char *w = words[(seed >> 16) % 8];
+        for (size_t i = 0; w[i] && n < len; i++) text[n++] = w[i];
+        if (n < len && n - line_start > 80) {
+            text[n++] = '\n';
+            line_start = n;
+        } else if (n < len) {
+            text[n++] = ' ';
+        }
+    }
+    text[len] = '\0';
+    return text;
+}
 
-                // Color based on type
-                if (r->type == 0) { // folder
-                    wattron(win, COLOR_PAIR(4));
-                } else if (r->type == 1) { // filename
-                    wattron(win, COLOR_PAIR(3));
-                }
+void bench_strstr(long mb) {
+    size_t len = (size_t)mb << 20;
+    char *text = bench_make_text(len);
+    if (!text) return;
+
+    struct { const char *name; FoldKernel kernel; } kernels[3] = { { "scalar", find_folded_scalar } };
+    int nkernels = 1;
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("sse2")) kernels[nkernels++] = (typeof(kernels[0])){ "sse2", find_folded_sse2 };
+    if (__builtin_cpu_supports("avx2")) kernels[nkernels++] = (typeof(kernels[0])){ "avx2", find_folded_avx2 };
+#endif
+
+    for (int k = 0; k < nkernels; k++) {
+        long failures = bench_differential(kernels[k].kernel, 2000000);
+        printf("strstr %-6s differential vs old function: %s (%ld mismatches in 2000000)\n",
+               kernels[k].name, failures ? "FAILED" : "ok", failures);
+    }
 
-                mvwprintw(win, y, 2, "%-*.*s", win_width - 4, win_width - 4, r->display);
+    // Line by line, as search_in_file() calls it; the needle never matches
+    const char *needle = "Zyzzyva";
+    char *copy = strdup(text);
+    double t0 = bench_now_ms();
+    long hits = 0;
+    for (char *line = strtok(copy, "\n"); line; line = strtok(NULL, "\n")) hits += bench_legacy_strstr(line, needle);
+    double legacy = bench_now_ms() - t0;
+    free(copy);
+    copy = strdup(text);
+    t0 = bench_now_ms();
+    for (char *line = strtok(copy, "\n"); line; line = strtok(NULL, "\n")) hits += case_insensitive_strstr(line, needle);
+    double current = bench_now_ms() - t0;
+    free(copy);
+    printf("strstr per line   old %8.2f ms (%7.0f MB/s) | %s %8.2f ms (%7.0f MB/s)\n",
+           legacy, bench_rate(mb, legacy), find_folded_name, current, bench_rate(mb, current));
+
+    // One pass over the whole buffer per kernel
+    unsigned char folded[16];
+    size_t needle_len = strlen(needle);
+    for (size_t i = 0; i < needle_len; i++) folded[i] = fold_table[(unsigned char)needle[i]];
+    for (int k = 0; k < nkernels; k++) {
+        double best = 1e18;
+        for (int run = 0; run < 3; run++) {
+            t0 = bench_now_ms();
+            hits += kernels[k].kernel((const unsigned char *)text, len, folded, needle_len) >= 0;
+            double t = bench_now_ms() - t0;
+            if (t < best) best = t;
+        }
+        printf("strstr whole buffer %-6s %8.2f ms (%7.0f MB/s)\n", kernels[k].name, best, bench_rate(mb, best));
+    }
+    if (hits) printf("unexpected hits: %ld\n", hits);
+    free(text);
+}
 
-                if (r->type == 0) {
-                    wattroff(win, COLOR_PAIR(4));
-                } else if (r->type == 1) {
-                    wattroff(win, COLOR_PAIR(3));
-                }
+// One pass of each search mode over a buffer none of them matches: a
+// literal, term sets through Teddy and through Aho-Corasick alone, regexes
+void bench_patterns(long mb) {
+    size_t len = (size_t)mb << 20;
+    char *text = bench_make_text(len);
+    if (!text) return;
+    static const struct { int mode; int teddy; const char *query; } cases[] = {
+        { SEARCH_TEXT, 1, "Zyzzyva" },
+        { SEARCH_TERMS, 1, "Zyzzyva|Quokka|Jabberwock|Xylophone" },
+        { SEARCH_TERMS, 0, "Zyzzyva|Quokka|Jabberwock|Xylophone" },
+        { SEARCH_TERMS, 1, "Zyzzyva|Quokka|Jabberwock|Xylophone|Kumquat|Fjord|Sphinx|Onyx|"
+                           "Vortex|Glyph|Nymph|Crwth|Pzazz|Quixote|Jinx|Wyvern" },
+        { SEARCH_TERMS, 0, "Zyzzyva|Quokka|Jabberwock|Xylophone|Kumquat|Fjord|Sphinx|Onyx|"
+                           "Vortex|Glyph|Nymph|Crwth|Pzazz|Quixote|Jinx|Wyvern" },
+        { SEARCH_REGEX, 1, "Zyzzyva" },
+        { SEARCH_REGEX, 1, "Zyzz[a-z]+va|Quok+a|Jabber(wock|wicky)" },
+        { SEARCH_REGEX, 1, "^[[:space:]]*struct [a-z]+ [a-z]+\\(" },
+    };
+    long (*teddy)(const LiteralSet *, const unsigned char *, size_t) = teddy_kernel;
+    long hits = 0;
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        if (!cases[c].teddy) teddy_kernel = NULL;
+        SearchPattern pat;
+        char error[128];
+        int ok = compile_search_pattern(&pat, cases[c].query, cases[c].mode, error, sizeof(error));
+        teddy_kernel = teddy;
+        if (!ok) {
+            fprintf(stderr, "bench: %s: %s\n", cases[c].query, error);
+            continue;
+        }
+        double best = 1e18;
+        for (int run = 0; run < 3; run++) {
+            double t0 = bench_now_ms();
+            hits += pattern_find(&pat, text, len) >= 0;
+            double t = bench_now_ms() - t0;
+            if (t < best) best = t;
+        }
+        const char *engine = cases[c].mode != SEARCH_TERMS ? "" : pat.terms && pat.terms->teddy_bytes ? " teddy" : " aho-corasick";
+        printf("patterns %-5s%-13s %8.2f ms (%7.0f MB/s)  %.48s\n", search_mode_names[cases[c].mode], engine,
+               best, bench_rate(mb, best), cases[c].query);
+        free_search_pattern(&pat);
+    }
+    if (hits) printf("unexpected hits: %ld\n", hits);
+    free(text);
+}
 
-                if (i == search_selected) {
-                    wattroff(win, A_REVERSE);
-                }
+// The content scan as it was: fgets() into 1 KB lines
+int bench_legacy_find_in_file(const char *filepath, const char *query) {
+    FILE *f = fopen(filepath, "r");
+    if (!f) return 0;
+    char line[1024];
+    int found = 0;
+    while (fgets(line, sizeof(line), f) && !found) {
+        if (bench_legacy_strstr(line, query)) found = 1;
+    }
+    fclose(f);
+    return found;
+}
+
+// Path of bench_scan's file i under root; 0 when it does not fit
+int bench_scan_path(char *path, size_t len, const char *root, long i) {
+    int n = snprintf(path, len, "%s/file_%07ld.txt", root, i);
+    return n >= 0 && (size_t)n < len;
+}
+
+void bench_scan(long files, long kb) {
+    char root[MAX_PATH];
+    if (bench_make_flat_dir(root, sizeof(root), 0) != 0) {
+        perror("bench: fixture");
+        return;
+    }
+    char *text = malloc(kb << 10);
+    if (!text) return;
+    for (long i = 0; i < kb << 10; i++) text[i] = i % 97 == 96 ? '\n' : "abcdefghij KLMNOP"[i % 17];
+
+    char path[MAX_PATH];
+    for (long i = 0; i < files; i++) {
+        if (!bench_scan_path(path, sizeof(path), root, i)) {
+            fprintf(stderr, "bench: fixture: %s\n", strerror(ENAMETOOLONG));
+            free(text);
+            bench_remove_flat_dir(root);
+            return;
+        }
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) break;
+        write(fd, text, kb << 10);
+        close(fd);
+    }
+    free(text);
+
+    // Warm the page cache, then time a query found nowhere
+    SearchPattern pat;
+    char error[128];
+    compile_search_pattern(&pat, "Zyzzyva", SEARCH_TEXT, error, sizeof(error));
+    double best_old = 1e18, best_new = 1e18;
+    for (int run = 0; run < 3; run++) {
+        double t0 = bench_now_ms();
+        for (long i = 0; i < files && bench_scan_path(path, sizeof(path), root, i); i++) {
+            bench_legacy_find_in_file(path, "Zyzzyva");
+        }
+        double t1 = bench_now_ms();
+        for (long i = 0; i < files && bench_scan_path(path, sizeof(path), root, i); i++) {
+            char display[512];
+            find_in_file(path, &pat, path, display, sizeof(display));
+        }
+        double t2 = bench_now_ms();
+        if (t1 - t0 < best_old) best_old = t1 - t0;
+        if (t2 - t1 < best_new) best_new = t2 - t1;
+    }
+    double mb = files * kb / 1024.0;
+    printf("scan %ld x %ld KB: fgets lines %9.2f ms (%7.0f MB/s) | whole file %9.2f ms (%7.0f MB/s)\n",
+           files, kb, best_old, bench_rate(mb, best_old), best_new, bench_rate(mb, best_new));
+    bench_remove_flat_dir(root);
+}
+
+// Walked search of a text tree with 1, 4 and one-per-CPU threads
+void bench_search(long count) {
+    char root[MAX_PATH];
+    if (bench_make_text_tree(root, sizeof(root), count) != 0) {
+        perror("bench: fixture");
+        return;
+    }
+    char query[32];
+    snprintf(query, sizeof(query), "marker%ld", count / 2);
+    int counts[] = { 1, 4, default_worker_count() };
+    for (int c = 0; c < 3; c++) {
+        if (c == 2 && (counts[2] == 1 || counts[2] == 4)) break;
+        search_workers = counts[c];
+        double best = 1e18;
+        for (int run = 0; run < 3; run++) {
+            search_query[0] = '\0';
+            double t0 = bench_now_ms();
+            perform_search(query, root, search_mode, search_ignore);
+            double t = bench_now_ms() - t0;
+            if (t < best) best = t;
+        }
+        printf("search %7ld files threads %3d: %9.2f ms (%d hits)\n", count, counts[c], best, search_result_count);
+    }
+    search_workers = 0;
+    bench_remove_tree(AT_FDCWD, root, root);
+}
+
+// Walked search of a text tree whose .gitignore leaves only the first of
+// its top folders, with the rules applied and without
+void bench_ignore(long count) {
+    char root[MAX_PATH];
+    if (bench_make_text_tree(root, sizeof(root), count) != 0) {
+        perror("bench: fixture");
+        return;
+    }
+    char path[MAX_PATH];
+    int n = snprintf(path, sizeof(path), "%s/.gitignore", root);
+    FILE *f = NULL;
+    if (n < 0 || n >= (int)sizeof(path)) errno = ENAMETOOLONG;
+    else f = fopen(path, "w");
+    if (!f) {
+        perror("bench: .gitignore");
+        bench_remove_tree(AT_FDCWD, root, root);
+        return;
+    }
+    fputs("# generated\n/d*/\n!/d00/\n*.o\n", f);
+    fclose(f);
+
+    const char *query = "marker";
+    for (int use_ignore = 1; use_ignore >= 0; use_ignore--) {
+        double best = 1e18;
+        for (int run = 0; run < 3; run++) {
+            search_query[0] = '\0';
+            double t0 = bench_now_ms();
+            perform_search(query, root, search_mode, use_ignore);
+            double t = bench_now_ms() - t0;
+            if (t < best) best = t;
+        }
+        printf("ignore %7ld files, rules %-3s: %9.2f ms (%d hits)\n", count, use_ignore ? "on" : "off",
+               best, search_result_count);
+    }
+    bench_remove_tree(AT_FDCWD, root, root);
+}
+
+// Fuzzy name scoring over synthetic paths, against substring matching
+void bench_fuzzy(long count) {
+    static const char *parts[] = { "src", "lib", "include", "test", "main", "util", "buffer", "window",
+                                   "search", "index", "config", "parser", "Render", "Node", "io", "net" };
+    static const char *exts[] = { ".c", ".h", ".cpp", ".py", ".md", ".json", ".txt", "" };
+    char *names = malloc((size_t)count * 64);
+    size_t *lens = malloc((size_t)count * sizeof(size_t));
+    if (!names || !lens) {
+        perror("bench: paths");
+        free(names);
+        free(lens);
+        return;
+    }
+    unsigned seed = 7;
+    for (long i = 0; i < count; i++) {
+        char *p = names + (size_t)i * 64;
+        int n = 0;
+        for (int k = 0; k < 3; k++) {
+            seed = seed * 1103515245 + 12345;
+            n += snprintf(p + n, 64 - n, "%s%s", k ? (seed >> 20) % 2 ? "_" : "" : "", parts[(seed >> 16) % 16]);
+        }
+        seed = seed * 1103515245 + 12345;
+        n += snprintf(p + n, 64 - n, "%u%s", (seed >> 16) % 100, exts[(seed >> 24) % 8]);
+        lens[i] = n;
+    }
+
+    const char *queries[] = { "main", "bufwin", "srcRN", "zzq", "indexparser" };
+    for (int q = 0; q < 5; q++) {
+        FuzzyPattern p;
+        fuzzy_compile(&p, queries[q]);
+        long fuzzy_hits = 0, sub_hits = 0;
+        double t0 = bench_now_ms();
+        for (long i = 0; i < count; i++) {
+            fuzzy_hits += fuzzy_score(&p, names + (size_t)i * 64, lens[i]) != 0;
+        }
+        double t1 = bench_now_ms();
+        for (long i = 0; i < count; i++) {
+            sub_hits += find_case_insensitive(names + (size_t)i * 64, lens[i], queries[q], strlen(queries[q])) >= 0;
+        }
+        double t2 = bench_now_ms();
+        printf("fuzzy %8ld paths: %-12s fuzzy %8.2f ms (%6.1f M/s, %7ld hits) | substring %8.2f ms (%7ld hits)\n",
+               count, queries[q], t1 - t0, count / ((t1 - t0) * 1000), fuzzy_hits, t2 - t1, sub_hits);
+    }
+    free(names);
+    free(lens);
+}
+
+// Correctness checks run by --bench check; each returns 0 when it passes
+
+// Create more files than the inotify queue holds while a listing is shown:
+// the overflow reload must enumerate again and show every one of them
+int check_watch_overflow(void) {
+    long queued = 16384;
+    FILE *f = fopen("/proc/sys/fs/inotify/max_queued_events", "r");
+    if (f) {
+        if (fscanf(f, "%ld", &queued) != 1) queued = 16384;
+        fclose(f);
+    }
+    char root[MAX_PATH];
+    if (bench_make_flat_dir(root, sizeof(root), 10) != 0) return 1;
+    if (watch_fd < 0) start_directory_watch();
+    load_directory(root);
+
+    long count = queued + 1000;
+    int dfd = open(root, O_RDONLY | O_DIRECTORY);
+    for (long i = 0; dfd >= 0 && i < count; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "flood_%07ld", i);
+        int fd = openat(dfd, name, O_WRONLY | O_CREAT, 0644);
+        if (fd >= 0) close(fd);
+    }
+    if (dfd >= 0) close(dfd);
+    apply_watch_events();
+    wait_for_directory_load();
+
+    pthread_mutex_lock(&listing_lock);
+    int shown = entry_count - first_real_entry();
+    int missing = find_entry("flood_0000000", 0) < 0 || find_entry("file_0000009.txt", 0) < 0;
+    pthread_mutex_unlock(&listing_lock);
+    if (shown != count + 10 || missing) {
+        fprintf(stderr, "watch overflow: %d entries listed, %ld on disk\n", shown, count + 10);
+    }
+    load_directory("/");
+    bench_remove_flat_dir(root);
+    return shown != count + 10 || missing;
+}
+
+// Nested bounded repeats multiply; compiling must give up, not spin
+int check_regex_blowup(void) {
+    static const char *patterns[] = { "(((){1000}){1000}){1000}", "((a?){1000}){1000}", "(((x|){1000}){1000}){1000}" };
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        const char *error = NULL;
+        double t0 = bench_now_ms();
+        Regex *re = compile_regex(patterns[i], &error);
+        double ms = bench_now_ms() - t0;
+        free_regex(re);
+        if (ms > 100) {
+            fprintf(stderr, "regex blowup: %s took %.0f ms to %s\n", patterns[i], ms, re ? "compile" : "reject");
+            failed = 1;
+        }
+    }
+    const char *error = NULL;
+    Regex *re = compile_regex("((){1000}){1000}x", &error);
+    if (!re) {
+        fprintf(stderr, "regex blowup: ((){1000}){1000}x rejected: %s\n", error);
+        failed = 1;
+    }
+    free_regex(re);
+    // Counts that would wrap to a small int must be refused, not shrunk
+    static const char *huge[] = { "a{4294967297}", "a{4294967296}b", "a{1,4294967297}", "a{99999999999999999999}" };
+    for (size_t i = 0; i < sizeof(huge) / sizeof(huge[0]); i++) {
+        re = compile_regex(huge[i], &error);
+        if (re) {
+            fprintf(stderr, "regex blowup: %s was accepted\n", huge[i]);
+            failed = 1;
+        }
+        free_regex(re);
+    }
+    return failed;
+}
+
+// UTF-16 without a BOM, ASCII alone and mixed with CJK, against binary data
+int check_classify(void) {
+    static const uint16_t ascii[] = u"plain ASCII text\nsecond line\n";
+    static const uint16_t cjk[] = u"\u4e00\u3000line \u4e00 one\u3000\u6f22\u5b57 and more text\n\u4e00\u3000two\n";
+    static const struct { const uint16_t *text; size_t units; } texts[] = {
+        { ascii, sizeof(ascii) / 2 - 1 },
+        { cjk, sizeof(cjk) / 2 - 1 },
+    };
+    int failed = 0;
+    unsigned char buf[256];
+    for (size_t i = 0; i < sizeof(texts) / sizeof(texts[0]); i++) {
+        for (int be = 0; be <= 1; be++) {
+            size_t len = texts[i].units * 2;
+            for (size_t k = 0; k < texts[i].units; k++) {
+                buf[2 * k + be] = texts[i].text[k] & 0xff;
+                buf[2 * k + !be] = texts[i].text[k] >> 8;
+            }
+            int want = be ? FILE_UTF16BE : FILE_UTF16LE;
+            int kind = classify_content(buf, len);
+            if (kind != want) {
+                fprintf(stderr, "classify: UTF-16%s text %zu classified as %d\n", be ? "BE" : "LE", i, kind);
+                failed = 1;
             }
         }
+    }
+    for (size_t k = 0; k < sizeof(buf); k++) buf[k] = k % 3 == 0 ? 0 : (unsigned char)(k * 37);
+    if (classify_content(buf, sizeof(buf)) != FILE_BINARY) {
+        fprintf(stderr, "classify: binary block not classified as binary\n");
+        failed = 1;
+    }
+    return failed;
+}
 
-        // Footer
-        wattron(win, COLOR_PAIR(1));
-        mvwhline(win, win_height - 2, 1, ' ', win_width - 2);
-        mvwprintw(win, win_height - 2, 2, "Enter:Open | ESC:Close | Results:%d", search_result_count);
-        wattroff(win, COLOR_PAIR(1));
+// Truncate a file while it is mapped: the scan must land back in the
+// caller, as it does when another process shrinks a file being searched
+int check_map_truncation(void) {
+    char path[MAX_PATH];
+    const char *tmp = getenv("TMPDIR");
+    snprintf(path, sizeof(path), "%s/openfm-bench-XXXXXX", tmp && *tmp ? tmp : "/tmp");
+    int fd = mkstemp(path);
+    if (fd < 0) return 1;
+    size_t len = SEARCH_READ_SMALL * 4;
+    char *text = bench_make_text(len);
+    int written = text && write(fd, text, len) == (ssize_t)len;
+    free(text);
+    close(fd);
+
+    volatile int faulted = 0;
+    FileView view = { 0 };
+    sigjmp_buf fault;
+    if (sigsetjmp(fault, 0)) {
+        faulted = 1;
+    } else {
+        map_fault_jmp = &fault;
+        if (written && file_view_open(&view, path) && view.map) {
+            if (truncate(path, 0) == 0) {
+                volatile char last = view.data[view.len - 1];
+                (void)last;
+            }
+        }
+    }
+    map_fault_jmp = NULL;
+    file_view_close(&view);
+    unlink(path);
+    if (!faulted) fprintf(stderr, "map truncation: reading past the new end did not fault\n");
+    return !faulted;
+}
 
-        wrefresh(win);
+// A damaged index file must be refused at load, not followed out of the
+// mapping: every path and posting offset is checked against the file
+int check_index_validation(void) {
+    char root[MAX_PATH];
+    if (bench_make_text_tree(root, sizeof(root), 200) != 0) return 1;
+    char cache[MAX_PATH], index_path[MAX_PATH];
+    // Not created here: the index code makes a missing cache directory itself
+    int n = snprintf(cache, sizeof(cache), "%s/.cache/nested", root);
+    if (n < 0 || n >= (int)sizeof(cache)) {
+        fprintf(stderr, "index validation: temporary path too long\n");
+        bench_remove_tree(AT_FDCWD, root, root);
+        return 1;
+    }
+    char *saved = getenv("XDG_CACHE_HOME") ? strdup(getenv("XDG_CACHE_HOME")) : NULL;
+    setenv("XDG_CACHE_HOME", cache, 1);
+    int failed = !index_file_path(root, index_path, sizeof(index_path));
+    if (failed) fprintf(stderr, "index validation: cannot create %s: %s\n", index_path, strerror(errno));
+
+    IndexScan scan;
+    TrigramIndex *idx = NULL;
+    if (failed || !scan_project(root, &scan)) {
+        failed = 1;
+    } else {
+        failed = !build_trigram_index(root, &scan) || !(idx = load_trigram_index(root));
+        free_scan(&scan);
+    }
+    if (idx) {
+        const IndexHeader hdr = *idx->hdr;
+        uint64_t files_at = sizeof(IndexHeader);
+        uint64_t tris_at = files_at + (uint64_t)hdr.file_count * sizeof(IndexFile) + hdr.names_len;
+        free_trigram_index(idx);
+        // A path offset past the names, a posting list past the postings,
+        // and a posting that names a file beyond the table
+        static const struct { const char *what; int part; uint64_t value; } damage[] = {
+            { "path offset", 0, 1ULL << 40 },
+            { "posting offset", 1, 1ULL << 40 },
+            { "posting count", 2, 0xffffffffULL },
+        };
+        for (size_t i = 0; i < sizeof(damage) / sizeof(damage[0]); i++) {
+            int fd = open(index_path, O_RDWR);
+            if (fd < 0) { failed = 1; break; }
+            IndexFile f;
+            IndexTrigram t;
+            off_t at = damage[i].part == 0 ? (off_t)files_at : (off_t)tris_at;
+            int ok = damage[i].part == 0 ? pread(fd, &f, sizeof(f), at) == sizeof(f) : pread(fd, &t, sizeof(t), at) == sizeof(t);
+            if (ok && damage[i].part == 0) {
+                uint64_t keep = f.name_off;
+                f.name_off = damage[i].value;
+                ok = pwrite(fd, &f, sizeof(f), at) == sizeof(f);
+                idx = load_trigram_index(root);
+                f.name_off = keep;
+                ok = ok && pwrite(fd, &f, sizeof(f), at) == sizeof(f);
+            } else if (ok) {
+                IndexTrigram keep = t;
+                if (damage[i].part == 1) t.off = damage[i].value; else t.count = (uint32_t)damage[i].value;
+                ok = pwrite(fd, &t, sizeof(t), at) == sizeof(t);
+                idx = load_trigram_index(root);
+                ok = ok && pwrite(fd, &keep, sizeof(keep), at) == sizeof(keep);
+            }
+            close(fd);
+            if (!ok || idx) {
+                fprintf(stderr, "index validation: damaged %s %s\n", damage[i].what, ok ? "was loaded" : "could not be written");
+                free_trigram_index(idx);
+                idx = NULL;
+                failed = 1;
+            }
+        }
+        idx = load_trigram_index(root);
+        if (!idx) {
+            fprintf(stderr, "index validation: the repaired index was refused\n");
+            failed = 1;
+        }
+        free_trigram_index(idx);
+    }
 
-        int ch = wgetch(win);
+    if (saved) setenv("XDG_CACHE_HOME", saved, 1); else unsetenv("XDG_CACHE_HOME");
+    free(saved);
+    bench_remove_tree(AT_FDCWD, root, root);
+    return failed;
+}
 
-        switch(ch) {
-            case 27: // ESC
-                running = 0;
-                break;
+// A move to another filesystem whose copy fails leaves the source alone and
+// nothing at the destination, so it can be retried; skipped when /dev/shm
+// is on the same filesystem as the fixture
+int check_move_cleanup(void) {
+    const char *tmp = getenv("TMPDIR");
+    char src[MAX_PATH], dst[] = "/dev/shm/openfm-check-XXXXXX";
+    snprintf(src, sizeof(src), "%s/openfm-check-XXXXXX", tmp ? tmp : "/tmp");
+    if (!mkdtemp(src)) return 1;
+    struct stat s_st, d_st;
+    if (!mkdtemp(dst)) {
+        rmdir(src);
+        return 0;
+    }
+    if (stat(src, &s_st) != 0 || stat(dst, &d_st) != 0 || s_st.st_dev == d_st.st_dev) {
+        rmdir(src);
+        rmdir(dst);
+        return 0;
+    }
 
-            case KEY_BACKSPACE:
-            case 127:
-            case 8:
-                if (query_len > 0) {
-                    query[--query_len] = '\0';
-                    search_selected = 0;
-                    search_scroll = 0;
-                }
-                break;
+    // A fifo cannot be copied, so the copy of "item" fails halfway
+    int src_fd = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int dst_fd = open(dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    mkdirat(src_fd, "item", 0755);
+    close(openat(src_fd, "item/a", O_WRONLY | O_CREAT, 0644));
+    mkfifoat(src_fd, "item/p", 0644);
+    close(openat(src_fd, "item/z", O_WRONLY | O_CREAT, 0644));
+
+    char *names[] = { "item" };
+    unsigned char is_dir[] = { 1 };
+    MoveArgs args;
+    memset(&args, 0, sizeof(args));
+    args.src_dirfd = src_fd;
+    args.dst_dirfd = dst_fd;
+    snprintf(args.src_dir, sizeof(args.src_dir), "%s", src);
+    snprintf(args.dst_dir, sizeof(args.dst_dir), "%s", dst);
+    args.names = names;
+    args.is_dir = is_dir;
+    args.count = 1;
+    FileJob *job = new_file_job("MOVING", run_move_job, &args);
+    int failed = !job;
+    if (job) {
+        file_job_thread(job);
+        struct stat st;
+        int left_behind = fstatat(dst_fd, "item", &st, AT_SYMLINK_NOFOLLOW) == 0;
+        int source_kept = fstatat(src_fd, "item/z", &st, 0) == 0;
+        if (job->error_count == 0 || atomic_load(&args.moved) != 0 || left_behind || !source_kept) {
+            fprintf(stderr, "move cleanup: %d errors, %d moved, copy %s, source %s\n", job->error_count,
+                    atomic_load(&args.moved), left_behind ? "left behind" : "removed", source_kept ? "kept" : "lost");
+            failed = 1;
+        }
+        free_file_job(job);
+    }
+    close(src_fd);
+    close(dst_fd);
+    bench_remove_tree(AT_FDCWD, src, src);
+    bench_remove_tree(AT_FDCWD, dst, dst);
+    return failed;
+}
 
-            case KEY_UP:
-                if (search_selected > 0) {
-                    search_selected--;
-                    if (search_selected < search_scroll) {
-                        search_scroll = search_selected;
-                    }
-                }
+// Results published a batch at a time must rank like a full sort of them
+int check_publish_top(void) {
+    clear_search_results();
+    unsigned seed = 7;
+    int failed = 0;
+    for (int batch = 0; batch < 20 && !failed; batch++) {
+        for (int i = 0; i < 137; i++) {
+            seed = seed * 1103515245 + 12345;
+            char display[64];
+            snprintf(display, sizeof(display), "[~] name%u", (seed >> 8) % 5000);
+            add_search_result("/x", "x", 1, 0, (int)((seed >> 20) % 9) + 1, display);
+        }
+        search_publish(1);
+        SearchResult *sorted = malloc(search_result_count * sizeof(SearchResult));
+        if (!sorted) return 1;
+        memcpy(sorted, search_results, search_result_count * sizeof(SearchResult));
+        qsort(sorted, search_result_count, sizeof(SearchResult), compare_search_results);
+        for (int i = 0; i < search_view_count; i++) {
+            if (compare_search_results(&search_view[i], &sorted[i]) != 0) {
+                fprintf(stderr, "publish top: batch %d, rank %d is %s, not %s\n", batch, i,
+                        search_view[i].display, sorted[i].display);
+                failed = 1;
                 break;
+            }
+        }
+        if (search_view_count != (search_result_count < MAX_SEARCH_RESULTS ? search_result_count : MAX_SEARCH_RESULTS)) failed = 1;
+        free(sorted);
+    }
+    clear_search_results();
+    return failed;
+}
 
-            case KEY_DOWN:
-                if (search_selected < search_result_count - 1) {
-                    search_selected++;
-                    if (search_selected >= search_scroll + result_height) {
-                        search_scroll = search_selected - result_height + 1;
-                    }
-                }
-                break;
+// A query refined from a shorter one must find what a fresh search finds
+int check_refine(void) {
+    char root[MAX_PATH];
+    if (bench_make_text_tree(root, sizeof(root), 300) != 0) return 1;
+    search_query[0] = '\0';
+    perform_search("gamma", root, SEARCH_TEXT, 0);
+    perform_search("gamma delta", root, SEARCH_TEXT, 0);
+    int refined = search_result_count;
+    search_query[0] = '\0';
+    perform_search("gamma delta", root, SEARCH_TEXT, 0);
+    int fresh = search_result_count;
+    search_query[0] = '\0';
+    bench_remove_tree(AT_FDCWD, root, root);
+    if (refined != fresh || fresh == 0) {
+        fprintf(stderr, "refine: %d results refined, %d from a fresh search\n", refined, fresh);
+        return 1;
+    }
+    return 0;
+}
 
-            case 10:
-            case 13: // Enter
-                if (search_result_count > 0) {
-                    SearchResult *r = &search_results[search_selected];
-                    running = 0;
-                    delwin(win);
-                    clear();
-                    refresh();
+int bench_check(void) {
+    static const struct { const char *name; int (*run)(void); } checks[] = {
+        { "watch overflow", check_watch_overflow },
+        { "regex blowup", check_regex_blowup },
+        { "classify", check_classify },
+        { "map truncation", check_map_truncation },
+        { "index validation", check_index_validation },
+        { "publish top", check_publish_top },
+        { "refine", check_refine },
+        { "move cleanup", check_move_cleanup },
+    };
+    int failures = 0;
+    for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+        int failed = checks[i].run() != 0;
+        printf("check %-24s %s\n", checks[i].name, failed ? "FAILED" : "ok");
+        failures += failed;
+    }
+    return failures ? 1 : 0;
+}
 
-                    if (r->is_dir) {
-                        navigate_to(r->path);
-                    } else {
-                        open_file(r->path);
-                        load_directory(current_dir); // Reload in case file was modified
-                    }
-                    return;
-                }
-                break;
+int bench_main(int argc, char *argv[]) {
+    if (argc < 1) {
+        fprintf(stderr, "usage: --bench listing [N ...] | copy [small_files [big_files [big_mb]]] | index [files] | strstr [MB] | scan [files [KB]] | search [files] | ignore [files] | fuzzy [paths] | patterns [MB] | check\n");
+        return 1;
+    }
 
-            case  18: // Ctrl+R for rename
-                if (entry_count > 0 && strcmp(entries[selected].name, "..") != 0
-                    && strcmp(entries[selected].name, "[+ New File]") != 0
-                    && strcmp(entries[selected].name, "[+ New Folder]") != 0) {
-                    rename_entry(&entries[selected]);
-                }
-                break;
-            
-            default:
-                if (ch >= 32 && ch < 127 && query_len < 255) {
-                    query[query_len++] = ch;
-                    query[query_len] = '\0';
-                    search_selected = 0;
-                    search_scroll = 0;
-                }
-                break;
+    if (strcmp(argv[0], "listing") == 0) {
+        if (argc == 1) {
+            bench_listing(10000);
+            bench_listing(100000);
+            bench_listing(1000000);
         }
+        for (int i = 1; i < argc; i++) bench_listing(atol(argv[i]));
+        return 0;
     }
 
-    delwin(win);
-    clear();
+    if (strcmp(argv[0], "check") == 0) {
+        return bench_check();
+    }
+
+    if (strcmp(argv[0], "patterns") == 0) {
+        bench_patterns(argc > 1 ? atol(argv[1]) : 256);
+        return 0;
+    }
+
+    if (strcmp(argv[0], "fuzzy") == 0) {
+        bench_fuzzy(argc > 1 ? atol(argv[1]) : 2000000);
+        return 0;
+    }
+
+    if (strcmp(argv[0], "ignore") == 0) {
+        bench_ignore(argc > 1 ? atol(argv[1]) : 100000);
+        return 0;
+    }
+
+    if (strcmp(argv[0], "search") == 0) {
+        bench_search(argc > 1 ? atol(argv[1]) : 100000);
+        return 0;
+    }
+
+    if (strcmp(argv[0], "scan") == 0) {
+        bench_scan(argc > 1 ? atol(argv[1]) : 2000, argc > 2 ? atol(argv[2]) : 256);
+        return 0;
+    }
+
+    if (strcmp(argv[0], "strstr") == 0) {
+        bench_strstr(argc > 1 ? atol(argv[1]) : 256);
+        return 0;
+    }
+
+    if (strcmp(argv[0], "index") == 0) {
+        bench_index(argc > 1 ? atol(argv[1]) : 100000);
+        return 0;
+    }
+
+    if (strcmp(argv[0], "copy") == 0) {
+        bench_copy(argc > 1 ? atol(argv[1]) : 100000,
+                   argc > 2 ? atol(argv[2]) : 4,
+                   argc > 3 ? atol(argv[3]) : 2048);
+        return 0;
+    }
+
+    fprintf(stderr, "unknown benchmark: %s\n", argv[0]);
+    return 1;
 }
+#endif
 
 int main(int argc, char *argv[]) {
-    if (argc > 1) {
-        strcpy(current_dir, argv[1]);
-    } else {
-        getcwd(current_dir, MAX_PATH);
+    init_search_kernels();
+#ifdef OPENFM_BENCH
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) return bench_main(argc - 2, argv + 2);
+#endif
+    // Parallel copies keep a directory's descriptors open while its children are in flight
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max) {
+        nofile.rlim_cur = nofile.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &nofile);
+    }
+
+    getcwd(current_dir, MAX_PATH);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--eager") == 0) {
+            lazy_metadata = 0; // stat everything up front, as before
+        } else if (strcmp(argv[i], "--cache-mb") == 0 && i + 1 < argc) {
+            dir_cache_budget = (size_t)atol(argv[++i]) << 20;
+        } else if (strcmp(argv[i], "--search-max-mb") == 0 && i + 1 < argc) {
+            search_max_file = (off_t)atol(argv[++i]) << 20;
+        } else if (strcmp(argv[i], "--search-threads") == 0 && i + 1 < argc) {
+            search_workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--index") == 0) {
+            index_enabled = 1;
+        } else if (strcmp(argv[i], "--copy-threads") == 0 && i + 1 < argc) {
+            copy_workers = atoi(argv[++i]);
+        } else {
+            strncpy(current_dir, argv[i], MAX_PATH - 1);
+        }
     }
 
     initscr();
@@ -1339,12 +7703,21 @@ int main(int argc, char *argv[]) {
 
     check_and_setup_editor();
 
-    load_directory(current_dir);
+    set_escdelay(25);
+
+    if (lazy_metadata) start_meta_worker();
+    start_directory_watch();
+    begin_directory_load(current_dir);
 
     int running = 1;
     while (running) {
+        if (listing_resort_needed) resort_listing();
         draw_ui();
-        int ch = getch();
+
+        // Wakes up for keys, directory changes and background progress
+        int ch = ui_getch();
+        if (ch == ERR) continue;
+
         int height = getmaxy(stdscr) - 3;
 
         switch(ch) {
@@ -1353,6 +7726,14 @@ int main(int argc, char *argv[]) {
                 running = 0;
                 break;
 
+            case 27: // ESC stops a directory load in progress
+                cancel_directory_load();
+                break;
+
+            case 'i':
+                show_cache_stats();
+                break;
+
             case '/':
                 show_search_ui();
                 break;
@@ -1376,14 +7757,16 @@ int main(int argc, char *argv[]) {
             case 10:
             case 13:
                 if (entry_count > 0) {
-                    if (strcmp(entries[selected].name, "[+ New File]") == 0) {
+                    char path[MAX_PATH];
+                    entry_path(&entries[selected], path, sizeof(path));
+                    if (strcmp(entry_name(&entries[selected]), "[+ New File]") == 0) {
                         create_new_file();
-                    } else if (strcmp(entries[selected].name, "[+ New Folder]") == 0) {
+                    } else if (strcmp(entry_name(&entries[selected]), "[+ New Folder]") == 0) {
                         create_new_folder();  // Add this new condition
                     } else if (entries[selected].is_dir) {
-                        navigate_to(entries[selected].path);
+                        navigate_to(path);
                     } else {
-                        open_file(entries[selected].path);
+                        open_file(path);
                     }
                 }
                 break;
@@ -1392,22 +7775,20 @@ int main(int argc, char *argv[]) {
             case 127:
             case 8:
                 if (strcmp(current_dir, "/") != 0) {
-                    navigate_to("..");
+                    char parent[MAX_PATH];
+                    snprintf(parent, sizeof(parent), "%s/..", current_dir);
+                    navigate_to(parent);
                 }
                 break;
 
             case 4: // Ctrl+D for delete
-                if (entry_count > 0 && strcmp(entries[selected].name, "..") != 0
-                    && strcmp(entries[selected].name, "[+ New File]") != 0
-                    && strcmp(entries[selected].name, "[+ New Folder]") != 0) {
+                if (entry_count > 0 && !is_special_entry(&entries[selected])) {
                     delete_entry(&entries[selected]);
                 }
                 break;
             
             case 18: // Ctrl+R for rename (18 is the ASCII code for Ctrl+R)
-                    if (entry_count > 0 && strcmp(entries[selected].name, "..") != 0
-                        && strcmp(entries[selected].name, "[+ New File]") != 0
-                        && strcmp(entries[selected].name, "[+ New Folder]") != 0) {
+                    if (entry_count > 0 && !is_special_entry(&entries[selected])) {
                         rename_entry(&entries[selected]);
                     }
                     break;
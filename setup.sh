@@ -15,7 +15,7 @@ sudo apt install -y build-essential libncurses5-dev libncursesw5-dev
 # 2. Compile the code
 echo -e "Step 2: Compiling fm.c..."
 if [ -f "fm.c" ]; then
-    gcc fm.c -o fm -lncurses
+    gcc fm.c -o fm -lncurses -pthread
     if [ $? -eq 0 ]; then
         echo -e "${GREEN}Compilation successful!${NC}"
     else